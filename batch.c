@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+
+// One byte per game, the holes of the games of a block are next to each other
+// GCC turns the operations on these vectors into the instructions of the target, and the batch
+// loop is compiled twice, for AVX2 and for the SSE2 of every x86-64 CPU, the right one being chosen
+// when the program starts. Other compilers and CPUs get a generic build of the same code
+// The alignment is given since without AVX, GCC only aligns the vectors on 16 bytes
+typedef int8_t Lanes __attribute__((vector_size(BATCH_LANES), aligned(BATCH_LANES)));
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define BATCH_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define BATCH_TARGETS
+#endif
+
+// The boards of the games of a block, comparisons give -1 in the lanes where they are true
+typedef struct
+{
+    Lanes holes[NUM_HOLES];
+    Lanes scores[2];
+    Lanes turn; // 0 or 1
+} BatchBoards;
+
+typedef struct
+{
+    BatchBoards boards;
+    Lanes playing; // -1 in the lanes that hold a game, 0 in the idle ones
+    int moves[BATCH_LANES];
+    uint64_t random[BATCH_LANES]; // Generator of the game of each lane
+} BatchBlock;
+
+// ========== Policies ==========
+// Both the batch and the scalar playouts choose the moves here, so that every game is the same
+
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Each game has its own generator, so it doesn't matter which lane plays it
+static uint64_t game_random(uint64_t seed, long game)
+{
+    uint64_t z = seed + (uint64_t)(game + 1) * 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+// Choose a move among the legal ones, bit k of legal is set if the kth hole of the side can be
+// played. With gains, only the moves that win the most seeds are kept
+// Returns the index of the hole in the side of the player to move
+static int choose_move(uint64_t *random, int legal, const int *gains)
+{
+    int candidates[NUM_HOLES / 2];
+    int count = 0;
+    int best = -1;
+    for (int k = 0; k < NUM_HOLES / 2; k++)
+    {
+        if (!(legal >> k & 1) || (gains && gains[k] < best))
+        {
+            continue;
+        }
+        if (gains && gains[k] > best)
+        {
+            best = gains[k];
+            count = 0;
+        }
+        candidates[count++] = k;
+    }
+    return candidates[((next_random(random) >> 32) * count) >> 32];
+}
+
+static void count_game(PlayoutResults *results, int score1, int score2, int finished)
+{
+    results->games++;
+    results->seeds[0] += score1;
+    results->seeds[1] += score2;
+    if (!finished)
+    {
+        results->unfinished++;
+    }
+    else if (score1 != score2)
+    {
+        results->wins[score1 > score2 ? 0 : 1]++;
+    }
+    else
+    {
+        results->draws++;
+    }
+}
+
+// ========== Batch ==========
+
+// Play a hole in every game of a block, origin holds the hole of each lane
+// Only the lanes in playing change, the same rules as apply_move apply to each of them
+// over is set to -1 in the lanes where the move ended the game
+// The vectors are passed by address, their size would make the calling convention depend on the target
+static inline __attribute__((always_inline)) void play_lanes(const BatchBoards *boards, const Lanes *origin_lanes, const Lanes *playing_lanes,
+                              BatchBoards *next, Lanes *over_lanes)
+{
+    Lanes origin = *origin_lanes;
+    Lanes playing = *playing_lanes;
+    Lanes seeds = {0};
+    for (int j = 0; j < NUM_HOLES; j++)
+    {
+        seeds |= boards->holes[j] & (origin == (int8_t)j);
+    }
+
+    // Every full lap gives a seed to each hole, then the rest go to the holes after the played one
+    Lanes laps = {0};
+    for (int lap = 1; lap * NUM_HOLES <= TOTAL_SEEDS; lap++)
+    {
+        laps -= seeds >= (int8_t)(lap * NUM_HOLES);
+    }
+    Lanes rest = seeds - laps * NUM_HOLES;
+    Lanes last = origin + rest;
+    last -= (last >= NUM_HOLES) & NUM_HOLES;
+    for (int j = 0; j < NUM_HOLES; j++)
+    {
+        Lanes distance = (int8_t)j - origin;
+        distance += (distance < 0) & NUM_HOLES;
+        Lanes sown = laps - ((distance >= 1) & (distance <= rest));
+        next->holes[j] = (boards->holes[j] & ~((origin == (int8_t)j) & playing)) + (sown & playing);
+    }
+
+    // Holes of 2 or 3 seeds are captured from the last one, going back while on the opponent's side
+    Lanes second_player = boards->turn == 1;
+    Lanes chain = {0};
+    Lanes captured = {0};
+    for (int j = NUM_HOLES - 1; j >= 0; j--)
+    {
+        Lanes opponent_side = j >= NUM_HOLES / 2 ? ~second_player : second_player;
+        Lanes holes = next->holes[j];
+        chain = opponent_side & playing & ((holes == 2) | (holes == 3)) & ((last == (int8_t)j) | chain);
+        captured += holes & chain;
+        next->holes[j] = holes & ~chain;
+    }
+    next->scores[0] = boards->scores[0] + (captured & ~second_player);
+    next->scores[1] = boards->scores[1] + (captured & second_player);
+
+    // Once a side is empty the remaining seeds go to their owner and the turn doesn't change
+    Lanes side1 = {0};
+    Lanes side2 = {0};
+    for (int j = 0; j < NUM_HOLES / 2; j++)
+    {
+        side1 += next->holes[j];
+        side2 += next->holes[j + NUM_HOLES / 2];
+    }
+    Lanes over = playing & ((side1 == 0) | (side2 == 0));
+    next->scores[0] += side1 & over;
+    next->scores[1] += side2 & over;
+    for (int j = 0; j < NUM_HOLES; j++)
+    {
+        next->holes[j] &= ~over;
+    }
+    next->turn = boards->turn ^ (playing & ~over & 1);
+    *over_lanes = over;
+}
+
+// Put a new game in a lane, or leave it idle once every game has started
+static void start_lane(BatchBlock *block, int lane, long game, long games, uint64_t seed)
+{
+    if (game >= games)
+    {
+        block->playing[lane] = 0;
+        return;
+    }
+    for (int j = 0; j < NUM_HOLES; j++)
+    {
+        block->boards.holes[j][lane] = INITIAL_SEEDS_PER_HOLE;
+    }
+    block->boards.scores[0][lane] = 0;
+    block->boards.scores[1][lane] = 0;
+    block->boards.turn[lane] = 0;
+    block->playing[lane] = -1;
+    block->moves[lane] = 0;
+    block->random[lane] = game_random(seed, game);
+}
+
+BATCH_TARGETS
+static void play_batch(BatchBlock *blocks, long games, PlayoutPolicy policy, uint64_t seed, PlayoutResults *results)
+{
+    long started = 0;
+    for (int b = 0; b < BATCH_BLOCKS; b++)
+    {
+        for (int lane = 0; lane < BATCH_LANES; lane++)
+        {
+            start_lane(&blocks[b], lane, started, games, seed);
+            started += started < games;
+        }
+    }
+
+    long finished = 0;
+    while (finished < games)
+    {
+        for (int b = 0; b < BATCH_BLOCKS; b++)
+        {
+            BatchBlock *block = &blocks[b];
+            BatchBoards *boards = &block->boards;
+            Lanes second_player = boards->turn == 1;
+            Lanes first = second_player & (NUM_HOLES / 2);
+
+            // Bit k is set in the lanes where the kth hole of the player to move can be played
+            Lanes legal = {0};
+            for (int k = 0; k < NUM_HOLES / 2; k++)
+            {
+                Lanes nonempty = (~second_player & (boards->holes[k] != 0)) |
+                                 (second_player & (boards->holes[k + NUM_HOLES / 2] != 0));
+                legal |= nonempty & (int8_t)(1 << k);
+            }
+            // The greedy policy plays every hole first to see what it wins
+            Lanes gains[NUM_HOLES / 2];
+            if (policy == PLAYOUT_GREEDY)
+            {
+                for (int k = 0; k < NUM_HOLES / 2; k++)
+                {
+                    BatchBoards after;
+                    Lanes origin = first + (int8_t)k;
+                    Lanes over;
+                    play_lanes(boards, &origin, &block->playing, &after, &over);
+                    gains[k] = ((after.scores[0] - boards->scores[0]) & ~second_player) |
+                               ((after.scores[1] - boards->scores[1]) & second_player);
+                }
+            }
+
+            Lanes origin = first;
+            int playing = 0;
+            for (int lane = 0; lane < BATCH_LANES; lane++)
+            {
+                if (!block->playing[lane])
+                {
+                    continue;
+                }
+                playing++;
+                int lane_gains[NUM_HOLES / 2];
+                for (int k = 0; policy == PLAYOUT_GREEDY && k < NUM_HOLES / 2; k++)
+                {
+                    lane_gains[k] = gains[k][lane];
+                }
+                origin[lane] += choose_move(&block->random[lane], legal[lane],
+                                            policy == PLAYOUT_GREEDY ? lane_gains : NULL);
+            }
+            if (playing == 0)
+            {
+                continue;
+            }
+
+            BatchBoards next;
+            Lanes over;
+            play_lanes(boards, &origin, &block->playing, &next, &over);
+            *boards = next;
+
+            for (int lane = 0; lane < BATCH_LANES; lane++)
+            {
+                if (!block->playing[lane])
+                {
+                    continue;
+                }
+                block->moves[lane]++;
+                results->moves++;
+                if (over[lane] || block->moves[lane] == MAX_PLAYOUT_MOVES)
+                {
+                    count_game(results, boards->scores[0][lane], boards->scores[1][lane], over[lane] != 0);
+                    finished++;
+                    start_lane(block, lane, started, games, seed);
+                    started += started < games;
+                }
+            }
+        }
+    }
+}
+
+// Play games from the start with a policy, BATCH_LANES * BATCH_BLOCKS at a time
+// The results are those of run_playouts_scalar with the same seed
+// Returns -1 if the memory can't be allocated
+int run_playouts(long games, PlayoutPolicy policy, uint64_t seed, PlayoutResults *results)
+{
+    memset(results, 0, sizeof(PlayoutResults));
+    // The vectors must be aligned on their size
+    BatchBlock *blocks = (BatchBlock *)aligned_alloc(_Alignof(BatchBlock), BATCH_BLOCKS * sizeof(BatchBlock));
+    if (!blocks)
+    {
+        perror("Failed to allocate memory for playouts");
+        return -1;
+    }
+    play_batch(blocks, games, policy, seed, results);
+    free(blocks);
+    return 0;
+}
+
+// ========== Scalar ==========
+
+// Play the same games one at a time with apply_move, to check and measure the batch playouts
+void run_playouts_scalar(long games, PlayoutPolicy policy, uint64_t seed, PlayoutResults *results)
+{
+    memset(results, 0, sizeof(PlayoutResults));
+    for (long game = 0; game < games; game++)
+    {
+        uint64_t random = game_random(seed, game);
+        PackedState state;
+        initial_packed_state(&state);
+        for (int m = 0; m < MAX_PLAYOUT_MOVES && !state.over; m++)
+        {
+            int first = state.turn * (NUM_HOLES / 2);
+            int legal = 0;
+            int gains[NUM_HOLES / 2];
+            for (int k = 0; k < NUM_HOLES / 2; k++)
+            {
+                if (state.holes[first + k] != 0)
+                {
+                    legal |= 1 << k;
+                    if (policy == PLAYOUT_GREEDY)
+                    {
+                        PackedState after = apply_move(state, first + k);
+                        gains[k] = after.scores[state.turn] - state.scores[state.turn];
+                    }
+                }
+            }
+            state = apply_move(state, first + choose_move(&random, legal, policy == PLAYOUT_GREEDY ? gains : NULL));
+            results->moves++;
+        }
+        count_game(results, state.scores[0], state.scores[1], state.over);
+    }
+}
+
+// Instructions the batch playouts run on, for the benchmarks
+const char *playout_instruction_set(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+    return __builtin_cpu_supports("avx2") ? "AVX2" : "SSE2";
+#else
+    return "generic";
+#endif
+}
@@ -0,0 +1,39 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include "board.h"
+
+// Random or greedy playouts of many games at once, for the rating and bot testing tools
+// The games are stored by hole across lanes (one byte per game), so that a move is played in
+// every game of a block by the same vector instructions: AVX2 when the CPU has it, SSE2 otherwise
+// A finished game is replaced by a new one in its lane, so the blocks stay full until the end
+#define BATCH_LANES 32
+// Blocks played together, so that BATCH_LANES * BATCH_BLOCKS games are in play at once
+#define BATCH_BLOCKS 64
+// Games still going after this many moves are stopped, they can loop forever
+#define MAX_PLAYOUT_MOVES 400
+
+typedef enum
+{
+    PLAYOUT_RANDOM = 0, // Any legal move
+    PLAYOUT_GREEDY      // A move that wins the most seeds, any of them if there are several
+} PlayoutPolicy;
+
+// Totals over all the games of a run, the same for the batch and the scalar playouts
+typedef struct
+{
+    long games;
+    long moves;
+    long wins[2];
+    long draws;
+    long unfinished;   // Stopped after MAX_PLAYOUT_MOVES moves
+    long seeds[2];     // Final scores of each player, added up
+} PlayoutResults;
+
+// Function prototypes
+int run_playouts(long games, PlayoutPolicy policy, uint64_t seed, PlayoutResults *results);
+void run_playouts_scalar(long games, PlayoutPolicy policy, uint64_t seed, PlayoutResults *results);
+const char *playout_instruction_set(void);
+
+#endif // BATCH_H
@@ -0,0 +1,67 @@
+// Benchmark of the batch playouts
+// Plays the same random and greedy games one at a time with apply_move, then in batches, reports
+// the games per second of both and checks that they end the same
+// Usage: ./bench_batch [games]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "batch.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int same_results(const PlayoutResults *a, const PlayoutResults *b)
+{
+    return a->games == b->games && a->moves == b->moves && a->wins[0] == b->wins[0] && a->wins[1] == b->wins[1] &&
+           a->draws == b->draws && a->unfinished == b->unfinished && a->seeds[0] == b->seeds[0] &&
+           a->seeds[1] == b->seeds[1];
+}
+
+// Returns 0 if both ways gave the same games
+static int compare(const char *name, long games, PlayoutPolicy policy, uint64_t seed)
+{
+    PlayoutResults scalar, batch;
+    double start = now();
+    run_playouts_scalar(games, policy, seed, &scalar);
+    double scalar_time = now() - start;
+    start = now();
+    if (run_playouts(games, policy, seed, &batch) == -1)
+    {
+        return -1;
+    }
+    double batch_time = now() - start;
+
+    printf("%-7s %12.0f %12.0f %9.2f   %.1f moves/game, player 1 won %.1f%%, %ld unfinished\n", name,
+           games / scalar_time, games / batch_time, scalar_time / batch_time, (double)batch.moves / batch.games,
+           100.0 * batch.wins[0] / batch.games, batch.unfinished);
+    if (!same_results(&scalar, &batch))
+    {
+        fprintf(stderr, "%s: the batch playouts differ, %ld moves and %ld-%ld seeds against %ld moves and %ld-%ld seeds\n",
+                name, batch.moves, batch.seeds[0], batch.seeds[1], scalar.moves, scalar.seeds[0], scalar.seeds[1]);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long games = argc > 1 ? atol(argv[1]) : 200000;
+    if (argc > 2 || games <= 0)
+    {
+        fprintf(stderr, "Usage: %s [games]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%ld games per policy, %d at a time on %s\n", games, BATCH_LANES * BATCH_BLOCKS, playout_instruction_set());
+    printf("policy  scalar games/s  batch games/s  speedup\n");
+    int errors = 0;
+    errors += compare("random", games, PLAYOUT_RANDOM, 0x5EED5EEDu) != 0;
+    errors += compare("greedy", games, PLAYOUT_GREEDY, 0x5EED5EEDu) != 0;
+    return errors > 0 ? 1 : 0;
+}
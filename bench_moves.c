@@ -0,0 +1,433 @@
+// Microbenchmark of the move kernel
+// Plays the same random games with the previous make_move, which sowed one seed at a time on the
+// int board of a Game and allocated a history node per move, and with apply_move on a packed state
+// Then tries every move of every position of those games and takes it back, on a copy of the game
+// or with do_move and undo_move, after checking do_move and undo_move against make_move, and against
+// apply_move on random boards
+// Usage: ./bench_moves [games]
+
+#include <time.h>
+#include "game.h"
+
+// Small generator so that both kernels play exactly the same games
+static uint64_t next_random(uint64_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+// Pick one of count moves without a division
+static int pick(uint64_t *seed, int count)
+{
+    return (int)(((next_random(seed) >> 32) * count) >> 32);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// make_move as it was before apply_move
+static int previous_make_move(Game *game, int player, int hole)
+{
+    int valid = is_valid_move(game, player, hole);
+    if (valid != 0)
+    {
+        return -valid;
+    }
+
+    int seeds = game->state.board[hole];
+    game->state.board[hole] = 0;
+    int position = hole;
+    while (seeds > 0)
+    {
+        position = (position + 1) % NUM_HOLES;
+        game->state.board[position]++;
+        seeds--;
+    }
+
+    int captured = 0;
+    while ((player == PLAYER1 && position >= NUM_HOLES / 2) || (player == PLAYER2 && position < NUM_HOLES / 2))
+    {
+        if (game->state.board[position] != 2 && game->state.board[position] != 3)
+        {
+            break;
+        }
+        captured += game->state.board[position];
+        game->state.board[position] = 0;
+        position = (position - 1 + NUM_HOLES) % NUM_HOLES;
+    }
+    game->state.scores[player] += captured;
+
+    add_move_to_history(game, player, hole);
+
+    if (check_game_over(game))
+    {
+        for (int i = 0; i < NUM_HOLES; i++)
+        {
+            int owner = (i < NUM_HOLES / 2) ? PLAYER1 : PLAYER2;
+            game->state.scores[owner] += game->state.board[i];
+            game->state.board[i] = 0;
+        }
+        return 1;
+    }
+    game->state.turn = 1 - game->state.turn;
+    return 0;
+}
+
+// Games can loop forever, so they are cut after this many moves
+#define MAX_GAME_MOVES 400
+
+// Play random games with the previous kernel
+// The moves are written to record when it isn't NULL, with a 255 after each game
+// Returns the number of moves played, the scores of all games are added to checksum
+static long play_previous(int games, uint64_t seed, long *checksum, uint8_t *record)
+{
+    long moves = 0;
+    for (int g = 0; g < games; g++)
+    {
+        Game *game = create_game(g, NO_USERNAME, NO_USERNAME);
+        for (int m = 0; m < MAX_GAME_MOVES; m++)
+        {
+            int legal[NUM_HOLES / 2];
+            int count = 0;
+            int first = game->state.turn * (NUM_HOLES / 2);
+            for (int hole = first; hole < first + NUM_HOLES / 2; hole++)
+            {
+                if (game->state.board[hole] != 0)
+                {
+                    legal[count++] = hole;
+                }
+            }
+            int hole = legal[pick(&seed, count)];
+            if (record)
+            {
+                *record++ = hole;
+            }
+            moves++;
+            if (previous_make_move(game, game->state.turn, hole) == 1)
+            {
+                break;
+            }
+        }
+        if (record)
+        {
+            *record++ = 255;
+        }
+        *checksum += game->state.scores[PLAYER1] * 64 + game->state.scores[PLAYER2];
+        delete_game(game);
+    }
+    return moves;
+}
+
+// Play the same games with apply_move
+static long play_packed(int games, uint64_t seed, long *checksum)
+{
+    long moves = 0;
+    for (int g = 0; g < games; g++)
+    {
+        PackedState state;
+        initial_packed_state(&state);
+        for (int m = 0; m < MAX_GAME_MOVES; m++)
+        {
+            int legal[NUM_HOLES / 2];
+            int count = legal_moves(&state, legal);
+            moves++;
+            state = apply_move(state, legal[pick(&seed, count)]);
+            if (state.over)
+            {
+                break;
+            }
+        }
+        *checksum += state.scores[0] * 64 + state.scores[1];
+    }
+    return moves;
+}
+
+// Replay recorded games with the previous kernel, without choosing the moves
+static void replay_previous(const uint8_t *record, int games, long *checksum)
+{
+    for (int g = 0; g < games; g++)
+    {
+        Game *game = create_game(g, NO_USERNAME, NO_USERNAME);
+        for (; *record != 255; record++)
+        {
+            previous_make_move(game, game->state.turn, *record);
+        }
+        record++;
+        *checksum += game->state.scores[PLAYER1] * 64 + game->state.scores[PLAYER2];
+        delete_game(game);
+    }
+}
+
+// Replay recorded games with apply_move
+static void replay_packed(const uint8_t *record, int games, long *checksum)
+{
+    for (int g = 0; g < games; g++)
+    {
+        PackedState state;
+        initial_packed_state(&state);
+        for (; *record != 255; record++)
+        {
+            state = apply_move(state, *record);
+        }
+        record++;
+        *checksum += state.scores[0] * 64 + state.scores[1];
+    }
+}
+
+static int same_state(const GameState *a, const GameState *b)
+{
+    return memcmp(a->board, b->board, sizeof(a->board)) == 0 && a->scores[PLAYER1] == b->scores[PLAYER1] &&
+           a->scores[PLAYER2] == b->scores[PLAYER2] && a->turn == b->turn && a->hash == b->hash;
+}
+
+// Replay recorded games with make_move and do_move side by side, then take every move back
+// The states must match after each move, and on the way back they must be those seen on the way
+// Returns the number of states that differ
+static long check_undo(const uint8_t *record, int games)
+{
+    long differences = 0;
+    GameState states[MAX_GAME_MOVES + 1];
+    MoveUndo undos[MAX_GAME_MOVES];
+    for (int g = 0; g < games; g++)
+    {
+        Game *game = create_game(g, NO_USERNAME, NO_USERNAME);
+        GameState state = game->state;
+        int count = 0;
+        for (; *record != 255; record++)
+        {
+            states[count] = state;
+            int over = do_move(&state, *record, &undos[count]);
+            count++;
+            differences += make_move(game, game->state.turn, *record) != over || !same_state(&state, &game->state);
+        }
+        record++;
+        while (count > 0)
+        {
+            count--;
+            undo_move(&state, &undos[count]);
+            differences += !same_state(&state, &states[count]);
+        }
+        delete_game(game);
+    }
+    return differences;
+}
+
+// Random boards of TOTAL_SEEDS seeds, with a pile of 12 or more in a hole of the player to move for
+// half of them, a board that games rarely reach: the move laps the board and can end the game
+static void random_board(uint64_t *seed, GameState *state)
+{
+    memset(state, 0, sizeof(GameState));
+    state->turn = pick(seed, 2);
+    int on_board = 1 + pick(seed, TOTAL_SEEDS);
+    int left = on_board;
+    if (left >= NUM_HOLES && pick(seed, 2))
+    {
+        int pile = NUM_HOLES + pick(seed, left - NUM_HOLES + 1);
+        state->board[state->turn * (NUM_HOLES / 2) + pick(seed, NUM_HOLES / 2)] = pile;
+        left -= pile;
+    }
+    for (; left > 0; left--)
+    {
+        state->board[pick(seed, NUM_HOLES)]++;
+    }
+    state->scores[PLAYER1] = pick(seed, TOTAL_SEEDS - on_board + 1);
+    state->scores[PLAYER2] = TOTAL_SEEDS - on_board - state->scores[PLAYER1];
+    state->hash = hash_game_state(state);
+}
+
+// Play a random legal move of random boards with do_move and apply_move, then take it back
+// The boards and hashes must match after the move, and be the same as before after undo_move
+// Returns the number of states that differ, laps is set to the number of moves of 12 seeds or more
+static long check_undo_random(int boards, uint64_t seed, long *laps)
+{
+    long differences = 0;
+    *laps = 0;
+    for (int b = 0; b < boards; b++)
+    {
+        GameState state;
+        random_board(&seed, &state);
+        PackedState packed;
+        pack_state(&state, &packed);
+        int legal[NUM_HOLES / 2];
+        int count = legal_moves(&packed, legal);
+        if (count == 0)
+        {
+            continue;
+        }
+        // The pile is played half of the time, when there is one
+        int hole = legal[pick(&seed, count)];
+        for (int i = 0; i < count; i++)
+        {
+            if (state.board[legal[i]] >= NUM_HOLES && pick(&seed, 2))
+            {
+                hole = legal[i];
+            }
+        }
+        *laps += state.board[hole] >= NUM_HOLES;
+
+        GameState before = state;
+        MoveUndo undo;
+        int over = do_move(&state, hole, &undo);
+        PackedState expected = apply_move(packed, hole);
+        PackedState played;
+        pack_state(&state, &played);
+        played.over = expected.over;
+        differences += over != expected.over || memcmp(&played, &expected, sizeof(PackedState)) != 0 ||
+                       state.hash != hash_game_state(&state);
+        undo_move(&state, &undo);
+        differences += !same_state(&state, &before);
+    }
+    return differences;
+}
+
+// Try every legal move of every position of the recorded games on a copy of the game
+// Returns the number of moves tried, the scores after them are added to checksum
+static long lookahead_copy(const uint8_t *record, int games, long *checksum)
+{
+    long tries = 0;
+    for (int g = 0; g < games; g++)
+    {
+        Game *game = create_game(g, NO_USERNAME, NO_USERNAME);
+        for (; *record != 255; record++)
+        {
+            int first = game->state.turn * (NUM_HOLES / 2);
+            for (int hole = first; hole < first + NUM_HOLES / 2; hole++)
+            {
+                if (game->state.board[hole] != 0)
+                {
+                    Game copy = *game;
+                    make_move(&copy, copy.state.turn, hole);
+                    *checksum += copy.state.scores[PLAYER1] * 64 + copy.state.scores[PLAYER2];
+                    // Only the history node of the move belongs to the copy
+                    free(copy.move_history);
+                    tries++;
+                }
+            }
+            make_move(game, game->state.turn, *record);
+        }
+        record++;
+        delete_game(game);
+    }
+    return tries;
+}
+
+// Try the same moves with do_move and undo_move
+static long lookahead_undo(const uint8_t *record, int games, long *checksum)
+{
+    long tries = 0;
+    for (int g = 0; g < games; g++)
+    {
+        Game *game = create_game(g, NO_USERNAME, NO_USERNAME);
+        GameState state = game->state;
+        delete_game(game);
+        MoveUndo undo;
+        for (; *record != 255; record++)
+        {
+            int first = state.turn * (NUM_HOLES / 2);
+            for (int hole = first; hole < first + NUM_HOLES / 2; hole++)
+            {
+                if (state.board[hole] != 0)
+                {
+                    do_move(&state, hole, &undo);
+                    *checksum += state.scores[PLAYER1] * 64 + state.scores[PLAYER2];
+                    undo_move(&state, &undo);
+                    tries++;
+                }
+            }
+            do_move(&state, *record, &undo);
+        }
+        record++;
+    }
+    return tries;
+}
+
+int main(int argc, char **argv)
+{
+    int games = argc > 1 ? atoi(argv[1]) : 200000;
+    if (games <= 0)
+    {
+        fprintf(stderr, "Usage: %s [games]\n", argv[0]);
+        return 1;
+    }
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+
+    uint8_t *record = (uint8_t *)malloc((size_t)games * (MAX_GAME_MOVES + 1));
+    if (!record)
+    {
+        perror("Failed to allocate memory for the recorded games");
+        return 1;
+    }
+
+    // Random playouts, the moves are chosen as the games go
+    long previous_checksum = 0;
+    double start = now();
+    long previous_moves = play_previous(games, seed, &previous_checksum, NULL);
+    double previous_time = now() - start;
+
+    long packed_checksum = 0;
+    start = now();
+    long packed_moves = play_packed(games, seed, &packed_checksum);
+    double packed_time = now() - start;
+
+    printf("%d games, %ld moves\n", games, packed_moves);
+    printf("Playouts  make_move (before): %6.1f M moves/s  apply_move (after): %6.1f M moves/s\n",
+           previous_moves / previous_time / 1e6, packed_moves / packed_time / 1e6);
+
+    // Replays of the same games, only the kernels are measured
+    long recorded_checksum = 0;
+    play_previous(games, seed, &recorded_checksum, record);
+    long previous_replay_checksum = 0;
+    start = now();
+    replay_previous(record, games, &previous_replay_checksum);
+    double previous_replay_time = now() - start;
+
+    long packed_replay_checksum = 0;
+    start = now();
+    replay_packed(record, games, &packed_replay_checksum);
+    double packed_replay_time = now() - start;
+
+    printf("Replays   make_move (before): %6.1f M moves/s  apply_move (after): %6.1f M moves/s\n",
+           packed_moves / previous_replay_time / 1e6, packed_moves / packed_replay_time / 1e6);
+
+    // Lookahead from every position, each move is taken back
+    long undo_differences = check_undo(record, games);
+    long laps;
+    long random_differences = check_undo_random(games, seed, &laps);
+    printf("do_move/undo_move checked on %d random boards, %ld of them playing 12 seeds or more\n", games, laps);
+    long copy_checksum = 0;
+    start = now();
+    long tries = lookahead_copy(record, games, &copy_checksum);
+    double copy_time = now() - start;
+
+    long undo_checksum = 0;
+    start = now();
+    lookahead_undo(record, games, &undo_checksum);
+    double undo_time = now() - start;
+
+    printf("Lookahead copy + make_move (before): %6.1f M moves/s  do_move/undo_move (after): %6.1f M moves/s\n",
+           tries / copy_time / 1e6, tries / undo_time / 1e6);
+    free(record);
+
+    if (undo_differences != 0 || random_differences != 0 || undo_checksum != copy_checksum)
+    {
+        fprintf(stderr, "do_move and undo_move disagree: %ld states of the games and %ld random boards differ, "
+                        "checksum %ld against %ld\n",
+                undo_differences, random_differences, undo_checksum, copy_checksum);
+        return 1;
+    }
+
+    if (previous_moves != packed_moves || previous_checksum != packed_checksum ||
+        previous_replay_checksum != previous_checksum || packed_replay_checksum != previous_checksum)
+    {
+        fprintf(stderr, "The kernels disagree: %ld moves, checksum %ld, against %ld moves, checksum %ld\n",
+                previous_moves, previous_checksum, packed_moves, packed_checksum);
+        return 1;
+    }
+    return 0;
+}
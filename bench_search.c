@@ -0,0 +1,115 @@
+// Benchmark of the parallel search
+// Searches a fixed suite of positions to the same depth with 1, 2, 4... threads sharing the
+// transposition table, and reports the time, the nodes per second and the speedup over one thread
+// Usage: ./bench_search [max_threads] [depth]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "engine.h"
+
+#define SUITE_SIZE 8
+// log2 of the number of entries of the shared table, 16 bytes each
+#define BENCH_TABLE_LOG2_ENTRIES 22
+
+// Positions of the suite, reached by playing this many random moves from the start with a fixed seed
+static const int suite_moves[SUITE_SIZE] = {0, 4, 10, 16, 24, 32, 40, 50};
+
+static uint64_t next_random(uint64_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+// Build the suite, a game that ends early stops at its last position before the end
+static void build_suite(PackedState *suite)
+{
+    for (int p = 0; p < SUITE_SIZE; p++)
+    {
+        uint64_t seed = 0x5EED0000u + p;
+        PackedState state;
+        initial_packed_state(&state);
+        for (int m = 0; m < suite_moves[p]; m++)
+        {
+            int moves[NUM_HOLES / 2];
+            int count = legal_moves(&state, moves);
+            PackedState next = apply_move(state, moves[next_random(&seed) % count]);
+            if (next.over)
+            {
+                break;
+            }
+            state = next;
+        }
+        suite[p] = state;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = argc > 1 ? atoi(argv[1]) : (cpus > 0 ? (int)cpus : 1);
+    int depth = argc > 2 ? atoi(argv[2]) : 14;
+    if (max_threads <= 0 || depth <= 0 || depth > MAX_SEARCH_DEPTH)
+    {
+        fprintf(stderr, "Usage: %s [max_threads] [depth]\n", argv[0]);
+        return 1;
+    }
+
+    PackedState suite[SUITE_SIZE];
+    build_suite(suite);
+    TranspositionTable table;
+    if (init_transposition_table(&table, BENCH_TABLE_LOG2_ENTRIES) == -1)
+    {
+        return 1;
+    }
+
+    printf("%d positions searched to depth %d, %ld CPUs\n", SUITE_SIZE, depth, cpus);
+    printf("threads      time (ms)     nodes   M nodes/s  speedup\n");
+    int values[SUITE_SIZE];
+    double single_thread_ms = 0;
+    // Powers of two, then max_threads itself
+    for (int threads = 1; threads <= max_threads;
+         threads = threads < max_threads && threads * 2 > max_threads ? max_threads : threads * 2)
+    {
+        SearchLimits limits = {depth, 0, threads};
+        long nodes = 0;
+        long elapsed_us = 0;
+        int differences = 0;
+        for (int p = 0; p < SUITE_SIZE; p++)
+        {
+            // Every search starts from an empty table, as for a new position
+            clear_transposition_table(&table);
+            SearchResult result;
+            search_best_move(&table, &suite[p], &limits, &result);
+            nodes += result.nodes;
+            elapsed_us += result.elapsed_us;
+            if (threads == 1)
+            {
+                values[p] = result.value;
+            }
+            else if (result.value != values[p])
+            {
+                differences++;
+            }
+        }
+
+        double ms = elapsed_us / 1000.0;
+        if (threads == 1)
+        {
+            single_thread_ms = ms;
+        }
+        printf("%7d  %13.1f  %9ld  %10.2f  %7.2f", threads, ms, nodes,
+               elapsed_us > 0 ? (double)nodes / elapsed_us : 0, ms > 0 ? single_thread_ms / ms : 0);
+        // The threads can fill the table in a different order, which may change the values a little
+        if (differences > 0)
+        {
+            printf("  (%d values differ from 1 thread)", differences);
+        }
+        printf("\n");
+    }
+
+    free_transposition_table(&table);
+    return 0;
+}
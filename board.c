@@ -0,0 +1,199 @@
+#include <string.h>
+#include <pthread.h>
+#include "board.h"
+
+// Sowing more seeds than there are holes goes around the board at least once, so the seeds
+// each hole receives are precomputed for every starting hole and number of seeds instead of
+// sowing them one at a time. The starting hole isn't skipped, it receives a seed on each lap
+typedef struct
+{
+    uint8_t add[NUM_HOLES]; // Seeds added to each hole
+    uint8_t last;           // Hole that receives the last seed
+} Sowing;
+
+// Keeps the 6 holes of a side from a word read at its first hole, the holes come first in memory
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SIDE_HOLES(word) ((word) & 0xFFFFFFFFFFFFull)
+#else
+#define SIDE_HOLES(word) ((word) >> 16)
+#endif
+
+static Sowing sowings[NUM_HOLES][TOTAL_SEEDS + 1];
+static pthread_once_t sowings_once = PTHREAD_ONCE_INIT;
+
+static void init_sowings(void)
+{
+    for (int hole = 0; hole < NUM_HOLES; hole++)
+    {
+        for (int seeds = NUM_HOLES; seeds <= TOTAL_SEEDS; seeds++)
+        {
+            Sowing *sowing = &sowings[hole][seeds];
+            int position = hole;
+            for (int i = 0; i < seeds; i++)
+            {
+                position = position == NUM_HOLES - 1 ? 0 : position + 1;
+                sowing->add[position]++;
+            }
+            sowing->last = position;
+        }
+    }
+}
+
+// Set up the board at the start of a game, player 1 moves first
+void initial_packed_state(PackedState *state)
+{
+    memset(state->holes, INITIAL_SEEDS_PER_HOLE, NUM_HOLES);
+    state->scores[0] = 0;
+    state->scores[1] = 0;
+    state->turn = 0;
+    state->over = 0;
+}
+
+// Check if the player to move can play a hole, holes 0-5 belong to player 1 and 6-11 to player 2
+int is_legal_move(const PackedState *state, int hole)
+{
+    int first = state->turn * (NUM_HOLES / 2);
+    return !state->over && hole >= first && hole < first + NUM_HOLES / 2 && state->holes[hole] != 0;
+}
+
+// Fill moves with the holes the player to move can play
+// Returns the number of moves, 0 once the game is over
+int legal_moves(const PackedState *state, int *moves)
+{
+    if (state->over)
+    {
+        return 0;
+    }
+    int count = 0;
+    int first = state->turn * (NUM_HOLES / 2);
+    for (int hole = first; hole < first + NUM_HOLES / 2; hole++)
+    {
+        if (state->holes[hole] != 0)
+        {
+            moves[count++] = hole;
+        }
+    }
+    return count;
+}
+
+// Play a legal move and return the resulting state, same rules as make_move
+// Nothing is allocated and the given state isn't changed, so it can be called from any thread
+PackedState apply_move(PackedState state, int hole)
+{
+    int player = state.turn;
+    int seeds = state.holes[hole];
+    state.holes[hole] = 0;
+    int position = hole;
+
+    if (seeds < NUM_HOLES)
+    {
+        // At most one seed per hole
+        while (seeds > 0)
+        {
+            position = position == NUM_HOLES - 1 ? 0 : position + 1;
+            state.holes[position]++;
+            seeds--;
+        }
+    }
+    else
+    {
+        pthread_once(&sowings_once, init_sowings);
+        const Sowing *sowing = &sowings[hole][seeds];
+        for (int i = 0; i < NUM_HOLES; i++)
+        {
+            state.holes[i] += sowing->add[i];
+        }
+        position = sowing->last;
+    }
+
+    // Capture the holes holding 2 or 3 seeds, going back from the last one while on the opponent's side
+    int opponent_first = (1 - player) * (NUM_HOLES / 2);
+    int captured = 0;
+    while (position >= opponent_first && position < opponent_first + NUM_HOLES / 2 &&
+           (state.holes[position] == 2 || state.holes[position] == 3))
+    {
+        captured += state.holes[position];
+        state.holes[position] = 0;
+        position--;
+    }
+    state.scores[player] += captured;
+
+    // The game is over once a side is empty, the remaining seeds go to the owner of their side
+    // Each side is tested at once by reading its 6 holes as part of a 64-bit word
+    uint64_t side1_word, side2_word;
+    memcpy(&side1_word, state.holes, 8);
+    memcpy(&side2_word, state.holes + NUM_HOLES / 2, 8);
+    if (SIDE_HOLES(side1_word) == 0 || SIDE_HOLES(side2_word) == 0)
+    {
+        int side1 = 0;
+        int side2 = 0;
+        for (int i = 0; i < NUM_HOLES / 2; i++)
+        {
+            side1 += state.holes[i];
+            side2 += state.holes[i + NUM_HOLES / 2];
+        }
+        state.scores[0] += side1;
+        state.scores[1] += side2;
+        memset(state.holes, 0, NUM_HOLES);
+        state.over = 1;
+        return state;
+    }
+
+    state.turn = 1 - player;
+    return state;
+}
+
+// Zobrist keys: a random number for each count of each hole and score, and one for the turn
+// The hash of a board is the xor of the keys of its counts, so equal boards have equal hashes
+static ZobristKeys keys;
+static pthread_once_t keys_once = PTHREAD_ONCE_INIT;
+
+// The keys are generated from a fixed seed, so hashes are the same in every process
+static uint64_t splitmix64(uint64_t *seed)
+{
+    uint64_t z = (*seed += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static void init_keys(void)
+{
+    uint64_t seed = 0x417761C3u;
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        for (int seeds = 0; seeds < ZOBRIST_COUNTS; seeds++)
+        {
+            keys.holes[i][seeds] = splitmix64(&seed);
+        }
+    }
+    for (int player = 0; player < 2; player++)
+    {
+        for (int seeds = 0; seeds < ZOBRIST_COUNTS; seeds++)
+        {
+            keys.scores[player][seeds] = splitmix64(&seed);
+        }
+    }
+    keys.turn = splitmix64(&seed);
+}
+
+// Keys for the boards that are updated a hole at a time
+const ZobristKeys *zobrist_keys(void)
+{
+    pthread_once(&keys_once, init_keys);
+    return &keys;
+}
+
+// Hash of a whole board, the scores and the player to move
+uint64_t zobrist_hash(const PackedState *state)
+{
+    pthread_once(&keys_once, init_keys);
+    uint64_t hash = state->turn ? keys.turn : 0;
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        hash ^= keys.holes[i][state->holes[i]];
+    }
+    hash ^= keys.scores[0][state->scores[0]];
+    hash ^= keys.scores[1][state->scores[1]];
+    return hash;
+}
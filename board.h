@@ -0,0 +1,40 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+#include <stdint.h>
+
+#define NUM_HOLES 12             // Total number of holes on the board
+#define INITIAL_SEEDS_PER_HOLE 4 // Initial seeds in each hole
+#define TOTAL_SEEDS (NUM_HOLES * INITIAL_SEEDS_PER_HOLE)
+
+// Board of a game packed in 16 bytes, so that it can be copied, compared and hashed as a whole
+// This is the form used by the engine and the analysis tools, the server keeps a GameState
+// in each game and only packs it to play a move
+// Every count fits in a byte since there are only 48 seeds
+typedef struct
+{
+    uint8_t holes[NUM_HOLES];
+    uint8_t scores[2];
+    uint8_t turn; // Player to move, 0 or 1
+    uint8_t over; // 1 once a side is empty and the remaining seeds are counted
+} PackedState;
+
+// Keys of the Zobrist hashes, there are keys for every count a byte can hold so that any
+// board can be hashed
+#define ZOBRIST_COUNTS 256
+typedef struct
+{
+    uint64_t holes[NUM_HOLES][ZOBRIST_COUNTS];
+    uint64_t scores[2][ZOBRIST_COUNTS];
+    uint64_t turn;
+} ZobristKeys;
+
+// Function prototypes
+void initial_packed_state(PackedState *state);
+int is_legal_move(const PackedState *state, int hole);
+int legal_moves(const PackedState *state, int *moves);
+PackedState apply_move(PackedState state, int hole);
+const ZobristKeys *zobrist_keys(void);
+uint64_t zobrist_hash(const PackedState *state);
+
+#endif // BOARD_H
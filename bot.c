@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "bot.h"
+#include "engine.h"
+
+// Depth and time given to each move, by level
+static const SearchLimits level_limits[BOT_MAX_LEVEL + 1] = {
+    {0, 0, 1},
+    {2, 50, 1},
+    {4, 100, 1},
+    {8, 250, 1},
+    {14, 500, 1},
+    {MAX_SEARCH_DEPTH, 1000, 1},
+};
+
+// A move to search, with a copy of the board so that the game isn't locked during the search
+typedef struct BotJob
+{
+    int game_id;
+    int version;
+    int level;
+    PackedState state;
+    struct BotJob *next;
+} BotJob;
+
+// Jobs are searched in the order they were requested
+static BotJob *queue_head = NULL;
+static BotJob *queue_tail = NULL;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static BotMoveHandler move_handler = NULL;
+// Endgames read by the searches of every worker
+static Tablebase tablebase;
+
+// Get the level of a bot from its username
+// Returns 0 if the username isn't the name of a bot
+int bot_level(const char *username)
+{
+    size_t prefix_len = strlen(BOT_PREFIX);
+    if (strncmp(username, BOT_PREFIX, prefix_len) != 0)
+    {
+        return 0;
+    }
+    const char *digits = username + prefix_len;
+    if (digits[0] < '0' + BOT_MIN_LEVEL || digits[0] > '0' + BOT_MAX_LEVEL || digits[1] != '\0')
+    {
+        return 0;
+    }
+    return digits[0] - '0';
+}
+
+// Write the username of the bot of a level, the buffer must hold USERNAME_MAX_LEN characters
+void bot_username(int level, char *username)
+{
+    sprintf(username, "%s%d", BOT_PREFIX, level);
+}
+
+// Map the endgame tablebase, before the workers start
+// Without the file the bots search the endgames like the rest of the game
+// Returns -1 if the file is invalid
+int load_bot_tablebase(const char *path)
+{
+    int result = open_tablebase(path, &tablebase);
+    if (result == -1)
+    {
+        return 0;
+    }
+    if (result == -2)
+    {
+        return -1;
+    }
+    printf("Endgame tablebase loaded, up to %d seeds\n", tablebase.max_seeds);
+    use_tablebase(&tablebase);
+    return 0;
+}
+
+// Worker thread, arg is its own transposition table, allocated by start_bots
+static void *bot_worker(void *arg)
+{
+    TranspositionTable *table = (TranspositionTable *)arg;
+    while (1)
+    {
+        pthread_mutex_lock(&queue_mutex);
+        while (!queue_head)
+        {
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        }
+        BotJob *job = queue_head;
+        queue_head = job->next;
+        if (!queue_head)
+        {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_mutex);
+
+        SearchResult result;
+        if (search_best_move(table, &job->state, &level_limits[job->level], &result) != -1)
+        {
+            move_handler(job->game_id, job->version, result.move);
+        }
+        free(job);
+    }
+    return NULL;
+}
+
+// Start the worker threads, handler plays the moves they choose
+// A worker is only started once its table is allocated, so every started worker takes jobs
+// Returns -1 if no worker could be started
+int start_bots(int workers, BotMoveHandler handler)
+{
+    move_handler = handler;
+    int started = 0;
+    for (int i = 0; i < workers; i++)
+    {
+        TranspositionTable *table = (TranspositionTable *)malloc(sizeof(TranspositionTable));
+        if (!table)
+        {
+            perror("Failed to allocate memory for bot worker");
+            break;
+        }
+        if (init_transposition_table(table, BOT_TABLE_LOG2_ENTRIES) == -1)
+        {
+            free(table);
+            break;
+        }
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, bot_worker, table) != 0)
+        {
+            perror("pthread_create");
+            free_transposition_table(table);
+            free(table);
+            break;
+        }
+        pthread_detach(tid);
+        started++;
+    }
+    return started > 0 ? 0 : -1;
+}
+
+// Queue the search of a move of a bot, the board is copied
+void request_bot_move(int game_id, int version, const PackedState *state, int level)
+{
+    BotJob *job = (BotJob *)malloc(sizeof(BotJob));
+    if (!job)
+    {
+        perror("Failed to allocate memory for bot move");
+        return;
+    }
+    job->game_id = game_id;
+    job->version = version;
+    job->level = level;
+    job->state = *state;
+    job->next = NULL;
+
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_tail)
+    {
+        queue_tail->next = job;
+    }
+    else
+    {
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
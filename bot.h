@@ -0,0 +1,28 @@
+#ifndef BOT_H
+#define BOT_H
+
+#include "board.h"
+
+// Computer opponents are virtual users named bot1 to bot5, stronger as the number grows
+// They aren't connected and have no account, their moves are searched by a pool of worker threads
+// so that the network threads never wait on the engine
+#define BOT_PREFIX "bot"
+#define BOT_MIN_LEVEL 1
+#define BOT_MAX_LEVEL 5
+#define BOT_DEFAULT_LEVEL 3
+// log2 of the number of entries of the transposition table of each worker, 16 bytes each
+#define BOT_TABLE_LOG2_ENTRIES 18
+
+// Called by a worker once it has chosen a move for a game
+// version is the number of moves of the game when the move was requested, the move must be
+// ignored if the game changed in the meantime
+typedef void (*BotMoveHandler)(int game_id, int version, int hole);
+
+// Function prototypes
+int bot_level(const char *username);
+void bot_username(int level, char *username);
+int load_bot_tablebase(const char *path);
+int start_bots(int workers, BotMoveHandler handler);
+void request_bot_move(int game_id, int version, const PackedState *state, int level);
+
+#endif // BOT_H
@@ -0,0 +1,347 @@
+// Builds the endgame tablebase by retrograde analysis
+// The boards are solved by number of seeds, from 0 up to max_seeds. A capture leads to a board
+// with fewer seeds, already solved, so only the moves that capture nothing stay within a count.
+// Within a count, the value v of a board is found from the questions "can the player to move
+// end up with at least k seeds more than the opponent": a win for k > 0 must reach a capture or
+// the end of the game, so the boards that answer yes are found backwards from the moves that leave
+// the count with enough seeds, as in a won/lost endgame. The opponent, who wants less than k,
+// answers the question for 1 - k at the same time, and playing forever is enough for it.
+// Usage: ./build_tablebase [max_seeds] [output]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "tablebase.h"
+#include "snapshot.h"
+
+// Best value of the moves that leave the count, for boards that have none
+#define NO_EXIT (-128)
+// Value of the boards not solved yet
+#define UNSOLVED (-128)
+
+// A board of a count, with the links between the boards of the count
+typedef struct
+{
+    int8_t best_exit;   // Best value of the moves that capture or end the game
+    uint8_t valid;      // Both sides hold seeds, so the game isn't over
+    uint8_t moves_left; // Moves within the count not known to lead to a yes for the other player
+    uint8_t moves;      // Moves within the count
+    uint16_t yes_level; // Moves needed to force the answer yes, 0 if not forced
+    uint16_t no_level;  // Moves needed by the opponent to force the answer no, 0 if not forced
+} Node;
+
+// Entries of all the counts, those of the counts below the current one are solved
+static TablebaseEntry *entries;
+
+// Next board of a count in the order of tablebase_index
+// Returns 0 after the last board
+static int next_board(uint8_t *holes)
+{
+    // The last hole with seeds after it gets one more, the seeds after it all go to the last hole
+    int seeds_after = holes[NUM_HOLES - 1];
+    for (int i = NUM_HOLES - 2; i >= 0; i--)
+    {
+        if (seeds_after > 0)
+        {
+            holes[i]++;
+            memset(holes + i + 1, 0, NUM_HOLES - 1 - (i + 1));
+            holes[NUM_HOLES - 1] = seeds_after - 1;
+            return 1;
+        }
+        seeds_after += holes[i];
+    }
+    return 0;
+}
+
+static void first_board(uint8_t *holes, int seeds)
+{
+    memset(holes, 0, NUM_HOLES);
+    holes[NUM_HOLES - 1] = seeds;
+}
+
+// Index of the board after a move that didn't end the game, seen by the player to move next
+static size_t child_index(const PackedState *child, int seeds)
+{
+    uint8_t holes[NUM_HOLES];
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        holes[i] = child->holes[(i + NUM_HOLES / 2) % NUM_HOLES];
+    }
+    return tablebase_index(holes, seeds);
+}
+
+// Play every move of every board of the count, to find the best value leaving the count and the
+// moves within it. The boards reached within the count get their number of predecessors counted
+// after their start, or with predecessors given, the board of the move added to their predecessors
+static void link_boards(int seeds, Node *nodes, size_t *predecessor_start, uint32_t *predecessors)
+{
+    size_t start = tablebase_layer_start(seeds);
+    uint8_t holes[NUM_HOLES];
+    first_board(holes, seeds);
+    size_t b = 0;
+    do
+    {
+        Node *node = &nodes[b];
+        int side1 = 0;
+        int side2 = 0;
+        for (int i = 0; i < NUM_HOLES / 2; i++)
+        {
+            side1 += holes[i];
+            side2 += holes[i + NUM_HOLES / 2];
+        }
+        node->valid = side1 > 0 && side2 > 0;
+        node->best_exit = NO_EXIT;
+        node->moves = 0;
+        PackedState state;
+        memcpy(state.holes, holes, NUM_HOLES);
+        state.scores[0] = 0;
+        state.scores[1] = 0;
+        state.turn = 0;
+        state.over = 0;
+        for (int hole = 0; node->valid && hole < NUM_HOLES / 2; hole++)
+        {
+            if (holes[hole] == 0)
+            {
+                continue;
+            }
+            PackedState child = apply_move(state, hole);
+            int captured = child.scores[0];
+            int value;
+            if (child.over)
+            {
+                value = child.scores[0] - child.scores[1];
+            }
+            else if (captured > 0)
+            {
+                value = captured - entries[child_index(&child, seeds - captured)].value;
+            }
+            else
+            {
+                size_t c = child_index(&child, seeds) - start;
+                if (predecessors)
+                {
+                    predecessors[predecessor_start[c]++] = b;
+                }
+                else
+                {
+                    predecessor_start[c + 1]++;
+                }
+                node->moves++;
+                continue;
+            }
+            if (value > node->best_exit)
+            {
+                node->best_exit = value;
+            }
+        }
+        b++;
+    } while (next_board(holes));
+}
+
+// Solve the boards of a count, the counts below it must be solved
+// Returns -1 if the memory can't be allocated
+static int solve_count(int seeds)
+{
+    size_t start = tablebase_layer_start(seeds);
+    size_t count = tablebase_layer_start(seeds + 1) - start;
+    Node *nodes = (Node *)malloc(count * sizeof(Node));
+    size_t *predecessor_start = (size_t *)calloc(count + 1, sizeof(size_t));
+    uint32_t *queue = (uint32_t *)malloc(2 * count * sizeof(uint32_t));
+    if (!nodes || !predecessor_start || !queue)
+    {
+        perror("Failed to allocate memory for tablebase");
+        free(nodes);
+        free(predecessor_start);
+        free(queue);
+        return -1;
+    }
+
+    // The predecessors of each board are stored after those of the boards before it
+    link_boards(seeds, nodes, predecessor_start, NULL);
+    for (size_t i = 0; i < count; i++)
+    {
+        predecessor_start[i + 1] += predecessor_start[i];
+    }
+    uint32_t *predecessors = (uint32_t *)malloc((predecessor_start[count] + 1) * sizeof(uint32_t));
+    if (!predecessors)
+    {
+        perror("Failed to allocate memory for tablebase");
+        free(nodes);
+        free(predecessor_start);
+        free(queue);
+        return -1;
+    }
+    // Filling the lists moves each start to the end of its list, which is the start of the next one
+    link_boards(seeds, nodes, predecessor_start, predecessors);
+    memmove(predecessor_start + 1, predecessor_start, count * sizeof(size_t));
+    predecessor_start[0] = 0;
+
+    TablebaseEntry *solved = entries + start;
+    for (size_t i = 0; i < count; i++)
+    {
+        solved[i].value = nodes[i].valid ? UNSOLVED : 0;
+        solved[i].distance = TABLEBASE_NO_DISTANCE;
+    }
+
+    for (int k = 1; k <= seeds; k++)
+    {
+        // The player to move answers "at least k", the opponent "at least 1 - k"
+        // A board in the queue is either a yes to "at least k" or a no to "at least 1 - k",
+        // the lowest bit tells which
+        size_t head = 0;
+        size_t tail = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            Node *node = &nodes[i];
+            node->moves_left = node->moves;
+            node->yes_level = node->valid && node->best_exit >= k;
+            node->no_level = node->valid && node->moves == 0 && node->best_exit < 1 - k;
+            if (node->yes_level)
+            {
+                queue[tail++] = i << 1;
+            }
+            else if (node->no_level)
+            {
+                queue[tail++] = i << 1 | 1;
+            }
+        }
+        // Boards come out of the queue by increasing level, so a board gets the longest level
+        // when it needs all of its moves
+        while (head < tail)
+        {
+            size_t i = queue[head] >> 1;
+            int is_no = queue[head] & 1;
+            head++;
+            for (size_t p = predecessor_start[i]; p < predecessor_start[i + 1]; p++)
+            {
+                Node *node = &nodes[predecessors[p]];
+                if (is_no && !node->yes_level)
+                {
+                    // A move to a board where the opponent can't get 1 - k gives at least k
+                    node->yes_level = nodes[i].no_level + 1;
+                    queue[tail++] = predecessors[p] << 1;
+                }
+                else if (!is_no && !node->no_level && --node->moves_left == 0 && node->best_exit < 1 - k)
+                {
+                    // Every move gives the opponent at least k
+                    node->no_level = nodes[i].yes_level + 1;
+                    queue[tail++] = predecessors[p] << 1 | 1;
+                }
+            }
+        }
+
+        // The answers only change from yes to no as k grows, so the value is the last k with a
+        // yes, or the first 1 - k without a no. Until then the distance of a board is the level
+        // of its last no
+        for (size_t i = 0; i < count; i++)
+        {
+            Node *node = &nodes[i];
+            if (node->yes_level)
+            {
+                solved[i].value = k;
+                solved[i].distance = node->yes_level < TABLEBASE_NO_DISTANCE ? node->yes_level : TABLEBASE_NO_DISTANCE - 1;
+            }
+            else if (solved[i].value == UNSOLVED)
+            {
+                if (!node->no_level)
+                {
+                    solved[i].value = 1 - k;
+                    if (k == 1)
+                    {
+                        solved[i].distance = TABLEBASE_NO_DISTANCE;
+                    }
+                }
+                else
+                {
+                    solved[i].distance = node->no_level < TABLEBASE_NO_DISTANCE ? node->no_level : TABLEBASE_NO_DISTANCE - 1;
+                }
+            }
+        }
+    }
+    // Boards where the opponent gets every seed
+    for (size_t i = 0; i < count; i++)
+    {
+        if (solved[i].value == UNSOLVED)
+        {
+            solved[i].value = -seeds;
+        }
+    }
+
+    free(nodes);
+    free(predecessor_start);
+    free(predecessors);
+    free(queue);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int max_seeds = argc > 1 ? atoi(argv[1]) : TABLEBASE_DEFAULT_SEEDS;
+    const char *path = argc > 2 ? argv[2] : GAME_DIR TABLEBASE_FILE;
+    if (argc > 3 || max_seeds <= 0 || max_seeds > TABLEBASE_MAX_SEEDS)
+    {
+        fprintf(stderr, "Usage: %s [max_seeds] [output]\n", argv[0]);
+        fprintf(stderr, "  max_seeds  Up to %d, default %d\n", TABLEBASE_MAX_SEEDS, TABLEBASE_DEFAULT_SEEDS);
+        fprintf(stderr, "  output     Default %s%s\n", GAME_DIR, TABLEBASE_FILE);
+        return 1;
+    }
+    if (argc <= 2)
+    {
+        mkdir(GAME_DIR, 0755);
+    }
+
+    size_t total = tablebase_layer_start(max_seeds + 1);
+    entries = (TablebaseEntry *)malloc(total * sizeof(TablebaseEntry));
+    if (!entries)
+    {
+        perror("Failed to allocate memory for tablebase");
+        return 1;
+    }
+    for (int seeds = 0; seeds <= max_seeds; seeds++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (solve_count(seeds) == -1)
+        {
+            free(entries);
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%2d seeds: %9zu boards in %.2f s\n", seeds, tablebase_layer_start(seeds + 1) - tablebase_layer_start(seeds),
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        fflush(stdout);
+    }
+
+    // Written next to the output, then renamed, so that a running server never maps half a file
+    TablebaseHeader header = {TABLEBASE_MAGIC, TABLEBASE_VERSION, max_seeds, 0};
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fp = fopen(tmp_path, "wb");
+    int result = 1;
+    if (!fp)
+    {
+        perror("Failed to open tablebase for writing");
+    }
+    else if (fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(entries, sizeof(TablebaseEntry), total, fp) != total)
+    {
+        perror("Failed to write tablebase");
+        fclose(fp);
+    }
+    else if (fclose(fp) != 0)
+    {
+        perror("Failed to write tablebase");
+    }
+    else if (rename(tmp_path, path) == -1)
+    {
+        perror("Failed to replace tablebase");
+    }
+    else
+    {
+        printf("%zu boards written to %s\n", total, path);
+        result = 0;
+    }
+    free(entries);
+    return result;
+}
@@ -3,6 +3,116 @@
 #include <pthread.h>
 #include "game.c"
 
+// Wire format spoken with the server, legacy only for servers predating framed messages
+WireFormat wire_format = WIRE_FRAMED;
+char username[USERNAME_MAX_LEN];
+// Both threads send messages, the resyncs come from the receiving thread
+pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Games watched by this client, kept up to date with the deltas sent by the server
+// Only used by the receiving thread
+Game **watched_games = NULL;
+size_t watched_count = 0;
+size_t watched_capacity = 0;
+
+int send_to_server(int sockfd, Message *msg)
+{
+    pthread_mutex_lock(&send_mutex);
+    int result = send_message(sockfd, msg, wire_format);
+    pthread_mutex_unlock(&send_mutex);
+    return result;
+}
+
+// Ask the server for the whole state of a watched game, when a delta is missing
+void request_resync(int sockfd, int game_id)
+{
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_TYPE_TEXT;
+    strncpy(msg.username, username, USERNAME_MAX_LEN - 1);
+    sprintf(msg.data, "/resync %d", game_id);
+    send_to_server(sockfd, &msg);
+}
+
+// Returns the slot of a watched game, or NULL if it isn't known yet
+Game **find_watched_game(int game_id)
+{
+    for (size_t i = 0; i < watched_count; i++)
+    {
+        if (watched_games[i]->game_id == game_id)
+        {
+            return &watched_games[i];
+        }
+    }
+    return NULL;
+}
+
+void print_watched_game(Game *game)
+{
+    char pretty_board[BUFFER_SIZE];
+    pretty_board_state(game, pretty_board);
+    printf("%sGame %d, move %d%s%s\n", STYLE_BOLD, game->game_id, game->move_count, COLOR_RESET, pretty_board);
+}
+
+// Replace the state of a watched game with a snapshot
+void handle_game_snapshot(const char *data)
+{
+    Game *game = game_from_snapshot(data);
+    if (!game)
+    {
+        return;
+    }
+
+    Game **slot = find_watched_game(game->game_id);
+    if (slot)
+    {
+        delete_game(*slot);
+        *slot = game;
+    }
+    else
+    {
+        if (watched_count == watched_capacity)
+        {
+            size_t capacity = watched_capacity ? watched_capacity * 2 : 4;
+            Game **games = (Game **)realloc(watched_games, capacity * sizeof(Game *));
+            if (!games)
+            {
+                perror("Failed to allocate memory for watched games");
+                delete_game(game);
+                return;
+            }
+            watched_games = games;
+            watched_capacity = capacity;
+        }
+        watched_games[watched_count++] = game;
+    }
+    print_watched_game(game);
+}
+
+// Apply a delta to a watched game, or ask for a snapshot if deltas were missed
+void handle_game_delta(int sockfd, const char *data)
+{
+    int game_id;
+    if (sscanf(data, "%d", &game_id) != 1)
+    {
+        return;
+    }
+
+    Game **slot = find_watched_game(game_id);
+    int result = slot ? apply_game_delta(*slot, data) : -2;
+    if (result == -2)
+    {
+        request_resync(sockfd, game_id);
+    }
+    else if (result == 0)
+    {
+        Game *game = *slot;
+        Player player = game->move_history->player;
+        printf("%s played hole %d.\n", username_of(game->players[player]), game->move_history->hole + 1);
+        print_watched_game(game);
+    }
+}
+
 // Thread to handle incoming messages
 void *receive_handler(void *arg)
 {
@@ -10,7 +120,7 @@ void *receive_handler(void *arg)
     Message msg;
     while (1)
     {
-        int res = receive_message(sockfd, &msg);
+        int res = receive_message(sockfd, &msg, wire_format);
         if (res == -1 || msg.type == MSG_TYPE_EXIT)
         {
             printf("%sDisconnected from server.%s\n", SERVER_ERROR_STYLE, COLOR_RESET);
@@ -37,14 +147,36 @@ void *receive_handler(void *arg)
         {
             printf("%s\n", msg.data);
         }
+        else if (msg.type == MSG_TYPE_BOARD)
+        {
+            // Only the state is needed to render the board, the game doesn't outlive the message
+            Game game;
+            if (decode_game_state(msg.data, &game) == 0)
+            {
+                char pretty_board[BUFFER_SIZE];
+                pretty_board_state(&game, pretty_board);
+                printf("%s\n", pretty_board);
+            }
+        }
         else if (msg.type == MSG_TYPE_INFO)
         {
+            // Text board, only sent by older servers
             Game *game = game_from_string(msg.data);
-
-            char pretty_board[BUFFER_SIZE];
-            pretty_board_state(game, pretty_board);
-
-            printf("%s\n", pretty_board);
+            if (game)
+            {
+                char pretty_board[BUFFER_SIZE];
+                pretty_board_state(game, pretty_board);
+                printf("%s\n", pretty_board);
+                delete_game(game);
+            }
+        }
+        else if (msg.type == MSG_TYPE_GAME_SNAPSHOT)
+        {
+            handle_game_snapshot(msg.data);
+        }
+        else if (msg.type == MSG_TYPE_GAME_DELTA)
+        {
+            handle_game_delta(sockfd, msg.data);
         }
     }
     return NULL;
@@ -54,7 +186,19 @@ int main(int argc, char **argv)
 {
     int sockfd;
     struct sockaddr_in server_addr;
-    char username[USERNAME_MAX_LEN];
+    const char *server_ip = "127.0.0.1";
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--legacy") == 0)
+        {
+            wire_format = WIRE_LEGACY;
+        }
+        else
+        {
+            server_ip = argv[i];
+        }
+    }
 
     printf("Enter username: ");
     fgets(username, USERNAME_MAX_LEN, stdin);
@@ -69,16 +213,8 @@ int main(int argc, char **argv)
 
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(PORT);
-    // Replace with server IP if needed
-    // if argc == 2, use argv[1] as server IP, else use localhost
-    if (argc == 2)
-    {
-        server_addr.sin_addr.s_addr = inet_addr(argv[1]);
-    }
-    else
-    {
-        server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    }
+    // Use the server IP given on the command line, else localhost
+    server_addr.sin_addr.s_addr = inet_addr(server_ip);
     memset(&(server_addr.sin_zero), 0, 8);
 
     if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1)
@@ -89,10 +225,11 @@ int main(int argc, char **argv)
 
     // Send username to server
     Message msg;
+    memset(&msg, 0, sizeof(msg));
     msg.type = MSG_TYPE_TEXT;
     strncpy(msg.username, username, USERNAME_MAX_LEN);
     strcpy(msg.data, "has joined the chat.");
-    if (send_message(sockfd, &msg) == -1)
+    if (send_to_server(sockfd, &msg) == -1)
     {
         perror("send_message");
         exit(1);
@@ -116,14 +253,14 @@ int main(int argc, char **argv)
         if (strcmp(input, "/exit") == 0)
         {
             msg.type = MSG_TYPE_EXIT;
-            send_message(sockfd, &msg);
+            send_to_server(sockfd, &msg);
             break;
         }
         else if (strcmp(input, "/forfeit") == 0)
         {
             msg.type = MSG_TYPE_TEXT;
             strcpy(msg.data, input);
-            if (send_message(sockfd, &msg) == -1)
+            if (send_to_server(sockfd, &msg) == -1)
             {
                 perror("send_message");
                 break;
@@ -138,7 +275,7 @@ int main(int argc, char **argv)
             {
                 continue;
             }
-            if (send_message(sockfd, &msg) == -1)
+            if (send_to_server(sockfd, &msg) == -1)
             {
                 perror("send_message");
                 break;
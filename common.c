@@ -1,14 +1,13 @@
 #include "common.h"
 
-// Send a message to the socket
-int send_message(int sockfd, Message *msg)
+// Send a whole buffer to the socket
+static int send_all(int sockfd, const char *data, int size)
 {
     int total = 0;
-    int bytes_left = sizeof(Message);
-    int n;
-    char *data = (char *)msg;
+    int bytes_left = size;
+    int n = 0;
 
-    while (total < sizeof(Message))
+    while (total < size)
     {
         n = send(sockfd, data + total, bytes_left, 0);
         if (n == -1)
@@ -22,15 +21,14 @@ int send_message(int sockfd, Message *msg)
     return n == -1 ? -1 : 0;
 }
 
-// Receive a message from the socket
-int receive_message(int sockfd, Message *msg)
+// Receive exactly size bytes from the socket
+static int receive_all(int sockfd, char *data, int size)
 {
     int total = 0;
-    int bytes_left = sizeof(Message);
-    int n;
-    char *data = (char *)msg;
+    int bytes_left = size;
+    int n = 1;
 
-    while (total < sizeof(Message))
+    while (total < size)
     {
         n = recv(sockfd, data + total, bytes_left, 0);
         if (n <= 0)
@@ -43,3 +41,163 @@ int receive_message(int sockfd, Message *msg)
 
     return n <= 0 ? -1 : 0;
 }
+
+// Serialize a message into buf, which must hold at least MAX_FRAME_SIZE bytes
+// Returns the number of bytes written
+int encode_message(const Message *msg, WireFormat format, char *buf)
+{
+    if (format == WIRE_LEGACY)
+    {
+        memcpy(buf, msg, sizeof(Message));
+        return sizeof(Message);
+    }
+
+    size_t username_len = strnlen(msg->username, USERNAME_MAX_LEN - 1);
+    // A board is binary and may contain null bytes
+    size_t data_len = msg->type == MSG_TYPE_BOARD ? BOARD_MESSAGE_SIZE : strnlen(msg->data, BUFFER_SIZE - 1);
+
+    unsigned char *header = (unsigned char *)buf;
+    header[0] = FRAME_MAGIC;
+    header[1] = PROTOCOL_VERSION;
+    header[2] = (unsigned char)msg->type;
+    header[3] = (unsigned char)username_len;
+    header[4] = (data_len >> 8) & 0xFF;
+    header[5] = data_len & 0xFF;
+    memcpy(buf + FRAME_HEADER_SIZE, msg->username, username_len);
+    memcpy(buf + FRAME_HEADER_SIZE + username_len, msg->data, data_len);
+
+    return FRAME_HEADER_SIZE + username_len + data_len;
+}
+
+// Check a frame header and get the lengths of the username and data that follow it
+// Returns -1 if the header is malformed
+static int parse_frame_header(const unsigned char *header, int *username_len, int *data_len)
+{
+    if (header[0] != FRAME_MAGIC || header[1] != PROTOCOL_VERSION)
+    {
+        return -1;
+    }
+    *username_len = header[3];
+    *data_len = (header[4] << 8) | header[5];
+    if (*username_len >= USERNAME_MAX_LEN || *data_len >= BUFFER_SIZE)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Fill a message from the fields of a frame, adding the null terminators
+static void fill_from_frame(Message *msg, const unsigned char *header, const char *body, int username_len, int data_len)
+{
+    msg->type = (MessageType)header[2];
+    memcpy(msg->username, body, username_len);
+    msg->username[username_len] = '\0';
+    memcpy(msg->data, body + username_len, data_len);
+    msg->data[data_len] = '\0';
+}
+
+// Decode a message from bytes already received
+// Returns the number of bytes consumed, 0 if the buffer doesn't hold a full message yet,
+// or -1 if the bytes are not a valid message
+int decode_message(const char *buf, size_t len, WireFormat format, Message *msg)
+{
+    if (format == WIRE_LEGACY)
+    {
+        if (len < sizeof(Message))
+        {
+            return 0;
+        }
+        memcpy(msg, buf, sizeof(Message));
+        return sizeof(Message);
+    }
+
+    if (len < FRAME_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    const unsigned char *header = (const unsigned char *)buf;
+    int username_len, data_len;
+    if (parse_frame_header(header, &username_len, &data_len) == -1)
+    {
+        return -1;
+    }
+
+    int frame_len = FRAME_HEADER_SIZE + username_len + data_len;
+    if (len < frame_len)
+    {
+        return 0;
+    }
+
+    fill_from_frame(msg, header, buf + FRAME_HEADER_SIZE, username_len, data_len);
+    return frame_len;
+}
+
+// Guess the format used by a peer from the first byte it sent
+WireFormat detect_wire_format(unsigned char first_byte)
+{
+    return first_byte == FRAME_MAGIC ? WIRE_FRAMED : WIRE_LEGACY;
+}
+
+// Send a message to the socket
+int send_message(int sockfd, Message *msg, WireFormat format)
+{
+    char buf[MAX_FRAME_SIZE];
+    int size = encode_message(msg, format, buf);
+    return send_all(sockfd, buf, size);
+}
+
+// Receive a message from the socket
+int receive_message(int sockfd, Message *msg, WireFormat format)
+{
+    if (format == WIRE_LEGACY)
+    {
+        return receive_all(sockfd, (char *)msg, sizeof(Message));
+    }
+
+    unsigned char header[FRAME_HEADER_SIZE];
+    if (receive_all(sockfd, (char *)header, FRAME_HEADER_SIZE) == -1)
+    {
+        return -1;
+    }
+
+    int username_len, data_len;
+    if (parse_frame_header(header, &username_len, &data_len) == -1)
+    {
+        return -1;
+    }
+
+    char body[USERNAME_MAX_LEN + BUFFER_SIZE];
+    if (receive_all(sockfd, body, username_len + data_len) == -1)
+    {
+        return -1;
+    }
+
+    fill_from_frame(msg, header, body, username_len, data_len);
+    return 0;
+}
+
+// FNV-1a hash of a null-terminated string
+uint32_t hash_string(const char *str)
+{
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++)
+    {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// FNV-1a hash of a block of bytes
+uint32_t hash_bytes(const void *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
@@ -10,6 +10,7 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <stdint.h>
 
 #define PORT 12345
 #define BUFFER_SIZE 2048
@@ -29,9 +30,20 @@ typedef enum
     // message for private message
     MSG_TYPE_MP,
     // message for game chat
-    MSG_TYPE_GAME
+    MSG_TYPE_GAME,
+    // Whole state of a watched game, see game_snapshot_to_string
+    MSG_TYPE_GAME_SNAPSHOT,
+    // What the last move changed in a watched game, see game_delta_to_string
+    MSG_TYPE_GAME_DELTA,
+    // Board of a game in binary, see encode_game_state
+    MSG_TYPE_BOARD
 } MessageType;
 
+// Data of a MSG_TYPE_BOARD message, a fixed layout of BOARD_MESSAGE_SIZE bytes:
+//  game_id (4 bytes, network order) | version (4 bytes, network order) | status (1 byte) | turn (1 byte)
+//  | board (1 byte per hole) | scores (1 byte per player) | usernames of both players (USERNAME_MAX_LEN bytes each, null padded)
+#define BOARD_MESSAGE_SIZE (4 + 4 + 1 + 1 + 12 + 2 + 2 * USERNAME_MAX_LEN)
+
 typedef struct
 {
     MessageType type;
@@ -39,8 +51,33 @@ typedef struct
     char data[BUFFER_SIZE];
 } Message;
 
+// How a message is laid out on the wire
+typedef enum
+{
+    // The raw Message struct, always sizeof(Message) bytes
+    WIRE_LEGACY,
+    // A header followed by the username and data without padding:
+    //  magic (1 byte) | version (1 byte) | type (1 byte) | username length (1 byte)
+    //  | data length (2 bytes, network order) | username | data
+    WIRE_FRAMED
+} WireFormat;
+
+// A legacy message starts with the low byte of its type, so it can never start with the magic byte
+#define FRAME_MAGIC 0xA5
+#define PROTOCOL_VERSION 2
+#define FRAME_HEADER_SIZE 6
+// Largest number of bytes a message can take on the wire, in any format
+#define MAX_FRAME_SIZE sizeof(Message)
+
 // Function prototypes
-int send_message(int sockfd, Message *msg);
-int receive_message(int sockfd, Message *msg);
+int send_message(int sockfd, Message *msg, WireFormat format);
+int receive_message(int sockfd, Message *msg, WireFormat format);
+int encode_message(const Message *msg, WireFormat format, char *buf);
+int decode_message(const char *buf, size_t len, WireFormat format, Message *msg);
+WireFormat detect_wire_format(unsigned char first_byte);
+
+// Hashing
+uint32_t hash_string(const char *str);
+uint32_t hash_bytes(const void *data, size_t len);
 
 #endif // COMMON_H
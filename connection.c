@@ -0,0 +1,540 @@
+#include "connection.h"
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+static size_t max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES;
+static SlowClientPolicy slow_client_policy = SLOW_CLIENT_DISCONNECT;
+
+static QueueStats stats = {0, 0, 0};
+
+// Connections waiting for their socket to become writable, handed over to the flusher thread
+static int flusher_running = 0;
+static int flusher_wake_pipe[2];
+static Connection **flusher_list = NULL;
+static size_t flusher_count = 0;
+static size_t flusher_capacity = 0;
+static pthread_mutex_t flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// ========== Connection lifetime ==========
+Connection *create_connection(int sockfd)
+{
+    Connection *conn = (Connection *)malloc(sizeof(Connection));
+    if (!conn)
+    {
+        perror("Failed to allocate memory for connection");
+        return NULL;
+    }
+    conn->sockfd = sockfd;
+    conn->format = WIRE_FRAMED;
+    conn->format_negotiated = 0;
+    conn->state = CONN_AWAIT_USERNAME;
+    conn->name_id = NO_USERNAME;
+    conn->rlen = 0;
+
+    // The caller holds the first reference
+    conn->refcount = 1;
+    conn->closed = 0;
+    conn->topics = NULL;
+    conn->topic_count = 0;
+    conn->topic_capacity = 0;
+
+    pthread_mutex_init(&conn->out_mutex, NULL);
+    conn->out.chunks = NULL;
+    conn->out.capacity = 0;
+    conn->out.head = 0;
+    conn->out.count = 0;
+    conn->out.len = 0;
+    conn->write_pending = 0;
+    conn->evicted = 0;
+    return conn;
+}
+
+void acquire_connection(Connection *conn)
+{
+    __atomic_fetch_add(&conn->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void clear_queue(OutQueue *queue);
+
+// Drop a reference, closing the socket and freeing the connection with the last one
+void release_connection(Connection *conn)
+{
+    if (__atomic_sub_fetch(&conn->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+
+    clear_queue(&conn->out);
+    close(conn->sockfd);
+    pthread_mutex_destroy(&conn->out_mutex);
+    free(conn->out.chunks);
+    free(conn->topics);
+    free(conn);
+}
+
+// ========== Shared frames ==========
+// Encode a message once, the caller holds the only reference
+// Returns NULL if the memory can't be allocated
+static SharedFrame *encode_frame(const Message *msg, WireFormat format)
+{
+    char buf[MAX_FRAME_SIZE];
+    size_t len = encode_message(msg, format, buf);
+
+    SharedFrame *frame = (SharedFrame *)malloc(sizeof(SharedFrame) + len);
+    if (!frame)
+    {
+        perror("Failed to allocate memory for outbound message");
+        return NULL;
+    }
+    frame->refcount = 1;
+    frame->len = len;
+    memcpy(frame->data, buf, len);
+    return frame;
+}
+
+static void release_frame(SharedFrame *frame)
+{
+    if (__atomic_sub_fetch(&frame->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(frame);
+    }
+}
+
+// ========== Outbound queues ==========
+void configure_outbound_queues(size_t max_bytes, SlowClientPolicy policy)
+{
+    max_queued_bytes = max_bytes;
+    slow_client_policy = policy;
+}
+
+void get_queue_stats(QueueStats *out)
+{
+    out->queued_bytes = __atomic_load_n(&stats.queued_bytes, __ATOMIC_RELAXED);
+    out->dropped_messages = __atomic_load_n(&stats.dropped_messages, __ATOMIC_RELAXED);
+    out->evictions = __atomic_load_n(&stats.evictions, __ATOMIC_RELAXED);
+}
+
+// Drop everything queued, must hold out_mutex or the last reference
+static void clear_queue(OutQueue *queue)
+{
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        release_frame(queue->chunks[(queue->head + i) % queue->capacity].frame);
+    }
+    __atomic_fetch_sub(&stats.queued_bytes, queue->len, __ATOMIC_RELAXED);
+    queue->head = 0;
+    queue->count = 0;
+    queue->len = 0;
+}
+
+// Make room for one more chunk, unwrapping the queue at the same time
+// Returns -1 if the memory can't be allocated
+static int grow_queue(OutQueue *queue)
+{
+    if (queue->count < queue->capacity)
+    {
+        return 0;
+    }
+
+    size_t capacity = queue->capacity ? queue->capacity * 2 : INITIAL_QUEUE_CHUNKS;
+    OutChunk *chunks = (OutChunk *)malloc(capacity * sizeof(OutChunk));
+    if (!chunks)
+    {
+        return -1;
+    }
+
+    // The queue is full, so its chunks wrap around at head
+    if (queue->count > 0)
+    {
+        size_t first = queue->capacity - queue->head;
+        memcpy(chunks, queue->chunks + queue->head, first * sizeof(OutChunk));
+        memcpy(chunks + first, queue->chunks, (queue->count - first) * sizeof(OutChunk));
+    }
+
+    free(queue->chunks);
+    queue->chunks = chunks;
+    queue->capacity = capacity;
+    queue->head = 0;
+    return 0;
+}
+
+// Disconnect a client that doesn't read its messages, must hold out_mutex
+static void evict_connection(Connection *conn)
+{
+    printf("Evicting slow client %s (%zu bytes queued).\n", conn->user.username, conn->out.len);
+
+    conn->evicted = 1;
+    __atomic_fetch_add(&stats.evictions, 1, __ATOMIC_RELAXED);
+    clear_queue(&conn->out);
+
+    // The reading side sees the end of the stream and closes the connection as usual
+    shutdown(conn->sockfd, SHUT_RDWR);
+}
+
+// Add a frame to the outbound queue of a connection, without writing to the socket
+// The queue takes its own reference to the frame, nothing is copied
+// Returns -1 if the frame was dropped
+static int queue_frame(Connection *conn, SharedFrame *frame)
+{
+    pthread_mutex_lock(&conn->out_mutex);
+    if (conn->closed || conn->evicted)
+    {
+        pthread_mutex_unlock(&conn->out_mutex);
+        return -1;
+    }
+
+    if (conn->out.len + frame->len > max_queued_bytes)
+    {
+        if (slow_client_policy == SLOW_CLIENT_DROP)
+        {
+            __atomic_fetch_add(&stats.dropped_messages, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            evict_connection(conn);
+        }
+        pthread_mutex_unlock(&conn->out_mutex);
+        return -1;
+    }
+
+    if (grow_queue(&conn->out) == -1)
+    {
+        perror("Failed to allocate memory for outbound queue");
+        __atomic_fetch_add(&stats.dropped_messages, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&conn->out_mutex);
+        return -1;
+    }
+
+    OutQueue *queue = &conn->out;
+    OutChunk *chunk = &queue->chunks[(queue->head + queue->count) % queue->capacity];
+    __atomic_fetch_add(&frame->refcount, 1, __ATOMIC_RELAXED);
+    chunk->frame = frame;
+    chunk->offset = 0;
+    queue->count++;
+    queue->len += frame->len;
+    __atomic_fetch_add(&stats.queued_bytes, frame->len, __ATOMIC_RELAXED);
+
+    pthread_mutex_unlock(&conn->out_mutex);
+    return 0;
+}
+
+// Copy a message to the outbound queue of a connection, without writing to the socket
+// Returns -1 if the message was dropped
+int queue_message(Connection *conn, Message *msg)
+{
+    SharedFrame *frame = encode_frame(msg, conn->format);
+    if (!frame)
+    {
+        __atomic_fetch_add(&stats.dropped_messages, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    int result = queue_frame(conn, frame);
+    release_frame(frame);
+    return result;
+}
+
+// Hand a connection with a full socket over to the flusher thread, if it runs
+static void notify_flusher(Connection *conn)
+{
+    if (!flusher_running)
+    {
+        // The event loop gets EPOLLOUT when the socket is writable again
+        return;
+    }
+
+    pthread_mutex_lock(&flusher_mutex);
+    if (flusher_count == flusher_capacity)
+    {
+        size_t capacity = flusher_capacity ? flusher_capacity * 2 : 16;
+        Connection **list = (Connection **)realloc(flusher_list, capacity * sizeof(Connection *));
+        if (!list)
+        {
+            perror("Failed to allocate memory for flusher list");
+            pthread_mutex_unlock(&flusher_mutex);
+            return;
+        }
+        flusher_list = list;
+        flusher_capacity = capacity;
+    }
+    acquire_connection(conn);
+    flusher_list[flusher_count++] = conn;
+    pthread_mutex_unlock(&flusher_mutex);
+
+    char wake = 1;
+    if (write(flusher_wake_pipe[1], &wake, 1) == -1 && errno != EAGAIN)
+    {
+        perror("write");
+    }
+}
+
+// Write as much of the outbound queue as the socket accepts without blocking
+// Several frames are handed to the socket at once, straight from the shared buffers
+// Returns:
+//  0 - Queue is empty
+//  1 - Bytes are left, they will be written when the socket is writable again
+// -1 - Socket error, the queue was discarded
+int flush_connection(Connection *conn)
+{
+    pthread_mutex_lock(&conn->out_mutex);
+
+    OutQueue *queue = &conn->out;
+    while (queue->count > 0)
+    {
+        struct iovec iov[FLUSH_MAX_CHUNKS];
+        size_t iov_count = 0;
+        for (; iov_count < queue->count && iov_count < FLUSH_MAX_CHUNKS; iov_count++)
+        {
+            OutChunk *chunk = &queue->chunks[(queue->head + iov_count) % queue->capacity];
+            iov[iov_count].iov_base = chunk->frame->data + chunk->offset;
+            iov[iov_count].iov_len = chunk->frame->len - chunk->offset;
+        }
+
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = iov;
+        header.msg_iovlen = iov_count;
+        ssize_t n = sendmsg(conn->sockfd, &header, MSG_DONTWAIT);
+        if (n > 0)
+        {
+            queue->len -= n;
+            __atomic_fetch_sub(&stats.queued_bytes, n, __ATOMIC_RELAXED);
+            // Drop the frames that were fully written
+            while (n > 0)
+            {
+                OutChunk *chunk = &queue->chunks[queue->head];
+                size_t left = chunk->frame->len - chunk->offset;
+                if ((size_t)n < left)
+                {
+                    chunk->offset += n;
+                    break;
+                }
+                n -= left;
+                release_frame(chunk->frame);
+                queue->head = (queue->head + 1) % queue->capacity;
+                queue->count--;
+            }
+        }
+        else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        else if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            // The peer is gone, nothing queued will ever be delivered
+            clear_queue(queue);
+            conn->write_pending = 0;
+            pthread_mutex_unlock(&conn->out_mutex);
+            return -1;
+        }
+    }
+
+    int result = 0;
+    if (queue->count > 0)
+    {
+        result = 1;
+        if (!conn->write_pending)
+        {
+            conn->write_pending = 1;
+            notify_flusher(conn);
+        }
+    }
+    else
+    {
+        conn->write_pending = 0;
+    }
+
+    pthread_mutex_unlock(&conn->out_mutex);
+    return result;
+}
+
+// ========== Publications ==========
+void begin_publication(Publication *pub, const Message *msg)
+{
+    for (int i = 0; i < WIRE_FORMAT_COUNT; i++)
+    {
+        pub->msgs[i] = msg;
+        pub->frames[i] = NULL;
+    }
+    pub->recipients = NULL;
+    pub->count = 0;
+    pub->capacity = 0;
+}
+
+// Send another message to the connections of a wire format, before the publication is queued to any of them
+void set_publication_message(Publication *pub, WireFormat format, const Message *msg)
+{
+    pub->msgs[format] = msg;
+}
+
+// Queue a publication to a connection, encoding it the first time its wire format is used
+// The connection is flushed by end_publication, so callers can hold their locks until then
+// Returns -1 if the message was dropped
+int publish_to(Publication *pub, Connection *conn)
+{
+    if (!pub->frames[conn->format])
+    {
+        pub->frames[conn->format] = encode_frame(pub->msgs[conn->format], conn->format);
+        if (!pub->frames[conn->format])
+        {
+            __atomic_fetch_add(&stats.dropped_messages, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+    }
+    if (queue_frame(conn, pub->frames[conn->format]) == -1)
+    {
+        return -1;
+    }
+
+    if (pub->count == pub->capacity)
+    {
+        size_t capacity = pub->capacity ? pub->capacity * 2 : 16;
+        Connection **recipients = (Connection **)realloc(pub->recipients, capacity * sizeof(Connection *));
+        if (!recipients)
+        {
+            // Queued anyway, the socket is written when the client sends something or becomes writable
+            perror("Failed to allocate memory for publication");
+            return 0;
+        }
+        pub->recipients = recipients;
+        pub->capacity = capacity;
+    }
+    acquire_connection(conn);
+    pub->recipients[pub->count++] = conn;
+    return 0;
+}
+
+// Write the publication to the sockets of its recipients, in the order they were added
+void end_publication(Publication *pub)
+{
+    for (size_t i = 0; i < pub->count; i++)
+    {
+        flush_connection(pub->recipients[i]);
+        release_connection(pub->recipients[i]);
+    }
+    free(pub->recipients);
+    for (int i = 0; i < WIRE_FORMAT_COUNT; i++)
+    {
+        if (pub->frames[i])
+        {
+            release_frame(pub->frames[i]);
+        }
+    }
+}
+
+// ========== Flusher thread ==========
+// Wait for the sockets of the connections handed over by notify_flusher to become writable
+static void *flusher_thread(void *arg)
+{
+    (void)arg;
+    Connection **watching = NULL;
+    size_t watching_count = 0;
+    size_t watching_capacity = 0;
+    struct pollfd *fds = NULL;
+
+    while (1)
+    {
+        // Take over the connections added since the last round
+        pthread_mutex_lock(&flusher_mutex);
+        if (watching_count + flusher_count > watching_capacity)
+        {
+            watching_capacity = (watching_count + flusher_count) * 2;
+            watching = (Connection **)realloc(watching, watching_capacity * sizeof(Connection *));
+            fds = (struct pollfd *)realloc(fds, (watching_capacity + 1) * sizeof(struct pollfd));
+            if (!watching || !fds)
+            {
+                perror("Failed to allocate memory for flusher thread");
+                exit(1);
+            }
+        }
+        memcpy(watching + watching_count, flusher_list, flusher_count * sizeof(Connection *));
+        watching_count += flusher_count;
+        flusher_count = 0;
+        pthread_mutex_unlock(&flusher_mutex);
+
+        if (!fds)
+        {
+            fds = (struct pollfd *)malloc(sizeof(struct pollfd));
+            if (!fds)
+            {
+                perror("Failed to allocate memory for flusher thread");
+                exit(1);
+            }
+        }
+        fds[0].fd = flusher_wake_pipe[0];
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < watching_count; i++)
+        {
+            fds[i + 1].fd = watching[i]->sockfd;
+            fds[i + 1].events = POLLOUT;
+        }
+
+        if (poll(fds, watching_count + 1, -1) == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror("poll");
+            }
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            char drain[64];
+            while (read(flusher_wake_pipe[0], drain, sizeof(drain)) > 0)
+            {
+            }
+        }
+
+        // Keep watching the connections that still have bytes left
+        size_t kept = 0;
+        for (size_t i = 0; i < watching_count; i++)
+        {
+            Connection *conn = watching[i];
+            // closed is set under out_mutex by the thread that handles the client
+            pthread_mutex_lock(&conn->out_mutex);
+            int pending = !conn->closed;
+            pthread_mutex_unlock(&conn->out_mutex);
+            if (pending && fds[i + 1].revents != 0)
+            {
+                pending = flush_connection(conn) == 1;
+            }
+
+            if (pending)
+            {
+                watching[kept++] = conn;
+            }
+            else
+            {
+                release_connection(conn);
+            }
+        }
+        watching_count = kept;
+    }
+    return NULL;
+}
+
+void start_flusher_thread(void)
+{
+    if (pipe(flusher_wake_pipe) == -1)
+    {
+        perror("pipe");
+        exit(1);
+    }
+    // Waking up the flusher must never block a sender
+    fcntl(flusher_wake_pipe[0], F_SETFL, fcntl(flusher_wake_pipe[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(flusher_wake_pipe[1], F_SETFL, fcntl(flusher_wake_pipe[1], F_GETFL, 0) | O_NONBLOCK);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, flusher_thread, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(tid);
+    flusher_running = 1;
+}
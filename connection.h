@@ -0,0 +1,138 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <pthread.h>
+#include "common.h"
+#include "user.h"
+#include "intern.h"
+
+// Default high-water mark of an outbound queue, in bytes
+#define DEFAULT_MAX_QUEUED_BYTES (256 * 1024)
+// Outbound queues start with room for a few frames and grow as needed
+#define INITIAL_QUEUE_CHUNKS 16
+// Most frames handed to the socket by a single write
+#define FLUSH_MAX_CHUNKS 64
+
+// Login progress of a connection
+typedef enum
+{
+    CONN_AWAIT_USERNAME,
+    CONN_AWAIT_PASSWORD,
+    CONN_AWAIT_NEW_PASSWORD,
+    CONN_AWAIT_BIOGRAPHY,
+    CONN_READY
+} ConnState;
+
+// What to do with a client whose outbound queue would go over the high-water mark
+typedef enum
+{
+    // Drop the message that doesn't fit
+    SLOW_CLIENT_DROP,
+    // Close the connection
+    SLOW_CLIENT_DISCONNECT
+} SlowClientPolicy;
+
+// A message encoded for the wire, shared by the outbound queues of every connection it is sent to
+// A frame is never modified once encoded, it is freed with its last reference
+typedef struct
+{
+    int refcount;
+    size_t len;
+    char data[];
+} SharedFrame;
+
+// A frame waiting in an outbound queue
+typedef struct
+{
+    SharedFrame *frame;
+    size_t offset; // Bytes already written
+} OutChunk;
+
+// Frames waiting to be written to a socket, stored as a ring buffer
+typedef struct
+{
+    OutChunk *chunks;
+    size_t capacity;
+    size_t head;  // Index of the next chunk to write
+    size_t count; // Chunks queued
+    size_t len;   // Bytes left to write
+} OutQueue;
+
+struct Topic;
+
+// A socket accepted by the server, from its first message until it disconnects
+// Connections are reference counted: the socket is closed when the last reference is released
+typedef struct Connection
+{
+    int sockfd;
+    WireFormat format; // Detected from the first bytes sent by the client
+    int format_negotiated;
+    ConnState state;
+    User user; // Account being logged in or created
+    UsernameId name_id; // Set once logged in
+    // Bytes received but not yet decoded into a message (event loop mode)
+    char rbuf[2 * MAX_FRAME_SIZE];
+    size_t rlen;
+
+    int refcount;
+    int closed; // Set once the server is done with the connection
+
+    // Topics the client is subscribed to, each one holds a reference to the connection
+    // Only used by the thread handling the client's messages, so it needs no lock
+    struct Topic **topics;
+    size_t topic_count;
+    size_t topic_capacity;
+
+    // Messages are only copied to the queue while holding this mutex, writes never block
+    pthread_mutex_t out_mutex;
+    OutQueue out;
+    int write_pending; // The socket was full, waiting for it to become writable
+    int evicted;       // Disconnected for not reading its messages fast enough
+} Connection;
+
+// Number of values of WireFormat
+#define WIRE_FORMAT_COUNT 2
+
+// A message sent to many connections: it is encoded once for each wire format in use and
+// the same frame is queued to every connection, which are then flushed together
+// Each wire format can be sent its own message, for the types legacy clients don't know
+typedef struct Publication
+{
+    const Message *msgs[WIRE_FORMAT_COUNT];
+    SharedFrame *frames[WIRE_FORMAT_COUNT];
+    Connection **recipients; // Each one holds a reference
+    size_t count;
+    size_t capacity;
+} Publication;
+
+// Counters of all outbound queues
+typedef struct
+{
+    long queued_bytes; // Bytes currently waiting in outbound queues
+    long dropped_messages;
+    long evictions;
+} QueueStats;
+
+// Function prototypes
+
+// Connection lifetime
+Connection *create_connection(int sockfd);
+void acquire_connection(Connection *conn);
+void release_connection(Connection *conn);
+
+// Outbound queues
+void configure_outbound_queues(size_t max_queued_bytes, SlowClientPolicy policy);
+int queue_message(Connection *conn, Message *msg);
+int flush_connection(Connection *conn);
+void get_queue_stats(QueueStats *stats);
+
+// Messages sent to many connections
+void begin_publication(Publication *pub, const Message *msg);
+void set_publication_message(Publication *pub, WireFormat format, const Message *msg);
+int publish_to(Publication *pub, Connection *conn);
+void end_publication(Publication *pub);
+
+// Drains connections whose socket was full, for servers without an event loop
+void start_flusher_thread(void);
+
+#endif // CONNECTION_H
@@ -0,0 +1,88 @@
+#include "common.h"
+#include "game.h"
+#include "snapshot.h"
+
+// Converts the games between the snapshot and the text files of the previous versions
+// The server must be stopped, and the moves still in the journals aren't converted
+
+static void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s <to-snapshot|to-legacy> [games directory]\n", program);
+    fprintf(stderr, "  to-snapshot  Write the game_<id>.dat files to %s\n", SNAPSHOT_FILE);
+    fprintf(stderr, "  to-legacy    Write %s to game_<id>.dat files, the status and visibility of the games are lost\n", SNAPSHOT_FILE);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    // The file names are appended to the directory
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", argc == 3 ? argv[2] : GAME_DIR);
+    size_t dir_len = strlen(dir);
+    if (dir_len > 0 && dir[dir_len - 1] != '/' && dir_len + 1 < sizeof(dir))
+    {
+        strcat(dir, "/");
+    }
+    char snapshot_path[1100];
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s%s", dir, SNAPSHOT_FILE);
+
+    GameIndex index;
+    memset(&index, 0, sizeof(index));
+
+    if (strcmp(argv[1], "to-snapshot") == 0)
+    {
+        load_legacy_games(dir, &index);
+        Game **games = (Game **)malloc((index.count ? index.count : 1) * sizeof(Game *));
+        if (!games)
+        {
+            perror("Failed to allocate memory for snapshot");
+            return 1;
+        }
+        size_t count = 0;
+        for (size_t i = 0; i < index.capacity; i++)
+        {
+            if (index.slots[i].state == GAME_SLOT_USED)
+            {
+                games[count++] = index.slots[i].game;
+            }
+        }
+        if (write_snapshot(snapshot_path, games, count) == -1)
+        {
+            return 1;
+        }
+        printf("Wrote %zu games to %s\n", count, snapshot_path);
+        free(games);
+    }
+    else if (strcmp(argv[1], "to-legacy") == 0)
+    {
+        if (load_snapshot(snapshot_path, &index) < 0)
+        {
+            fprintf(stderr, "No valid snapshot in %s\n", dir);
+            return 1;
+        }
+        size_t count = 0;
+        for (size_t i = 0; i < index.capacity; i++)
+        {
+            if (index.slots[i].state == GAME_SLOT_USED)
+            {
+                if (save_legacy_game(dir, index.slots[i].game) == -1)
+                {
+                    return 1;
+                }
+                count++;
+            }
+        }
+        printf("Wrote %zu game files to %s\n", count, dir);
+    }
+    else
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,481 @@
+// Game tree search for the bots and the analysis tools
+// Iterative deepening negamax with alpha-beta pruning on packed boards, the positions already
+// searched are kept in a transposition table indexed by their Zobrist hash
+// Several threads can search the same board at once, they only share the table (Lazy SMP):
+// each one finds positions already searched by the others, and they finish the depths sooner together
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "engine.h"
+
+// A captured seed is worth more than a seed still on the board
+#define CAPTURED_SEED_VALUE 8
+#define INFINITE_VALUE (WIN_VALUE + 1)
+// The clock is only read every this many nodes, a power of two
+#define NODES_PER_CLOCK_CHECK 1024
+// Outcomes read from the tablebase are worth less than the wins found by the search, which
+// can't be farther than the deepest search, since the end of the game may still be far away
+#define TABLEBASE_WIN_VALUE (WIN_VALUE - MAX_SEARCH_DEPTH)
+
+// State of a search thread
+typedef struct
+{
+    TranspositionTable *table;
+    long nodes;
+    const struct timespec *deadline; // NULL for no time limit
+    int *stop;   // Set once the search must end, shared by the threads of the search
+    int stopped; // The values of the current iteration are meaningless
+} Search;
+
+// Endgames with few seeds left are read instead of searched, NULL without a tablebase
+static const Tablebase *endgames = NULL;
+
+// Allocate a table of 2^log2_entries entries
+// Returns -1 if the memory can't be allocated
+int init_transposition_table(TranspositionTable *table, int log2_entries)
+{
+    size_t count = (size_t)1 << log2_entries;
+    table->entries = (TranspositionEntry *)calloc(count, sizeof(TranspositionEntry));
+    if (!table->entries)
+    {
+        perror("Failed to allocate memory for transposition table");
+        return -1;
+    }
+    table->mask = count - 1;
+    return 0;
+}
+
+// Forget every entry, before searching unrelated positions
+void clear_transposition_table(TranspositionTable *table)
+{
+    memset(table->entries, 0, (table->mask + 1) * sizeof(TranspositionEntry));
+}
+
+void free_transposition_table(TranspositionTable *table)
+{
+    free(table->entries);
+    table->entries = NULL;
+    table->mask = 0;
+}
+
+// Value of a board without searching, from the point of view of the player to move
+// Once the game is over, or a player has more than half of the seeds, the outcome is known,
+// ply is the number of moves played since the root so that faster wins are worth more
+// When the game is over the turn doesn't change, so the value is for the player who just moved
+int evaluate(const PackedState *state, int ply)
+{
+    int me = state->turn;
+    int opponent = 1 - me;
+    int difference = state->scores[me] - state->scores[opponent];
+    if (state->over)
+    {
+        return difference > 0 ? WIN_VALUE - ply : difference < 0 ? -(WIN_VALUE - ply) : 0;
+    }
+    if (state->scores[me] > TOTAL_SEEDS / 2)
+    {
+        return WIN_VALUE - ply;
+    }
+    if (state->scores[opponent] > TOTAL_SEEDS / 2)
+    {
+        return -(WIN_VALUE - ply);
+    }
+
+    // Seeds left on a side go to its owner at the end of the game
+    int own_seeds = 0;
+    int opponent_seeds = 0;
+    int first = me * (NUM_HOLES / 2);
+    for (int i = 0; i < NUM_HOLES / 2; i++)
+    {
+        own_seeds += state->holes[first + i];
+        opponent_seeds += state->holes[(first + NUM_HOLES / 2 + i) % NUM_HOLES];
+    }
+    return CAPTURED_SEED_VALUE * difference + own_seeds - opponent_seeds;
+}
+
+// Use a tablebase in the searches started from now on, it must stay mapped while they run
+void use_tablebase(const Tablebase *tablebase)
+{
+    endgames = tablebase;
+}
+
+// Exact value of a board from the tablebase
+// Returns 0 if the tablebase doesn't hold the board
+static int probe_endgame(const PackedState *state, int ply, int *value)
+{
+    TablebaseEntry entry;
+    if (!endgames || !probe_tablebase(endgames, state, &entry))
+    {
+        return 0;
+    }
+    int me = state->turn;
+    int difference = state->scores[me] - state->scores[1 - me] + entry.value;
+    *value = difference > 0 ? TABLEBASE_WIN_VALUE - ply : difference < 0 ? -(TABLEBASE_WIN_VALUE - ply) : 0;
+    return 1;
+}
+
+// Wins and losses are stored relative to the position of the entry, not to the root
+static int value_to_table(int value, int ply)
+{
+    if (value >= WIN_THRESHOLD)
+    {
+        return value + ply;
+    }
+    if (value <= -WIN_THRESHOLD)
+    {
+        return value - ply;
+    }
+    return value;
+}
+
+static int value_from_table(int value, int ply)
+{
+    if (value >= WIN_THRESHOLD)
+    {
+        return value - ply;
+    }
+    if (value <= -WIN_THRESHOLD)
+    {
+        return value + ply;
+    }
+    return value;
+}
+
+// Find the entry of a board
+// Returns 0 if the table doesn't hold the board
+static int probe_table(TranspositionTable *table, uint64_t key, TranspositionData *data)
+{
+    TranspositionEntry *entry = &table->entries[key & table->mask];
+    uint64_t check = __atomic_load_n(&entry->check, __ATOMIC_RELAXED);
+    uint64_t word = __atomic_load_n(&entry->data, __ATOMIC_RELAXED);
+    // The bound of a stored entry is never BOUND_NONE, so an empty entry has a zero word
+    if (word == 0 || (check ^ word) != key)
+    {
+        return 0;
+    }
+    data->value = (int16_t)(word & 0xFFFF);
+    data->depth = (word >> 16) & 0xFF;
+    data->bound = (word >> 24) & 0xFF;
+    data->move = (int8_t)((word >> 32) & 0xFF);
+    return 1;
+}
+
+static void store_in_table(TranspositionTable *table, uint64_t key, const TranspositionData *data)
+{
+    TranspositionEntry *entry = &table->entries[key & table->mask];
+    uint64_t word = (uint64_t)(uint16_t)data->value | (uint64_t)data->depth << 16 |
+                    (uint64_t)data->bound << 24 | (uint64_t)(uint8_t)data->move << 32;
+    __atomic_store_n(&entry->check, key ^ word, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->data, word, __ATOMIC_RELAXED);
+}
+
+// Check if the search must end, the clock and the other threads are only looked at from time to time
+static int time_is_up(Search *search)
+{
+    if ((search->nodes & (NODES_PER_CLOCK_CHECK - 1)) != 0)
+    {
+        return 0;
+    }
+    if (__atomic_load_n(search->stop, __ATOMIC_RELAXED))
+    {
+        return 1;
+    }
+    if (!search->deadline)
+    {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > search->deadline->tv_sec ||
+           (now.tv_sec == search->deadline->tv_sec && now.tv_nsec >= search->deadline->tv_nsec);
+}
+
+// Play every legal move, and give each one a priority for the search order:
+// the move of the transposition table first, then the moves that capture the most seeds
+// Returns the number of moves
+static int generate_children(const PackedState *state, int table_move, int *moves, PackedState *children, int *priorities)
+{
+    int count = legal_moves(state, moves);
+    for (int i = 0; i < count; i++)
+    {
+        children[i] = apply_move(*state, moves[i]);
+        priorities[i] = moves[i] == table_move ? INFINITE_VALUE
+                                               : children[i].scores[state->turn] - state->scores[state->turn];
+    }
+    return count;
+}
+
+// Move the child with the highest priority among the remaining ones to index i
+static void pick_next_child(int i, int count, int *moves, PackedState *children, int *priorities)
+{
+    int best = i;
+    for (int j = i + 1; j < count; j++)
+    {
+        if (priorities[j] > priorities[best])
+        {
+            best = j;
+        }
+    }
+    if (best != i)
+    {
+        int move = moves[i];
+        moves[i] = moves[best];
+        moves[best] = move;
+        PackedState child = children[i];
+        children[i] = children[best];
+        children[best] = child;
+        int priority = priorities[i];
+        priorities[i] = priorities[best];
+        priorities[best] = priority;
+    }
+}
+
+// Value of a board searched depth moves ahead, from the point of view of the player to move
+// The value is exact between alpha and beta, otherwise it is only a bound
+static int negamax(Search *search, const PackedState *state, int depth, int ply, int alpha, int beta)
+{
+    search->nodes++;
+    if (search->stopped || time_is_up(search))
+    {
+        search->stopped = 1;
+        return 0;
+    }
+
+    int static_value = evaluate(state, ply);
+    if (depth == 0 || static_value >= WIN_THRESHOLD || static_value <= -WIN_THRESHOLD)
+    {
+        return static_value;
+    }
+    int endgame_value;
+    if (probe_endgame(state, ply, &endgame_value))
+    {
+        return endgame_value;
+    }
+
+    uint64_t key = zobrist_hash(state);
+    TranspositionData entry;
+    int table_move = -1;
+    if (probe_table(search->table, key, &entry))
+    {
+        table_move = entry.move;
+        if (entry.depth >= depth)
+        {
+            int value = value_from_table(entry.value, ply);
+            if (entry.bound == BOUND_EXACT ||
+                (entry.bound == BOUND_LOWER && value >= beta) ||
+                (entry.bound == BOUND_UPPER && value <= alpha))
+            {
+                return value;
+            }
+        }
+    }
+
+    int moves[NUM_HOLES / 2];
+    PackedState children[NUM_HOLES / 2];
+    int priorities[NUM_HOLES / 2];
+    int count = generate_children(state, table_move, moves, children, priorities);
+
+    int original_alpha = alpha;
+    int best_value = -INFINITE_VALUE;
+    int best_move = -1;
+    for (int i = 0; i < count; i++)
+    {
+        pick_next_child(i, count, moves, children, priorities);
+        // The turn doesn't change once the game is over, so a finished child is already seen from here
+        int value = children[i].over ? evaluate(&children[i], ply + 1)
+                                     : -negamax(search, &children[i], depth - 1, ply + 1, -beta, -alpha);
+        if (search->stopped)
+        {
+            return 0;
+        }
+        if (value > best_value)
+        {
+            best_value = value;
+            best_move = moves[i];
+            if (value > alpha)
+            {
+                alpha = value;
+                if (alpha >= beta)
+                {
+                    break;
+                }
+            }
+        }
+    }
+
+    entry.value = value_to_table(best_value, ply);
+    entry.depth = depth;
+    entry.bound = best_value <= original_alpha ? BOUND_UPPER : best_value >= beta ? BOUND_LOWER : BOUND_EXACT;
+    entry.move = best_move;
+    store_in_table(search->table, key, &entry);
+    return best_value;
+}
+
+// Search the root one move deeper each time, from first_depth until max_depth or until the search stops
+// result must hold the move to search first, it is updated after each finished depth
+static void iterative_deepening(Search *search, const PackedState *state, int first_depth, int max_depth, SearchResult *result)
+{
+    int moves[NUM_HOLES / 2];
+    PackedState children[NUM_HOLES / 2];
+    int priorities[NUM_HOLES / 2];
+    int count = generate_children(state, result->move, moves, children, priorities);
+
+    for (int depth = first_depth; depth <= max_depth; depth++)
+    {
+        // The best move of the previous depth is searched first, it is the most likely to stay the best
+        for (int i = 0; i < count; i++)
+        {
+            priorities[i] = moves[i] == result->move ? INFINITE_VALUE : priorities[i];
+        }
+
+        int alpha = -INFINITE_VALUE;
+        int best_move = -1;
+        for (int i = 0; i < count; i++)
+        {
+            pick_next_child(i, count, moves, children, priorities);
+            int value = children[i].over ? evaluate(&children[i], 1)
+                                         : -negamax(search, &children[i], depth - 1, 1, -INFINITE_VALUE, -alpha);
+            if (search->stopped)
+            {
+                return;
+            }
+            if (value > alpha)
+            {
+                alpha = value;
+                best_move = moves[i];
+            }
+            // Moves keep their order for the next depth, the best one aside
+            priorities[i] = -i;
+        }
+
+        result->move = best_move;
+        result->value = alpha;
+        result->depth = depth;
+        // A forced win or loss won't change with more depth
+        if (alpha >= WIN_THRESHOLD || alpha <= -WIN_THRESHOLD)
+        {
+            return;
+        }
+    }
+}
+
+// A helper thread of a parallel search
+typedef struct
+{
+    Search search;
+    const PackedState *state;
+    int first_depth;
+    int max_depth;
+    SearchResult result;
+} SearchThread;
+
+static void *search_thread(void *arg)
+{
+    SearchThread *thread = (SearchThread *)arg;
+    iterative_deepening(&thread->search, thread->state, thread->first_depth, thread->max_depth, &thread->result);
+    return NULL;
+}
+
+static long elapsed_us_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// Find the best move of the player to move, until the depth or the time limit is reached
+// With several threads, the calling thread and the helpers search the same board, half of the helpers
+// starting one move deeper so that they don't all search the same depth at once. The search ends with
+// the calling thread, and the deepest finished depth of any thread gives the move
+// Returns the best move, or -1 if the game is over
+int search_best_move(TranspositionTable *table, const PackedState *state, const SearchLimits *limits, SearchResult *result)
+{
+    struct timespec start, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    if (limits->time_ms > 0)
+    {
+        deadline.tv_sec += limits->time_ms / 1000;
+        deadline.tv_nsec += (long)(limits->time_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    int moves[NUM_HOLES / 2];
+    int count = legal_moves(state, moves);
+    result->move = count > 0 ? moves[0] : -1;
+    result->value = evaluate(state, 0);
+    result->depth = 0;
+    result->nodes = 0;
+    result->elapsed_us = 0;
+    if (count <= 1)
+    {
+        // Nothing to choose from
+        return result->move;
+    }
+
+    int stop = 0;
+    Search search;
+    search.table = table;
+    search.nodes = 0;
+    search.deadline = limits->time_ms > 0 ? &deadline : NULL;
+    search.stop = &stop;
+    search.stopped = 0;
+    int max_depth = limits->max_depth < MAX_SEARCH_DEPTH ? limits->max_depth : MAX_SEARCH_DEPTH;
+
+    int helper_count = limits->threads > 1 ? limits->threads - 1 : 0;
+    SearchThread *helpers = NULL;
+    pthread_t *tids = NULL;
+    if (helper_count > 0)
+    {
+        helpers = (SearchThread *)malloc(helper_count * sizeof(SearchThread));
+        tids = (pthread_t *)malloc(helper_count * sizeof(pthread_t));
+        if (!helpers || !tids)
+        {
+            perror("Failed to allocate memory for search threads");
+            helper_count = 0;
+        }
+    }
+    int started = 0;
+    for (int i = 0; i < helper_count; i++)
+    {
+        helpers[i].search = search;
+        helpers[i].state = state;
+        helpers[i].first_depth = 1 + (i + 1) % 2;
+        helpers[i].max_depth = max_depth;
+        helpers[i].result = *result;
+        if (pthread_create(&tids[i], NULL, search_thread, &helpers[i]) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+        started++;
+    }
+
+    iterative_deepening(&search, state, 1, max_depth, result);
+    result->nodes = search.nodes;
+
+    // The helpers stop as soon as the calling thread is done
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(tids[i], NULL);
+        result->nodes += helpers[i].search.nodes;
+        if (helpers[i].result.depth > result->depth)
+        {
+            long nodes = result->nodes;
+            *result = helpers[i].result;
+            result->nodes = nodes;
+        }
+    }
+    free(helpers);
+    free(tids);
+
+    result->elapsed_us = elapsed_us_since(&start);
+    return result->move;
+}
@@ -0,0 +1,74 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "board.h"
+#include "tablebase.h"
+
+// Value of a won game, minus the number of moves needed to win it so that faster wins are preferred
+#define WIN_VALUE 30000
+// Values above this one are wins or losses found by the search
+#define WIN_THRESHOLD (WIN_VALUE - 1000)
+// Deepest search, in moves
+#define MAX_SEARCH_DEPTH 64
+
+typedef enum
+{
+    BOUND_NONE = 0,
+    BOUND_EXACT,
+    BOUND_LOWER, // The value is at least the stored one, the search failed high
+    BOUND_UPPER  // The value is at most the stored one, the search failed low
+} BoundType;
+
+// Result of a search, stored by the Zobrist hash of the board
+typedef struct
+{
+    int16_t value;
+    uint8_t depth;
+    uint8_t bound; // BoundType
+    int8_t move;   // Best move found, -1 if none
+} TranspositionData;
+
+// An entry holds the data packed in a word, and the key xored with that word
+// The threads of a search share the table without locking: an entry torn by two threads writing
+// it at once doesn't match any key, so it is ignored like an empty one
+typedef struct
+{
+    uint64_t check; // key ^ data
+    uint64_t data;
+} TranspositionEntry;
+
+// Fixed size hash table, a new entry replaces the one in its slot
+typedef struct
+{
+    TranspositionEntry *entries;
+    size_t mask; // Number of entries minus one, always a power of two minus one
+} TranspositionTable;
+
+// When to stop a search, the last fully searched depth is used
+typedef struct
+{
+    int max_depth;
+    int time_ms; // 0 for no time limit
+    int threads; // Threads searching together, sharing the transposition table (Lazy SMP)
+} SearchLimits;
+
+typedef struct
+{
+    int move;  // Best move, -1 if the game is over
+    int value; // From the point of view of the player to move
+    int depth; // Last depth searched to the end
+    long nodes; // Of all the threads
+    long elapsed_us;
+} SearchResult;
+
+// Function prototypes
+int init_transposition_table(TranspositionTable *table, int log2_entries);
+void clear_transposition_table(TranspositionTable *table);
+void free_transposition_table(TranspositionTable *table);
+int evaluate(const PackedState *state, int ply);
+void use_tablebase(const Tablebase *tablebase);
+int search_best_move(TranspositionTable *table, const PackedState *state, const SearchLimits *limits, SearchResult *result);
+
+#endif // ENGINE_H
@@ -4,7 +4,7 @@
 #include "common.h"
 
 // Create a new game instance
-Game *create_game(int game_id, const char *player1_username, const char *player2_username)
+Game *create_game(int game_id, UsernameId player1, UsernameId player2)
 {
     Game *game = (Game *)malloc(sizeof(Game));
     if (!game)
@@ -13,11 +13,10 @@ Game *create_game(int game_id, const char *player1_username, const char *player2
         return NULL;
     }
 
+    pthread_mutex_init(&game->lock, NULL);
     game->game_id = game_id;
-    strncpy(game->player_usernames[PLAYER1], player1_username, USERNAME_MAX_LEN - 1);
-    game->player_usernames[PLAYER1][USERNAME_MAX_LEN - 1] = '\0';
-    strncpy(game->player_usernames[PLAYER2], player2_username, USERNAME_MAX_LEN - 1);
-    game->player_usernames[PLAYER2][USERNAME_MAX_LEN - 1] = '\0';
+    game->players[PLAYER1] = player1;
+    game->players[PLAYER2] = player2;
 
     // Initialize the board with initial seeds
     for (int i = 0; i < NUM_HOLES; i++)
@@ -28,16 +27,18 @@ Game *create_game(int game_id, const char *player1_username, const char *player2
     game->state.scores[PLAYER1] = 0;
     game->state.scores[PLAYER2] = 0;
     game->state.turn = PLAYER1; // Player 1 starts the game
+    game->state.hash = hash_game_state(&game->state);
     game->move_history = NULL;
-    game->next = NULL;
+    game->move_count = 0;
     game->status = ONGOING;
     game->visibility = 1; // Public game by default
+    game->journal_dirty = 0;
 
-    // Initialize watch list with NULL
-    for (int i = 0; i < 100; i++)
-    {
-        game->watch_list[i][0] = '\0';
-    }
+    // Nobody is watching yet, the topic is only used by the server
+    pthread_mutex_init(&game->watchers.lock, NULL);
+    game->watchers.subscribers = NULL;
+    game->watchers.count = 0;
+    game->watchers.capacity = 0;
 
     return game;
 }
@@ -48,56 +49,265 @@ void delete_game(Game *game)
     if (game)
     {
         free_move_history(game->move_history);
+        free(game->watchers.subscribers);
+        pthread_mutex_destroy(&game->watchers.lock);
+        pthread_mutex_destroy(&game->lock);
         free(game);
     }
 }
 
-// Add a game to the linked list of games
-void add_game(Game **game_list, Game *new_game)
+// Multiplicative hash of a game ID, kept to the low bits of the product
+// The multiplier is odd, so sequential IDs land in different slots
+static size_t game_id_slot(int game_id, size_t capacity)
 {
-    new_game->next = *game_list;
-    *game_list = new_game;
+    return ((uint32_t)game_id * 2654435761u) & (capacity - 1);
 }
 
-// Find a game by its unique game ID
-Game *find_game_by_id(Game *game_list, int game_id)
+// Find the slot of a game
+// Returns the index of the slot, or -1 if the game isn't in the index
+static long find_game_slot(GameIndex *index, int game_id)
 {
-    Game *current = game_list;
-    while (current)
+    if (index->capacity == 0)
+    {
+        return -1;
+    }
+
+    size_t mask = index->capacity - 1;
+    for (size_t i = game_id_slot(game_id, index->capacity);; i = (i + 1) & mask)
     {
-        if (current->game_id == game_id)
+        if (index->slots[i].state == GAME_SLOT_EMPTY)
+        {
+            return -1;
+        }
+        if (index->slots[i].state == GAME_SLOT_USED && index->slots[i].game_id == game_id)
         {
-            return current;
+            return i;
         }
-        current = current->next;
     }
-    return NULL;
 }
 
-// Remove a game from the linked list and delete it
-void remove_game(Game **game_list, int game_id)
+// Rebuild the ID table with a new capacity, which drops the deleted slots
+// Returns -1 if the memory can't be allocated
+static int resize_game_slots(GameIndex *index, size_t capacity)
 {
-    Game *current = *game_list;
-    Game *prev = NULL;
+    GameSlot *slots = (GameSlot *)calloc(capacity, sizeof(GameSlot));
+    if (!slots)
+    {
+        perror("Failed to allocate memory for game index");
+        return -1;
+    }
 
-    while (current)
+    for (size_t i = 0; i < index->capacity; i++)
     {
-        if (current->game_id == game_id)
+        if (index->slots[i].state != GAME_SLOT_USED)
+        {
+            continue;
+        }
+        size_t j = game_id_slot(index->slots[i].game_id, capacity);
+        while (slots[j].state != GAME_SLOT_EMPTY)
         {
-            if (prev)
+            j = (j + 1) & (capacity - 1);
+        }
+        slots[j] = index->slots[i];
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->capacity = capacity;
+    index->used = index->count;
+    return 0;
+}
+
+// Multiplicative hash of a username ID, like game IDs they are handed out in sequence
+static size_t player_slot(UsernameId player, size_t capacity)
+{
+    return (player * 2654435761u) & (capacity - 1);
+}
+
+// Find the entry of a player, creating it if create is set
+// Returns NULL if the player has no entry
+static PlayerGames *player_entry(GameIndex *index, UsernameId player, int create)
+{
+    // Players are never removed, so the table only grows
+    if (create && (index->players_count + 1) * 4 > index->players_capacity * 3)
+    {
+        size_t capacity = index->players_capacity ? index->players_capacity * 2 : GAME_INDEX_INITIAL_CAPACITY;
+        PlayerGames *players = (PlayerGames *)calloc(capacity, sizeof(PlayerGames));
+        if (!players)
+        {
+            perror("Failed to allocate memory for game index");
+            return NULL;
+        }
+        for (size_t i = 0; i < index->players_capacity; i++)
+        {
+            if (index->players[i].player == NO_USERNAME)
             {
-                prev->next = current->next;
+                continue;
             }
-            else
+            size_t j = player_slot(index->players[i].player, capacity);
+            while (players[j].player != NO_USERNAME)
             {
-                *game_list = current->next;
+                j = (j + 1) & (capacity - 1);
             }
-            delete_game(current);
+            players[j] = index->players[i];
+        }
+        free(index->players);
+        index->players = players;
+        index->players_capacity = capacity;
+    }
+
+    if (index->players_capacity == 0 || player == NO_USERNAME)
+    {
+        return NULL;
+    }
+
+    size_t mask = index->players_capacity - 1;
+    for (size_t i = player_slot(player, index->players_capacity);; i = (i + 1) & mask)
+    {
+        PlayerGames *entry = &index->players[i];
+        if (entry->player == NO_USERNAME)
+        {
+            if (!create)
+            {
+                return NULL;
+            }
+            entry->player = player;
+            index->players_count++;
+            return entry;
+        }
+        if (entry->player == player)
+        {
+            return entry;
+        }
+    }
+}
+
+// Add a game to the ongoing games of a player
+static void add_player_game(GameIndex *index, UsernameId player, Game *game)
+{
+    PlayerGames *entry = player_entry(index, player, 1);
+    if (!entry)
+    {
+        return;
+    }
+    if (entry->count == entry->capacity)
+    {
+        int capacity = entry->capacity ? entry->capacity * 2 : 4;
+        Game **games = (Game **)realloc(entry->games, capacity * sizeof(Game *));
+        if (!games)
+        {
+            perror("Failed to allocate memory for player games");
             return;
         }
-        prev = current;
-        current = current->next;
+        entry->games = games;
+        entry->capacity = capacity;
     }
+    entry->games[entry->count++] = game;
+}
+
+// Remove a game from the ongoing games of a player
+static void remove_player_game(GameIndex *index, UsernameId player, Game *game)
+{
+    PlayerGames *entry = player_entry(index, player, 0);
+    if (!entry)
+    {
+        return;
+    }
+    for (int i = 0; i < entry->count; i++)
+    {
+        if (entry->games[i] == game)
+        {
+            // Order doesn't matter, move the last game in its place
+            entry->games[i] = entry->games[--entry->count];
+            return;
+        }
+    }
+}
+
+// Add a game to the index
+void add_game(GameIndex *index, Game *new_game)
+{
+    // Keep the load factor under 3/4, counting deleted slots since they lengthen probes
+    if ((index->used + 1) * 4 > index->capacity * 3)
+    {
+        size_t capacity = index->capacity ? index->capacity : GAME_INDEX_INITIAL_CAPACITY;
+        while ((index->count + 1) * 2 > capacity)
+        {
+            capacity *= 2;
+        }
+        if (resize_game_slots(index, capacity) == -1)
+        {
+            return;
+        }
+    }
+
+    size_t i = game_id_slot(new_game->game_id, index->capacity);
+    while (index->slots[i].state == GAME_SLOT_USED)
+    {
+        i = (i + 1) & (index->capacity - 1);
+    }
+    if (index->slots[i].state == GAME_SLOT_EMPTY)
+    {
+        index->used++;
+    }
+    index->slots[i].game_id = new_game->game_id;
+    index->slots[i].state = GAME_SLOT_USED;
+    index->slots[i].game = new_game;
+    index->count++;
+
+    if (new_game->status == ONGOING)
+    {
+        add_player_game(index, new_game->players[PLAYER1], new_game);
+        add_player_game(index, new_game->players[PLAYER2], new_game);
+    }
+}
+
+// Find a game by its unique game ID
+Game *find_game_by_id(GameIndex *index, int game_id)
+{
+    long i = find_game_slot(index, game_id);
+    return i == -1 ? NULL : index->slots[i].game;
+}
+
+// Remove a game from the index and delete it
+void remove_game(GameIndex *index, int game_id)
+{
+    long i = find_game_slot(index, game_id);
+    if (i == -1)
+    {
+        return;
+    }
+
+    Game *game = index->slots[i].game;
+    index->slots[i].state = GAME_SLOT_DELETED;
+    index->slots[i].game = NULL;
+    index->count--;
+
+    if (game->status == ONGOING)
+    {
+        remove_player_game(index, game->players[PLAYER1], game);
+        remove_player_game(index, game->players[PLAYER2], game);
+    }
+    delete_game(game);
+}
+
+// Mark a game as over, it stays in the index but is no longer an ongoing game of its players
+// The caller must hold the game's lock, and the index must not be used by another thread
+void finish_game(GameIndex *index, Game *game, GameStatus status)
+{
+    if (game->status == ONGOING && status != ONGOING)
+    {
+        remove_player_game(index, game->players[PLAYER1], game);
+        remove_player_game(index, game->players[PLAYER2], game);
+    }
+    game->status = status;
+}
+
+// Get the ongoing games of a player
+// Returns NULL if the player never had any
+PlayerGames *find_player_games(GameIndex *index, UsernameId player)
+{
+    return player_entry(index, player, 0);
 }
 
 // Add a move to the game's move history
@@ -113,6 +323,7 @@ void add_move_to_history(Game *game, int player, int hole)
     move->hole = hole;
     move->next = game->move_history;
     game->move_history = move;
+    game->move_count++;
 }
 
 // Free the move history linked list
@@ -161,7 +372,42 @@ int is_valid_move(Game *game, int player, int hole)
     return 0;
 }
 
+// Pack the board of a game for apply_move
+void pack_state(const GameState *state, PackedState *packed)
+{
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        packed->holes[i] = (uint8_t)state->board[i];
+    }
+    packed->scores[PLAYER1] = (uint8_t)state->scores[PLAYER1];
+    packed->scores[PLAYER2] = (uint8_t)state->scores[PLAYER2];
+    packed->turn = (uint8_t)state->turn;
+    packed->over = 0;
+}
+
+// Copy a packed board back into the board of a game, the hash isn't changed
+void unpack_state(const PackedState *packed, GameState *state)
+{
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        state->board[i] = packed->holes[i];
+    }
+    state->scores[PLAYER1] = packed->scores[PLAYER1];
+    state->scores[PLAYER2] = packed->scores[PLAYER2];
+    state->turn = packed->turn;
+}
+
+// Hash a whole state, after filling it by hand
+uint64_t hash_game_state(const GameState *state)
+{
+    PackedState packed;
+    pack_state(state, &packed);
+    return zobrist_hash(&packed);
+}
+
 // Execute a move in the game
+// The board is played by do_move, which updates the hash for each hole it sows, captures or sweeps
+// Only the move history is allocated here
 // Returns:
 //  0 - Move executed successfully
 //  1 - Game over
@@ -177,67 +423,146 @@ int make_move(Game *game, int player, int hole)
         return -valid;
     }
 
-    int seeds = game->state.board[hole];
-    game->state.board[hole] = 0;
-    int position = hole;
+    MoveUndo undo;
+    int over = do_move(&game->state, hole, &undo);
+
+    // Add move to history
+    add_move_to_history(game, player, hole);
+
+    // When the game is over the turn doesn't change and the seeds are already counted
+    return over;
+}
 
-    // Sow seeds in subsequent holes
-    while (seeds > 0)
+// Play a legal move on a state alone, for searches that look ahead without copying the game
+// Same rules as make_move, but nothing is allocated, the game isn't checked or recorded, and
+// undo_move takes the move back from what is written to undo
+// Returns 1 if the move ended the game, 0 otherwise
+int do_move(GameState *state, int hole, MoveUndo *undo)
+{
+    const ZobristKeys *keys = zobrist_keys();
+    int *board = state->board;
+    int player = state->turn;
+    int seeds = board[hole];
+    uint64_t hash = state->hash;
+    undo->hash = hash;
+    undo->player = player;
+    undo->hole = hole;
+    undo->seeds = seeds;
+
+    // Every full lap gives a seed to each hole, the played one included
+    hash ^= keys->holes[hole][seeds] ^ keys->holes[hole][0];
+    board[hole] = 0;
+    int laps = seeds / NUM_HOLES;
+    if (laps > 0)
+    {
+        for (int i = 0; i < NUM_HOLES; i++)
+        {
+            hash ^= keys->holes[i][board[i]] ^ keys->holes[i][board[i] + laps];
+            board[i] += laps;
+        }
+    }
+    int position = hole;
+    for (int i = seeds % NUM_HOLES; i > 0; i--)
     {
-        position = (position + 1) % NUM_HOLES;
-        // Skip opponent's scoring hole if implementing scoring pits
-        game->state.board[position]++;
-        seeds--;
+        position = position == NUM_HOLES - 1 ? 0 : position + 1;
+        hash ^= keys->holes[position][board[position]] ^ keys->holes[position][board[position] + 1];
+        board[position]++;
     }
 
-    // Capture logic
+    int opponent_first = (1 - player) * (NUM_HOLES / 2);
     int captured = 0;
-    while (1)
+    undo->captured_holes = 0;
+    undo->captured_threes = 0;
+    while (position >= opponent_first && position < opponent_first + NUM_HOLES / 2 &&
+           (board[position] == 2 || board[position] == 3))
     {
-        if ((player == PLAYER1 && position >= NUM_HOLES / 2) ||
-            (player == PLAYER2 && position < NUM_HOLES / 2))
+        if (board[position] == 3)
         {
-            // Check opponent's side for capture
-            if (game->state.board[position] == 2 || game->state.board[position] == 3)
-            {
-                captured += game->state.board[position];
-                game->state.board[position] = 0;
-                position = (position - 1 + NUM_HOLES) % NUM_HOLES;
-            }
-            else
-            {
-                break;
-            }
+            undo->captured_threes |= 1 << undo->captured_holes;
         }
-        else
+        undo->captured_holes++;
+        captured += board[position];
+        hash ^= keys->holes[position][board[position]] ^ keys->holes[position][0];
+        board[position] = 0;
+        position--;
+    }
+    int score_deltas[2] = {0, 0};
+    score_deltas[player] = captured;
+
+    int side1 = 0;
+    int side2 = 0;
+    for (int i = 0; i < NUM_HOLES / 2; i++)
+    {
+        side1 += board[i];
+        side2 += board[i + NUM_HOLES / 2];
+    }
+    undo->over = side1 == 0 || side2 == 0;
+    if (undo->over)
+    {
+        // The turn doesn't change once the game is over
+        for (int i = 0; i < NUM_HOLES; i++)
         {
-            break;
+            undo->swept[i] = board[i];
+            hash ^= keys->holes[i][board[i]] ^ keys->holes[i][0];
+            board[i] = 0;
         }
+        score_deltas[PLAYER1] += side1;
+        score_deltas[PLAYER2] += side2;
+    }
+    else
+    {
+        hash ^= keys->turn;
+        state->turn = 1 - player;
     }
-    game->state.scores[player] += captured;
 
-    // Add move to history
-    add_move_to_history(game, player, hole);
+    for (int p = 0; p < 2; p++)
+    {
+        hash ^= keys->scores[p][state->scores[p]] ^ keys->scores[p][state->scores[p] + score_deltas[p]];
+        state->scores[p] += score_deltas[p];
+        undo->score_deltas[p] = score_deltas[p];
+    }
+    state->hash = hash;
+    return undo->over;
+}
 
-    // Check for game over
-    if (check_game_over(game))
+// Take back the move of do_move, the state must be the one do_move left
+void undo_move(GameState *state, const MoveUndo *undo)
+{
+    int *board = state->board;
+    if (undo->over)
     {
-        // Game over logic
-        // Distribute remaining seeds to the opponent
         for (int i = 0; i < NUM_HOLES; i++)
         {
-            int owner = (i < NUM_HOLES / 2) ? PLAYER1 : PLAYER2;
-            game->state.scores[owner] += game->state.board[i];
-            game->state.board[i] = 0;
+            board[i] = undo->swept[i];
         }
-        // Indicate game over
-        return 1;
     }
+    state->scores[PLAYER1] -= undo->score_deltas[PLAYER1];
+    state->scores[PLAYER2] -= undo->score_deltas[PLAYER2];
 
-    // Change turn to the other player
-    game->state.turn = 1 - game->state.turn;
+    // The captured holes end at the last sown one
+    int last = (undo->hole + undo->seeds) % NUM_HOLES;
+    for (int i = 0; i < undo->captured_holes; i++)
+    {
+        board[last - i] = undo->captured_threes & (1 << i) ? 3 : 2;
+    }
 
-    return 0; // Move executed successfully
+    int laps = undo->seeds / NUM_HOLES;
+    if (laps > 0)
+    {
+        for (int i = 0; i < NUM_HOLES; i++)
+        {
+            board[i] -= laps;
+        }
+    }
+    int position = undo->hole;
+    for (int i = undo->seeds % NUM_HOLES; i > 0; i--)
+    {
+        position = position == NUM_HOLES - 1 ? 0 : position + 1;
+        board[position]--;
+    }
+    board[undo->hole] = undo->seeds;
+    state->turn = undo->player;
+    state->hash = undo->hash;
 }
 
 // Print the current game board
@@ -248,7 +573,7 @@ int pretty_board_state(Game *game, char *output)
     int *scores = game->state.scores;
     char *pos = output; // Pointer to track position in the output buffer
 
-    pos += sprintf(pos, "\n  Player 2 (%s) - Score: %d\n", game->player_usernames[PLAYER2], scores[PLAYER2]);
+    pos += sprintf(pos, "\n  Player 2 (%s) - Score: %d\n", username_of(game->players[PLAYER2]), scores[PLAYER2]);
 
     pos += sprintf(pos, "  12  11  10  9   8   7 \n");
     pos += sprintf(pos, "├───┼───┼───┼───┼───┼───┤\n");
@@ -259,7 +584,7 @@ int pretty_board_state(Game *game, char *output)
     pos += sprintf(pos, "│%2d │%2d │%2d │%2d │%2d │%2d │\n", board[0], board[1], board[2], board[3], board[4], board[5]);
     pos += sprintf(pos, "├───┼───┼───┼───┼───┼───┤\n");
     pos += sprintf(pos, "  1   2   3   4   5   6  \n");
-    pos += sprintf(pos, "  Player 1 (%s) - Score: %d\n\n", game->player_usernames[PLAYER1], scores[PLAYER1]);
+    pos += sprintf(pos, "  Player 1 (%s) - Score: %d\n\n", username_of(game->players[PLAYER1]), scores[PLAYER1]);
     return pos - output;
 }
 
@@ -293,24 +618,30 @@ int check_game_over(Game *game)
     return side1_empty || side2_empty;
 }
 
-// to string function
-char *game_to_string(Game *game)
+// Get the outcome of a game from the scores
+GameStatus status_from_scores(Game *game)
 {
-    char *str = (char *)malloc(BUFFER_SIZE);
-    if (!str)
+    if (game->state.scores[PLAYER1] > game->state.scores[PLAYER2])
     {
-        perror("Failed to allocate memory for game to string");
-        return NULL;
+        return PLAYER1_WON;
     }
+    if (game->state.scores[PLAYER2] > game->state.scores[PLAYER1])
+    {
+        return PLAYER2_WON;
+    }
+    return DRAW;
+}
 
-    char *pos = str;
-
-    sprintf(pos, "Game ID: %d\nPlayers: %s vs %s\nScores: %s: %d, %s: %d\nBoard: %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d\nNext turn: %s\n",
+// Write a game as text, the board sent to legacy clients, read back by game_from_string
+// Returns the number of characters written to the output buffer
+int game_to_string(Game *game, char *output)
+{
+    return sprintf(output, "Game ID: %d\nPlayers: %s vs %s\nScores: %s: %d, %s: %d\nBoard: %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d\nNext turn: %s\n",
             game->game_id,
-            game->player_usernames[PLAYER1],
-            game->player_usernames[PLAYER2],
-            game->player_usernames[PLAYER1], game->state.scores[PLAYER1],
-            game->player_usernames[PLAYER2], game->state.scores[PLAYER2],
+            username_of(game->players[PLAYER1]),
+            username_of(game->players[PLAYER2]),
+            username_of(game->players[PLAYER1]), game->state.scores[PLAYER1],
+            username_of(game->players[PLAYER2]), game->state.scores[PLAYER2],
             game->state.board[0],
             game->state.board[1],
             game->state.board[2],
@@ -323,9 +654,7 @@ char *game_to_string(Game *game)
             game->state.board[9],
             game->state.board[10],
             game->state.board[11],
-            game->player_usernames[game->state.turn]);
-
-    return str;
+            username_of(game->players[game->state.turn]));
 }
 
 // from string function
@@ -337,12 +666,19 @@ Game *game_from_string(char *str)
         perror("Failed to allocate memory for game from string");
         return NULL;
     }
+    pthread_mutex_init(&game->lock, NULL);
+    game->move_history = NULL;
+    game->move_count = 0;
+    pthread_mutex_init(&game->watchers.lock, NULL);
+    game->watchers.subscribers = NULL;
+    game->watchers.count = 0;
+    game->watchers.capacity = 0;
 
     char *token = strtok(str, "\n");
     if (token == NULL)
     {
         perror("Invalid input string");
-        free(game);
+        delete_game(game);
         return NULL;
     }
     sscanf(token, "Game ID: %d", &game->game_id);
@@ -351,26 +687,30 @@ Game *game_from_string(char *str)
     if (token == NULL)
     {
         perror("Invalid input string");
-        free(game);
+        delete_game(game);
         return NULL;
     }
-    sscanf(token, "Players: %s vs %s", game->player_usernames[PLAYER1], game->player_usernames[PLAYER2]);
+    // The client learns the usernames from the server, it interns them like the server does
+    char player1[USERNAME_MAX_LEN] = "";
+    char player2[USERNAME_MAX_LEN] = "";
+    sscanf(token, "Players: %31s vs %31s", player1, player2);
+    game->players[PLAYER1] = intern_username(player1);
+    game->players[PLAYER2] = intern_username(player2);
 
     token = strtok(NULL, "\n");
     if (token == NULL)
     {
         perror("Invalid input string");
-        free(game);
+        delete_game(game);
         return NULL;
     }
-    sscanf(token, "Scores: %s: %d, %s: %d", game->player_usernames[PLAYER1], &game->state.scores[PLAYER1],
-           game->player_usernames[PLAYER2], &game->state.scores[PLAYER2]);
+    sscanf(token, "Scores: %*s %d, %*s %d", &game->state.scores[PLAYER1], &game->state.scores[PLAYER2]);
 
     token = strtok(NULL, "\n");
     if (token == NULL)
     {
         perror("Invalid input string");
-        free(game);
+        delete_game(game);
         return NULL;
     }
 
@@ -388,9 +728,201 @@ Game *game_from_string(char *str)
            &game->state.board[10],
            &game->state.board[11]);
 
-    char turn[USERNAME_MAX_LEN];
-    sscanf(token, "Next turn: %s", turn);
-    game->state.turn = (strcmp(turn, game->player_usernames[PLAYER1]) == 0) ? PLAYER1 : PLAYER2;
+    char turn[USERNAME_MAX_LEN] = "";
+    sscanf(token, "Next turn: %31s", turn);
+    game->state.turn = (strcmp(turn, username_of(game->players[PLAYER1])) == 0) ? PLAYER1 : PLAYER2;
+    game->state.hash = hash_game_state(&game->state);
 
     return game;
-}
\ No newline at end of file
+}
+
+// ========== Binary board ==========
+
+// Write the state of a game in the layout of a MSG_TYPE_BOARD message, nothing is allocated
+// Returns the number of bytes written to the output buffer, always BOARD_MESSAGE_SIZE
+int encode_game_state(Game *game, char *output)
+{
+    unsigned char *pos = (unsigned char *)output;
+    uint32_t game_id = htonl((uint32_t)game->game_id);
+    uint32_t version = htonl((uint32_t)game->move_count);
+    memcpy(pos, &game_id, 4);
+    memcpy(pos + 4, &version, 4);
+    pos += 8;
+    *pos++ = (unsigned char)game->status;
+    *pos++ = (unsigned char)game->state.turn;
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        // There are only 48 seeds, so every count fits in a byte
+        *pos++ = (unsigned char)game->state.board[i];
+    }
+    *pos++ = (unsigned char)game->state.scores[PLAYER1];
+    *pos++ = (unsigned char)game->state.scores[PLAYER2];
+    for (int i = 0; i < 2; i++)
+    {
+        memset(pos, 0, USERNAME_MAX_LEN);
+        strncpy((char *)pos, username_of(game->players[i]), USERNAME_MAX_LEN - 1);
+        pos += USERNAME_MAX_LEN;
+    }
+    return BOARD_MESSAGE_SIZE;
+}
+
+// Read a board written by encode_game_state into a game owned by the caller
+// Only the ID, players, version, status and state are set, the move history is left alone
+// Returns -1 if the board is malformed
+int decode_game_state(const char *data, Game *game)
+{
+    const unsigned char *pos = (const unsigned char *)data;
+    uint32_t game_id, version;
+    memcpy(&game_id, pos, 4);
+    memcpy(&version, pos + 4, 4);
+    pos += 8;
+    GameStatus status = pos[0];
+    Player turn = pos[1];
+    pos += 2;
+    if (status > DRAW || (turn != PLAYER1 && turn != PLAYER2))
+    {
+        return -1;
+    }
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        game->state.board[i] = pos[i];
+    }
+    pos += NUM_HOLES;
+    game->state.scores[PLAYER1] = pos[0];
+    game->state.scores[PLAYER2] = pos[1];
+    pos += 2;
+
+    char player[USERNAME_MAX_LEN];
+    for (int i = 0; i < 2; i++)
+    {
+        // The padding may be missing if the sender is buggy
+        memcpy(player, pos, USERNAME_MAX_LEN - 1);
+        player[USERNAME_MAX_LEN - 1] = '\0';
+        game->players[i] = intern_username(player);
+        pos += USERNAME_MAX_LEN;
+    }
+
+    game->game_id = (int)ntohl(game_id);
+    game->move_count = (int)ntohl(version);
+    game->status = status;
+    game->state.turn = turn;
+    game->state.hash = hash_game_state(&game->state);
+    return 0;
+}
+
+// ========== Spectator updates ==========
+// Write the whole state of a game for a spectator, the move history isn't included
+// Format: game_id version status turn score1 score2 board[0..11] player1 player2
+// Returns the number of characters written to the output buffer
+int game_snapshot_to_string(Game *game, char *output)
+{
+    char *pos = output;
+    pos += sprintf(pos, "%d %d %d %d %d %d", game->game_id, game->move_count, game->status, game->state.turn,
+                   game->state.scores[PLAYER1], game->state.scores[PLAYER2]);
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        pos += sprintf(pos, " %d", game->state.board[i]);
+    }
+    pos += sprintf(pos, " %s %s", username_of(game->players[PLAYER1]), username_of(game->players[PLAYER2]));
+    return pos - output;
+}
+
+// Read a snapshot written by game_snapshot_to_string
+// Returns NULL if the snapshot is malformed
+Game *game_from_snapshot(const char *str)
+{
+    int game_id, version, status, turn, scores[2], board[NUM_HOLES];
+    char player1[USERNAME_MAX_LEN], player2[USERNAME_MAX_LEN];
+    if (sscanf(str, "%d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %d %31s %31s",
+               &game_id, &version, &status, &turn, &scores[PLAYER1], &scores[PLAYER2],
+               &board[0], &board[1], &board[2], &board[3], &board[4], &board[5],
+               &board[6], &board[7], &board[8], &board[9], &board[10], &board[11], player1, player2) != 20 ||
+        version < 0 || (turn != PLAYER1 && turn != PLAYER2))
+    {
+        return NULL;
+    }
+
+    Game *game = create_game(game_id, intern_username(player1), intern_username(player2));
+    if (!game)
+    {
+        return NULL;
+    }
+    game->move_count = version;
+    game->status = status;
+    game->state.turn = turn;
+    game->state.scores[PLAYER1] = scores[PLAYER1];
+    game->state.scores[PLAYER2] = scores[PLAYER2];
+    memcpy(game->state.board, board, sizeof(board));
+    game->state.hash = hash_game_state(&game->state);
+    return game;
+}
+
+// Write what the last move of a game changed, from the state before the move
+// Format: game_id version hole score1_delta score2_delta status turn, then hole:seeds for each changed hole
+// Returns the number of characters written to the output buffer
+int game_delta_to_string(Game *game, const GameState *before, int hole, char *output)
+{
+    char *pos = output;
+    pos += sprintf(pos, "%d %d %d %d %d %d %d", game->game_id, game->move_count, hole,
+                   game->state.scores[PLAYER1] - before->scores[PLAYER1],
+                   game->state.scores[PLAYER2] - before->scores[PLAYER2],
+                   game->status, game->state.turn);
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        if (game->state.board[i] != before->board[i])
+        {
+            pos += sprintf(pos, " %d:%d", i, game->state.board[i]);
+        }
+    }
+    return pos - output;
+}
+
+// Apply a delta written by game_delta_to_string, if it follows the version of the game
+// Returns:
+//  0 - Applied
+//  1 - Already applied, the delta is older than the game
+// -1 - Malformed delta
+// -2 - Deltas are missing, a new snapshot is needed
+int apply_game_delta(Game *game, const char *str)
+{
+    int game_id, version, hole, score_deltas[2], status, turn, used;
+    if (sscanf(str, "%d %d %d %d %d %d %d%n", &game_id, &version, &hole, &score_deltas[PLAYER1],
+               &score_deltas[PLAYER2], &status, &turn, &used) != 7 ||
+        game_id != game->game_id || hole < 0 || hole >= NUM_HOLES || (turn != PLAYER1 && turn != PLAYER2))
+    {
+        return -1;
+    }
+    if (version <= game->move_count)
+    {
+        return 1;
+    }
+    if (version != game->move_count + 1)
+    {
+        return -2;
+    }
+
+    // Read every changed hole before touching the game, so a malformed delta changes nothing
+    int board[NUM_HOLES];
+    memcpy(board, game->state.board, sizeof(board));
+    const char *pos = str + used;
+    int changed_hole, seeds;
+    while (sscanf(pos, " %d:%d%n", &changed_hole, &seeds, &used) == 2)
+    {
+        if (changed_hole < 0 || changed_hole >= NUM_HOLES)
+        {
+            return -1;
+        }
+        board[changed_hole] = seeds;
+        pos += used;
+    }
+
+    memcpy(game->state.board, board, sizeof(board));
+    game->state.scores[PLAYER1] += score_deltas[PLAYER1];
+    game->state.scores[PLAYER2] += score_deltas[PLAYER2];
+    game->status = status;
+    game->state.turn = turn;
+    game->state.hash = hash_game_state(&game->state);
+    // Also brings the version up to date
+    add_move_to_history(game, hole < NUM_HOLES / 2 ? PLAYER1 : PLAYER2, hole);
+    return 0;
+}
@@ -4,11 +4,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "common.h"
-
-#define NUM_HOLES 12             // Total number of holes on the board
-#define INITIAL_SEEDS_PER_HOLE 4 // Initial seeds in each hole
-#define MAX_WATCHERS 100         // Maximum number of watchers for a game
+#include "intern.h"
+#include "topic.h"
+#include "board.h"
 
 // Player identifiers
 typedef enum
@@ -31,8 +31,26 @@ typedef struct
     int board[NUM_HOLES]; // Seeds in each hole
     int scores[2];        // Scores for each player
     Player turn;          // Current player's turn (PLAYER1 or PLAYER2)
+    // Zobrist hash of the board, the scores and the turn, the same as zobrist_hash of the packed board
+    // make_move updates it, a state filled by hand must be hashed again with hash_game_state
+    uint64_t hash;
 } GameState;
 
+// What do_move changed, enough for undo_move to put the state back
+// The sown holes are the seeds holes after the played one, around the board as many times as needed
+typedef struct
+{
+    uint64_t hash;            // Hash of the state before the move
+    uint8_t player;
+    uint8_t hole;
+    uint8_t seeds;            // Seeds the hole held
+    uint8_t captured_holes;   // Holes captured, going back from the last sown one
+    uint8_t captured_threes;  // Bit i is set if the ith captured hole held 3 seeds, otherwise it held 2
+    uint8_t score_deltas[2];  // Seeds each player got from the move
+    uint8_t over;             // The move ended the game
+    uint8_t swept[NUM_HOLES]; // If the move ended the game, the board before the seeds left went to their owners
+} MoveUndo;
+
 // Move history node
 typedef struct MoveNode
 {
@@ -42,31 +60,84 @@ typedef struct MoveNode
 } MoveNode;
 
 // Game structure
+// Everything but the ID and the players can change during the game, so it is only accessed
+// while holding the game's own lock: moves in different games don't wait on each other
 typedef struct Game
 {
+    pthread_mutex_t lock;
     int game_id;
     // Player 1 is the player that goes first
-    char player_usernames[2][USERNAME_MAX_LEN];
+    UsernameId players[2];
     GameState state;
     MoveNode *move_history;
+    int move_count;
     GameStatus status;
     int visibility; // 0 for private, 1 for public
-    char watch_list[MAX_WATCHERS][USERNAME_MAX_LEN];
-    struct Game *next; // For managing multiple games in a linked list
+    Topic watchers; // Boards are published to the spectators, it has its own lock
+    int journal_dirty; // Changed since the last snapshot of the game
 } Game;
 
+// Initial number of slots of the game index tables, always a power of two
+#define GAME_INDEX_INITIAL_CAPACITY 64
+
+typedef enum
+{
+    GAME_SLOT_EMPTY = 0,
+    GAME_SLOT_USED,
+    // A removed game, kept so that probing continues past it
+    GAME_SLOT_DELETED
+} GameSlotState;
+
+typedef struct
+{
+    int game_id;
+    GameSlotState state;
+    Game *game;
+} GameSlot;
+
+// Ongoing games of a player
+typedef struct
+{
+    UsernameId player; // NO_USERNAME for an unused slot
+    Game **games;
+    int count;
+    int capacity;
+} PlayerGames;
+
+// All the games known to the server, indexed by ID with open addressing (linear probing),
+// plus the ongoing games of each player so they don't have to be searched for
+// A zeroed GameIndex is a valid empty index
+typedef struct
+{
+    GameSlot *slots;
+    size_t capacity;
+    size_t count; // Used slots
+    size_t used;  // Used and deleted slots
+
+    PlayerGames *players;
+    size_t players_capacity;
+    size_t players_count;
+} GameIndex;
+
 // Function prototypes
 
 // Game management
-Game *create_game(int game_id, const char *player1_username, const char *player2_username);
+Game *create_game(int game_id, UsernameId player1, UsernameId player2);
 void delete_game(Game *game);
-void add_game(Game **game_list, Game *new_game);
-Game *find_game_by_id(Game *game_list, int game_id);
-void remove_game(Game **game_list, int game_id);
+void add_game(GameIndex *index, Game *new_game);
+Game *find_game_by_id(GameIndex *index, int game_id);
+void remove_game(GameIndex *index, int game_id);
+void finish_game(GameIndex *index, Game *game, GameStatus status);
+PlayerGames *find_player_games(GameIndex *index, UsernameId player);
 
 // Move management
 int make_move(Game *game, int player, int hole);
 int is_valid_move(Game *game, int player, int hole);
+void pack_state(const GameState *state, PackedState *packed);
+void unpack_state(const PackedState *packed, GameState *state);
+uint64_t hash_game_state(const GameState *state);
+int do_move(GameState *state, int hole, MoveUndo *undo);
+void undo_move(GameState *state, const MoveUndo *undo);
 
 // Move history management
 void add_move_to_history(Game *game, int player, int hole);
@@ -74,12 +145,23 @@ void free_move_history(MoveNode *history);
 
 // Utility functions
 int check_game_over(Game *game);
+GameStatus status_from_scores(Game *game);
 int pretty_board_state(Game *game, char *output);
 
-// to string
-char *game_to_string(Game *game);
+// to string, the board sent to legacy clients
+int game_to_string(Game *game, char *output);
 
 // from string
 Game *game_from_string(char *str);
 
+// Binary board of a MSG_TYPE_BOARD message, for framed clients
+int encode_game_state(Game *game, char *output);
+int decode_game_state(const char *data, Game *game);
+
+// Spectator updates, the version of a game is its number of moves
+int game_snapshot_to_string(Game *game, char *output);
+Game *game_from_snapshot(const char *str);
+int game_delta_to_string(Game *game, const GameState *before, int hole, char *output);
+int apply_game_delta(Game *game, const char *str);
+
 #endif // GAME_H
@@ -0,0 +1,138 @@
+#include "idset.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static size_t slot_of(uint32_t id, size_t mask)
+{
+    // Spread consecutive IDs over the table
+    uint32_t hash = id * 2654435761u;
+    return (hash ^ (hash >> 16)) & mask;
+}
+
+// Rebuild the table with a new capacity
+// Returns -1 if the memory can't be allocated
+static int resize_idset(IdSet *set, size_t capacity)
+{
+    uint32_t *slots = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+    if (!slots)
+    {
+        perror("Failed to allocate memory for ID set");
+        return -1;
+    }
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < set->capacity; i++)
+    {
+        if (set->slots[i] == 0)
+        {
+            continue;
+        }
+        size_t j = slot_of(set->slots[i], mask);
+        while (slots[j] != 0)
+        {
+            j = (j + 1) & mask;
+        }
+        slots[j] = set->slots[i];
+    }
+
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+    return 0;
+}
+
+// Returns:
+// 1 - Added
+// 0 - Already in the set
+// -1 - Error
+int idset_add(IdSet *set, uint32_t id)
+{
+    if (idset_contains(set, id))
+    {
+        return 0;
+    }
+
+    // Keep the load factor under 3/4
+    if ((set->count + 1) * 4 > set->capacity * 3 &&
+        resize_idset(set, set->capacity ? set->capacity * 2 : IDSET_MIN_CAPACITY) == -1)
+    {
+        return -1;
+    }
+
+    size_t mask = set->capacity - 1;
+    size_t i = slot_of(id, mask);
+    while (set->slots[i] != 0)
+    {
+        i = (i + 1) & mask;
+    }
+    set->slots[i] = id;
+    set->count++;
+    return 1;
+}
+
+// Returns 1 if the ID was removed, 0 if it wasn't in the set
+int idset_remove(IdSet *set, uint32_t id)
+{
+    if (set->capacity == 0)
+    {
+        return 0;
+    }
+
+    size_t mask = set->capacity - 1;
+    size_t i = slot_of(id, mask);
+    while (set->slots[i] != id)
+    {
+        if (set->slots[i] == 0)
+        {
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+
+    // Shift the following IDs back instead of leaving a deleted marker, so probes stay short
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; set->slots[j] != 0; j = (j + 1) & mask)
+    {
+        size_t home = slot_of(set->slots[j], mask);
+        // The ID can fill the hole if its home slot isn't between the hole and its slot
+        if (((j - home) & mask) >= ((j - hole) & mask))
+        {
+            set->slots[hole] = set->slots[j];
+            hole = j;
+        }
+    }
+    set->slots[hole] = 0;
+    set->count--;
+
+    if (set->count == 0)
+    {
+        idset_free(set);
+    }
+    return 1;
+}
+
+int idset_contains(const IdSet *set, uint32_t id)
+{
+    if (set->capacity == 0 || id == 0)
+    {
+        return 0;
+    }
+
+    size_t mask = set->capacity - 1;
+    for (size_t i = slot_of(id, mask); set->slots[i] != 0; i = (i + 1) & mask)
+    {
+        if (set->slots[i] == id)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void idset_free(IdSet *set)
+{
+    free(set->slots);
+    set->slots = NULL;
+    set->capacity = 0;
+    set->count = 0;
+}
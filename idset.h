@@ -0,0 +1,25 @@
+#ifndef IDSET_H
+#define IDSET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Smallest number of slots of a set that holds IDs, always a power of two
+#define IDSET_MIN_CAPACITY 8
+
+// A set of non-zero IDs with open addressing (linear probing), 0 marks an empty slot
+// A zeroed IdSet is a valid empty set and holds no memory
+typedef struct
+{
+    uint32_t *slots;
+    size_t capacity;
+    size_t count;
+} IdSet;
+
+// Function prototypes
+int idset_add(IdSet *set, uint32_t id);
+int idset_remove(IdSet *set, uint32_t id);
+int idset_contains(const IdSet *set, uint32_t id);
+void idset_free(IdSet *set);
+
+#endif // IDSET_H
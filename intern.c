@@ -0,0 +1,157 @@
+#include "intern.h"
+#include <pthread.h>
+
+// A slot of the lookup table, open addressing with linear probing
+typedef struct
+{
+    uint32_t hash;
+    UsernameId id; // NO_USERNAME for an empty slot
+} InternSlot;
+
+// Names by ID, a chunk is allocated once its first name is given out
+static char (*name_chunks[INTERN_MAX_CHUNKS])[USERNAME_MAX_LEN];
+static UsernameId name_count = 0;
+
+// IDs by name, names are never removed so the table only grows
+static InternSlot *intern_slots = NULL;
+static size_t intern_capacity = 0;
+static pthread_rwlock_t intern_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static char *name_of(UsernameId id)
+{
+    return name_chunks[(id - 1) / INTERN_CHUNK_NAMES][(id - 1) % INTERN_CHUNK_NAMES];
+}
+
+// Find the slot of a username, or the empty slot where it would go, must hold the lock
+static InternSlot *find_slot(const char *username, uint32_t hash)
+{
+    size_t mask = intern_capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        InternSlot *slot = &intern_slots[i];
+        if (slot->id == NO_USERNAME ||
+            (slot->hash == hash && strcmp(name_of(slot->id), username) == 0))
+        {
+            return slot;
+        }
+    }
+}
+
+// Rebuild the table with a new capacity, must hold the lock for writing
+// Returns -1 if the memory can't be allocated
+static int resize_intern_table(size_t capacity)
+{
+    InternSlot *slots = (InternSlot *)calloc(capacity, sizeof(InternSlot));
+    if (!slots)
+    {
+        perror("Failed to allocate memory for username table");
+        return -1;
+    }
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < intern_capacity; i++)
+    {
+        if (intern_slots[i].id == NO_USERNAME)
+        {
+            continue;
+        }
+        size_t j = intern_slots[i].hash & mask;
+        while (slots[j].id != NO_USERNAME)
+        {
+            j = (j + 1) & mask;
+        }
+        slots[j] = intern_slots[i];
+    }
+
+    free(intern_slots);
+    intern_slots = slots;
+    intern_capacity = capacity;
+    return 0;
+}
+
+// Get the ID of a username, giving it the next one the first time it is seen
+// Returns NO_USERNAME if the username is empty or too long, or on error
+UsernameId intern_username(const char *username)
+{
+    size_t len = strnlen(username, USERNAME_MAX_LEN);
+    if (len == 0 || len >= USERNAME_MAX_LEN)
+    {
+        return NO_USERNAME;
+    }
+
+    // Most names are already known, only take the lock for writing to add one
+    UsernameId id = find_username_id(username);
+    if (id != NO_USERNAME)
+    {
+        return id;
+    }
+
+    uint32_t hash = hash_string(username);
+    pthread_rwlock_wrlock(&intern_lock);
+
+    // Keep the load factor under 3/4
+    if ((name_count + 1) * 4 > intern_capacity * 3 &&
+        resize_intern_table(intern_capacity ? intern_capacity * 2 : INTERN_INITIAL_CAPACITY) == -1)
+    {
+        pthread_rwlock_unlock(&intern_lock);
+        return NO_USERNAME;
+    }
+
+    // Another thread may have added it in the meantime
+    InternSlot *slot = find_slot(username, hash);
+    if (slot->id == NO_USERNAME)
+    {
+        size_t chunk = name_count / INTERN_CHUNK_NAMES;
+        if (chunk >= INTERN_MAX_CHUNKS)
+        {
+            fprintf(stderr, "Too many usernames\n");
+            pthread_rwlock_unlock(&intern_lock);
+            return NO_USERNAME;
+        }
+        if (!name_chunks[chunk])
+        {
+            name_chunks[chunk] = calloc(INTERN_CHUNK_NAMES, USERNAME_MAX_LEN);
+            if (!name_chunks[chunk])
+            {
+                perror("Failed to allocate memory for username table");
+                pthread_rwlock_unlock(&intern_lock);
+                return NO_USERNAME;
+            }
+        }
+
+        // The name is written before its ID is handed out
+        UsernameId new_id = name_count + 1;
+        memcpy(name_of(new_id), username, len + 1);
+        name_count = new_id;
+        slot->hash = hash;
+        slot->id = new_id;
+    }
+    id = slot->id;
+
+    pthread_rwlock_unlock(&intern_lock);
+    return id;
+}
+
+// Get the ID of a username without adding it
+// Returns NO_USERNAME if the username was never interned
+UsernameId find_username_id(const char *username)
+{
+    uint32_t hash = hash_string(username);
+
+    pthread_rwlock_rdlock(&intern_lock);
+    UsernameId id = intern_capacity ? find_slot(username, hash)->id : NO_USERNAME;
+    pthread_rwlock_unlock(&intern_lock);
+
+    return id;
+}
+
+// Get the username of an ID, names never move so no lock is needed
+// Returns an empty string for NO_USERNAME
+const char *username_of(UsernameId id)
+{
+    if (id == NO_USERNAME)
+    {
+        return "";
+    }
+    return name_of(id);
+}
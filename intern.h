@@ -0,0 +1,26 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stdint.h>
+#include "common.h"
+
+// Dense number given to each username seen by the process, so that players, watchers and
+// logged in clients are compared as integers, the names are only needed to talk to clients
+// and to write them to disk. Usernames are never forgotten, IDs stay valid until the process exits
+typedef uint32_t UsernameId;
+
+// Not the ID of any username
+#define NO_USERNAME 0
+
+// Names are stored in chunks that never move, so they can be read without locking
+#define INTERN_CHUNK_NAMES 4096
+#define INTERN_MAX_CHUNKS 65536
+// Initial number of slots of the lookup table, always a power of two
+#define INTERN_INITIAL_CAPACITY 1024
+
+// Function prototypes
+UsernameId intern_username(const char *username);
+UsernameId find_username_id(const char *username);
+const char *username_of(UsernameId id);
+
+#endif // INTERN_H
@@ -0,0 +1,639 @@
+#include "journal.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <semaphore.h>
+#include <time.h>
+
+static char journal_dir[1024];
+static FsyncPolicy fsync_policy = FSYNC_GROUP;
+static int group_commit_ms = DEFAULT_GROUP_COMMIT_MS;
+static SnapshotFunction snapshot_games = NULL;
+
+// Journal files found at startup, replayed in order
+static int *replay_seqs = NULL;
+static size_t replay_count = 0;
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int journal_fd = -1;
+static int journal_seq = 0; // Sequence of the file being written
+static int oldest_seq = 0;  // Oldest file still needed to recover the games
+static size_t journal_bytes = 0;
+
+// Records waiting for the writer thread, in a lock-free queue with many producers and a single consumer
+typedef struct PendingRecord
+{
+    struct PendingRecord *next;
+    Game *game;
+    uint64_t enqueued_us;
+    size_t size;
+    char data[sizeof(JournalRecord) + 2 * USERNAME_MAX_LEN];
+} PendingRecord;
+
+// The stub keeps the queue from ever being empty, so producers only touch the tail
+static PendingRecord queue_stub;
+static PendingRecord *queue_head = &queue_stub; // Only used by the writer thread
+static PendingRecord *queue_tail = &queue_stub;
+static sem_t queue_sem;
+static int writer_running = 0;
+static JournalStats stats = {0, 0, 0, 0, 0};
+
+// Games with records that aren't in their snapshot yet
+static Game **dirty_games = NULL;
+static size_t dirty_count = 0;
+static size_t dirty_capacity = 0;
+
+static void journal_path(int seq, char *path, size_t size)
+{
+    snprintf(path, size, "%s%s%d%s", journal_dir, JOURNAL_PREFIX, seq, JOURNAL_SUFFIX);
+}
+
+static int open_journal_file(int seq)
+{
+    char path[1100];
+    journal_path(seq, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1)
+    {
+        perror("Failed to open journal");
+    }
+    return fd;
+}
+
+static int compare_seqs(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// Remember that a game has to be snapshotted by the next compaction, must hold the journal mutex
+static void mark_dirty(Game *game)
+{
+    if (game->journal_dirty)
+    {
+        return;
+    }
+
+    if (dirty_count == dirty_capacity)
+    {
+        size_t capacity = dirty_capacity ? dirty_capacity * 2 : 64;
+        Game **games = (Game **)realloc(dirty_games, capacity * sizeof(Game *));
+        if (!games)
+        {
+            perror("Failed to allocate memory for journal");
+            return;
+        }
+        dirty_games = games;
+        dirty_capacity = capacity;
+    }
+    dirty_games[dirty_count++] = game;
+    game->journal_dirty = 1;
+}
+
+// ========== Startup ==========
+// Find the journal files left by the previous run and start a new one
+// Returns -1 if the journal can't be written
+int journal_init(const char *dir, FsyncPolicy policy, int commit_ms, SnapshotFunction snapshot)
+{
+    snprintf(journal_dir, sizeof(journal_dir), "%s", dir);
+    fsync_policy = policy;
+    group_commit_ms = commit_ms;
+    snapshot_games = snapshot;
+
+    DIR *d = opendir(dir);
+    if (!d)
+    {
+        perror("Failed to open journal directory");
+        return -1;
+    }
+
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        int seq;
+        char suffix[8];
+        if (sscanf(entry->d_name, JOURNAL_PREFIX "%d%7s", &seq, suffix) != 2 || strcmp(suffix, JOURNAL_SUFFIX) != 0)
+        {
+            continue;
+        }
+        if (replay_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 8;
+            replay_seqs = (int *)realloc(replay_seqs, capacity * sizeof(int));
+            if (!replay_seqs)
+            {
+                perror("Failed to allocate memory for journal");
+                closedir(d);
+                return -1;
+            }
+        }
+        replay_seqs[replay_count++] = seq;
+    }
+    closedir(d);
+
+    qsort(replay_seqs, replay_count, sizeof(int), compare_seqs);
+    oldest_seq = replay_count > 0 ? replay_seqs[0] : 1;
+    journal_seq = replay_count > 0 ? replay_seqs[replay_count - 1] + 1 : 1;
+
+    journal_fd = open_journal_file(journal_seq);
+    return journal_fd == -1 ? -1 : 0;
+}
+
+// Apply a record to the games loaded from the snapshots
+static void apply_record(GameIndex *index, JournalRecord *rec, const char *payload)
+{
+    Game *game = find_game_by_id(index, rec->game_id);
+
+    switch (rec->type)
+    {
+    case JOURNAL_GAME_CREATED:
+        if (!game)
+        {
+            game = create_game(rec->game_id, intern_username(payload), intern_username(payload + USERNAME_MAX_LEN));
+            if (!game)
+            {
+                return;
+            }
+            game->state.turn = rec->player;
+            game->state.hash = hash_game_state(&game->state);
+            add_game(index, game);
+        }
+        break;
+    case JOURNAL_MOVE:
+    {
+        // Moves older than the snapshot are already on the board
+        if (!game || game->status != ONGOING || rec->move_number != game->move_count)
+        {
+            return;
+        }
+        int result = make_move(game, rec->player, rec->hole);
+        if (result < 0)
+        {
+            fprintf(stderr, "Journal move %d of game %d doesn't apply\n", rec->move_number, rec->game_id);
+            return;
+        }
+        if (result == 1)
+        {
+            finish_game(index, game, status_from_scores(game));
+        }
+        break;
+    }
+    case JOURNAL_GAME_FINISHED:
+        if (!game)
+        {
+            return;
+        }
+        finish_game(index, game, (GameStatus)rec->player);
+        break;
+    default:
+        return;
+    }
+
+    mark_dirty(game);
+}
+
+// Size of a record with its payload
+static size_t record_size(const JournalRecord *rec)
+{
+    return sizeof(JournalRecord) + (rec->type == JOURNAL_GAME_CREATED ? 2 * USERNAME_MAX_LEN : 0);
+}
+
+static void replay_file(GameIndex *index, int seq, int *max_game_id)
+{
+    char path[1100];
+    journal_path(seq, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror("Failed to open journal for replay");
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
+    }
+
+    size_t size = st.st_size;
+    char *data = (char *)malloc(size ? size : 1);
+    size_t len = 0;
+    while (data && len < size)
+    {
+        ssize_t n = read(fd, data + len, size - len);
+        if (n <= 0)
+        {
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    if (!data)
+    {
+        perror("Failed to allocate memory for journal replay");
+        return;
+    }
+
+    size_t offset = 0;
+    size_t records = 0;
+    while (offset + sizeof(JournalRecord) <= len)
+    {
+        JournalRecord rec;
+        memcpy(&rec, data + offset, sizeof(JournalRecord));
+        size_t rec_size = record_size(&rec);
+        // A crash during a write leaves a partial record at the end
+        if (offset + rec_size > len ||
+            rec.checksum != hash_bytes(data + offset + sizeof(uint32_t), rec_size - sizeof(uint32_t)))
+        {
+            break;
+        }
+
+        apply_record(index, &rec, data + offset + sizeof(JournalRecord));
+        if (rec.game_id > *max_game_id)
+        {
+            *max_game_id = rec.game_id;
+        }
+        offset += rec_size;
+        records++;
+    }
+
+    if (offset < len)
+    {
+        fprintf(stderr, "Ignoring %zu bytes at the end of %s\n", len - offset, path);
+    }
+    printf("Replayed %zu records from %s\n", records, path);
+    free(data);
+}
+
+// Apply the journals left by the previous run to the games loaded from the snapshots
+// Returns the highest game ID found in the journals, 0 if there are none
+int journal_replay(GameIndex *index)
+{
+    int max_game_id = 0;
+    for (size_t i = 0; i < replay_count; i++)
+    {
+        replay_file(index, replay_seqs[i], &max_game_id);
+    }
+
+    free(replay_seqs);
+    replay_seqs = NULL;
+    replay_count = 0;
+    return max_game_id;
+}
+
+// Make the renames of the snapshots durable
+static void sync_directory(void)
+{
+    int fd = open(journal_dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1)
+    {
+        perror("Failed to open journal directory");
+        return;
+    }
+    fsync(fd);
+    close(fd);
+}
+
+// Delete the journals before the current one, once their records are in the snapshot
+static void delete_old_journals(void)
+{
+    for (int seq = oldest_seq; seq < journal_seq; seq++)
+    {
+        char path[1100];
+        journal_path(seq, path, sizeof(path));
+        unlink(path);
+    }
+    oldest_seq = journal_seq;
+}
+
+// Snapshot all the games, then delete the journals recorded before
+// Nothing is snapshotted if no record was written since the last compaction, unless forced
+// Returns -1 if the games couldn't be snapshotted, the journals are then kept until the next compaction
+int journal_compact(int force)
+{
+    // Later records go to a new journal
+    pthread_mutex_lock(&journal_mutex);
+    if (!force && journal_bytes == 0 && dirty_count == 0)
+    {
+        // The journals left by the previous run had nothing to replay
+        delete_old_journals();
+        pthread_mutex_unlock(&journal_mutex);
+        return 0;
+    }
+    int fd = open_journal_file(journal_seq + 1);
+    if (fd == -1)
+    {
+        pthread_mutex_unlock(&journal_mutex);
+        return -1;
+    }
+    fdatasync(journal_fd);
+    close(journal_fd);
+    journal_fd = fd;
+    journal_seq++;
+    journal_bytes = 0;
+
+    Game **games = dirty_games;
+    size_t count = dirty_count;
+    dirty_games = NULL;
+    dirty_count = 0;
+    dirty_capacity = 0;
+    pthread_mutex_unlock(&journal_mutex);
+
+    // A move made meanwhile is both in the snapshot and in the new journal, the replay skips it
+    int saved = snapshot_games(games, count) == 0;
+
+    // The writer thread marks games dirty, the flag is only changed while holding the journal mutex
+    pthread_mutex_lock(&journal_mutex);
+    for (size_t i = 0; i < count; i++)
+    {
+        games[i]->journal_dirty = 0;
+        if (!saved)
+        {
+            // Try again with the next compaction
+            mark_dirty(games[i]);
+        }
+    }
+    pthread_mutex_unlock(&journal_mutex);
+    free(games);
+
+    if (!saved)
+    {
+        return -1;
+    }
+
+    sync_directory();
+    delete_old_journals();
+    return 0;
+}
+
+// ========== Writer thread ==========
+// Push a record to the queue, from any thread and without taking a lock
+static void push_pending(PendingRecord *pending)
+{
+    pending->next = NULL;
+    PendingRecord *prev = __atomic_exchange_n(&queue_tail, pending, __ATOMIC_ACQ_REL);
+    // Until this store, the consumer sees the queue as cut after prev and waits for the next wakeup
+    __atomic_store_n(&prev->next, pending, __ATOMIC_RELEASE);
+}
+
+// Pop the oldest record, only called by the writer thread
+// Returns NULL if the queue is empty or a push isn't finished yet
+static PendingRecord *pop_pending(void)
+{
+    PendingRecord *head = queue_head;
+    PendingRecord *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (head == &queue_stub)
+    {
+        if (!next)
+        {
+            return NULL;
+        }
+        queue_head = next;
+        head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+    if (next)
+    {
+        queue_head = next;
+        return head;
+    }
+
+    // head is the last record, put the stub back behind it so it can be taken
+    if (head != __atomic_load_n(&queue_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    push_pending(&queue_stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next)
+    {
+        queue_head = next;
+        return head;
+    }
+    return NULL;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Write every queued record with a single write and flush them with a single fsync
+static void commit_batch(void)
+{
+    static char *batch = NULL;
+    static size_t batch_capacity = 0;
+
+    PendingRecord *first = NULL;
+    PendingRecord **last = &first;
+    size_t size = 0;
+    size_t count = 0;
+    PendingRecord *pending;
+    while ((pending = pop_pending()) != NULL)
+    {
+        if (size + pending->size > batch_capacity)
+        {
+            size_t capacity = batch_capacity ? batch_capacity * 2 : 64 * 1024;
+            char *grown = (char *)realloc(batch, capacity);
+            if (!grown)
+            {
+                perror("Failed to allocate memory for journal batch");
+                // Put it back at the end of the queue, it is committed with the next batch
+                push_pending(pending);
+                break;
+            }
+            batch = grown;
+            batch_capacity = capacity;
+        }
+        memcpy(batch + size, pending->data, pending->size);
+        size += pending->size;
+        count++;
+        *last = pending;
+        last = &pending->next;
+    }
+    *last = NULL;
+    if (count == 0)
+    {
+        return;
+    }
+
+    // The compaction doesn't switch files in the middle of a batch
+    pthread_mutex_lock(&journal_mutex);
+    ssize_t n = write(journal_fd, batch, size);
+    if (n != (ssize_t)size)
+    {
+        perror("Failed to write to journal");
+    }
+    else
+    {
+        journal_bytes += size;
+    }
+    if (fsync_policy != FSYNC_NONE && fdatasync(journal_fd) == -1)
+    {
+        perror("Failed to flush journal");
+    }
+    for (pending = first; pending; pending = pending->next)
+    {
+        mark_dirty(pending->game);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+
+    // The oldest record of the batch waited the longest
+    uint64_t latency = now_us() - first->enqueued_us;
+    __atomic_fetch_sub(&stats.pending_records, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.batches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.total_latency_us, latency, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats.last_latency_us, latency, __ATOMIC_RELAXED);
+    if (latency > stats.max_latency_us)
+    {
+        __atomic_store_n(&stats.max_latency_us, latency, __ATOMIC_RELAXED);
+    }
+
+    while (first)
+    {
+        pending = first;
+        first = first->next;
+        free(pending);
+    }
+}
+
+// The only thread that writes to the journal file
+static void *writer_thread(void *arg)
+{
+    (void)arg;
+    while (1)
+    {
+        if (sem_wait(&queue_sem) == -1)
+        {
+            continue;
+        }
+        if (fsync_policy == FSYNC_GROUP)
+        {
+            // Let the records made meanwhile join the batch
+            usleep(group_commit_ms * 1000);
+        }
+
+        // A record is linked before its wakeup is posted, so the wakeups taken here are for records the batch sees
+        while (sem_trywait(&queue_sem) == 0)
+        {
+        }
+        commit_batch();
+    }
+    return NULL;
+}
+
+// ========== Compaction thread ==========
+// Compact the journal when it gets too big
+static void *compaction_thread(void *arg)
+{
+    // The games replayed at startup are snapshotted right away
+    journal_compact(*(int *)arg);
+
+    while (1)
+    {
+        usleep(100 * 1000);
+
+        pthread_mutex_lock(&journal_mutex);
+        int compact = journal_bytes >= JOURNAL_COMPACT_BYTES;
+        pthread_mutex_unlock(&journal_mutex);
+
+        if (compact)
+        {
+            journal_compact(0);
+        }
+    }
+    return NULL;
+}
+
+// Start writing the queued records, and compacting the journal
+// force_snapshot makes the first compaction snapshot the games even if no journal was replayed
+void start_journal_threads(int force_snapshot)
+{
+    static int first_compaction;
+    first_compaction = force_snapshot;
+    sem_init(&queue_sem, 0, 0);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, writer_thread, NULL) != 0 ||
+        pthread_detach(tid) != 0 ||
+        pthread_create(&tid, NULL, compaction_thread, &first_compaction) != 0 ||
+        pthread_detach(tid) != 0)
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+    writer_running = 1;
+}
+
+void get_journal_stats(JournalStats *out)
+{
+    out->pending_records = __atomic_load_n(&stats.pending_records, __ATOMIC_RELAXED);
+    out->batches = __atomic_load_n(&stats.batches, __ATOMIC_RELAXED);
+    out->total_latency_us = __atomic_load_n(&stats.total_latency_us, __ATOMIC_RELAXED);
+    out->last_latency_us = __atomic_load_n(&stats.last_latency_us, __ATOMIC_RELAXED);
+    out->max_latency_us = __atomic_load_n(&stats.max_latency_us, __ATOMIC_RELAXED);
+}
+
+// ========== Records ==========
+// Hand a record over to the writer thread, the caller holds the game's lock so records of a game stay in order
+static void append_record(Game *game, JournalRecord *rec, const void *payload)
+{
+    PendingRecord *pending = (PendingRecord *)malloc(sizeof(PendingRecord));
+    if (!pending)
+    {
+        perror("Failed to allocate memory for journal record");
+        return;
+    }
+    pending->game = game;
+    pending->size = record_size(rec);
+    memcpy(pending->data, rec, sizeof(JournalRecord));
+    if (payload)
+    {
+        memcpy(pending->data + sizeof(JournalRecord), payload, pending->size - sizeof(JournalRecord));
+    }
+    uint32_t checksum = hash_bytes(pending->data + sizeof(uint32_t), pending->size - sizeof(uint32_t));
+    memcpy(pending->data, &checksum, sizeof(uint32_t));
+    pending->enqueued_us = now_us();
+
+    __atomic_fetch_add(&stats.pending_records, 1, __ATOMIC_RELAXED);
+    push_pending(pending);
+    if (writer_running)
+    {
+        sem_post(&queue_sem);
+    }
+}
+
+void journal_game_created(Game *game)
+{
+    JournalRecord rec = {0};
+    rec.type = JOURNAL_GAME_CREATED;
+    rec.player = game->state.turn;
+    rec.game_id = game->game_id;
+    // The record carries the usernames, IDs are only valid in this process
+    char usernames[2][USERNAME_MAX_LEN] = {{0}};
+    strcpy(usernames[PLAYER1], username_of(game->players[PLAYER1]));
+    strcpy(usernames[PLAYER2], username_of(game->players[PLAYER2]));
+    append_record(game, &rec, usernames);
+}
+
+// Record the last move of a game
+void journal_move(Game *game)
+{
+    JournalRecord rec = {0};
+    rec.type = JOURNAL_MOVE;
+    rec.player = game->move_history->player;
+    rec.hole = game->move_history->hole;
+    rec.game_id = game->game_id;
+    rec.move_number = game->move_count - 1;
+    append_record(game, &rec, NULL);
+}
+
+void journal_game_finished(Game *game)
+{
+    JournalRecord rec = {0};
+    rec.type = JOURNAL_GAME_FINISHED;
+    rec.player = game->status;
+    rec.game_id = game->game_id;
+    append_record(game, &rec, NULL);
+}
@@ -0,0 +1,74 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "game.h"
+
+// Journal files are named journal_<sequence>.log in the games directory
+#define JOURNAL_PREFIX "journal_"
+#define JOURNAL_SUFFIX ".log"
+// Interval between two flushes of the journal to disk with FSYNC_GROUP, in milliseconds
+#define DEFAULT_GROUP_COMMIT_MS 10
+// All the games are snapshotted and a new journal is started once the current one reaches this size
+#define JOURNAL_COMPACT_BYTES (16 * 1024 * 1024)
+
+// When the journal is flushed to disk
+typedef enum
+{
+    // As soon as the writer thread has written what is queued
+    FSYNC_EVERY,
+    // Every few milliseconds, for all the records queued in the meantime
+    FSYNC_GROUP,
+    // Left to the system
+    FSYNC_NONE
+} FsyncPolicy;
+
+typedef enum
+{
+    JOURNAL_GAME_CREATED = 1, // Followed by the usernames of the two players
+    JOURNAL_MOVE = 2,
+    JOURNAL_GAME_FINISHED = 3
+} JournalRecordType;
+
+// A record of the journal, as written to disk
+typedef struct
+{
+    uint32_t checksum; // Of the rest of the record, a torn write at the end of the file doesn't match
+    uint8_t type;
+    uint8_t player; // Player of a move, first player of a new game, status of a finished game
+    uint8_t hole;
+    uint8_t reserved;
+    int32_t game_id;
+    int32_t move_number; // Index of the move in the game, so a move already in a snapshot is skipped
+} JournalRecord;
+
+// Counters of the writer thread
+typedef struct
+{
+    long pending_records; // Queued and not yet written to disk
+    long batches;         // Writes, each followed by a single fsync
+    uint64_t total_latency_us;
+    uint64_t last_latency_us; // From the oldest record of a batch being queued to the batch being on disk
+    uint64_t max_latency_us;
+} JournalStats;
+
+// Saves every game, including the changed ones that may not be in the index yet
+// Returns -1 if the games couldn't be saved
+typedef int (*SnapshotFunction)(Game **changed, size_t count);
+
+// Function prototypes
+
+// Startup
+int journal_init(const char *dir, FsyncPolicy policy, int group_commit_ms, SnapshotFunction snapshot);
+int journal_replay(GameIndex *index);
+int journal_compact(int force);
+void start_journal_threads(int force_snapshot);
+void get_journal_stats(JournalStats *stats);
+
+// Records, queued while holding the game's lock and written by the writer thread
+void journal_game_created(Game *game);
+void journal_move(Game *game);
+void journal_game_finished(Game *game);
+
+#endif // JOURNAL_H
@@ -0,0 +1,168 @@
+#include "common.h"
+#include "user.h"
+#include "userdb.h"
+#include <dirent.h>
+
+// Moves the users of the previous versions, one <username>.dat file each, to the user database
+// The server must be stopped, the files are left in place and can be deleted once the server runs
+// A file holds the password, the biography, then one friend per line
+
+// Get the username of a user file, from its name without .dat
+// Returns 0 if the file isn't a user file
+static int username_of_file(const char *filename, char *username)
+{
+    size_t name_len = strlen(filename);
+    if (name_len <= 4 || strcmp(filename + name_len - 4, ".dat") != 0)
+    {
+        return 0;
+    }
+    if (name_len - 4 >= USERNAME_MAX_LEN)
+    {
+        fprintf(stderr, "Skipping %s, the username is too long\n", filename);
+        return 0;
+    }
+    memcpy(username, filename, name_len - 4);
+    username[name_len - 4] = '\0';
+    return 1;
+}
+
+// Read a line without its newline
+// Returns -1 at the end of the file
+static int read_line(FILE *fp, char *line, size_t size)
+{
+    if (fgets(line, size, fp) == NULL)
+    {
+        return -1;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    return 0;
+}
+
+// Copy the password and biography of a user file to the database
+// Returns -1 on error
+static int migrate_user(FILE *fp, const char *username)
+{
+    User user;
+    memset(&user, 0, sizeof(User));
+    strcpy(user.username, username);
+    if (read_line(fp, user.password, sizeof(user.password)) == -1 ||
+        read_line(fp, user.biography, sizeof(user.biography)) == -1)
+    {
+        return -1;
+    }
+    uint32_t user_id;
+    return user_db_save(&user, &user_id) == 1 ? 0 : -1;
+}
+
+// Copy the friends of a user file to the database, once all the users have their ID
+// Returns -1 on error
+static int migrate_friends(FILE *fp, const char *username)
+{
+    uint32_t user_id = user_db_find_id(username);
+    char line[1024];
+    if (user_id == 0 || read_line(fp, line, sizeof(line)) == -1 || read_line(fp, line, sizeof(line)) == -1)
+    {
+        return -1;
+    }
+
+    IdSet friends = {NULL, 0, 0};
+    int result = 0;
+    while (result == 0 && read_line(fp, line, sizeof(line)) == 0)
+    {
+        uint32_t friend_id = user_db_find_id(line);
+        if (line[0] == '\0' || friend_id == 0 || friend_id == user_id || idset_add(&friends, friend_id) != 1)
+        {
+            continue;
+        }
+        if (user_db_add_id(user_id, USER_FRIENDS, friend_id) != 1 ||
+            user_db_add_id(friend_id, USER_FOLLOWERS, user_id) != 1)
+        {
+            result = -1;
+        }
+    }
+    idset_free(&friends);
+    return result;
+}
+
+// Run a migration step on every user file of a directory
+// Returns the number of files that failed
+static size_t for_each_user_file(const char *dir, int (*step)(FILE *, const char *), size_t *done)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+    {
+        perror("Failed to open users directory");
+        return 1;
+    }
+
+    size_t failed = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        char username[USERNAME_MAX_LEN];
+        if (!username_of_file(entry->d_name, username))
+        {
+            continue;
+        }
+
+        char filepath[1400];
+        snprintf(filepath, sizeof(filepath), "%s%s", dir, entry->d_name);
+        FILE *fp = fopen(filepath, "r");
+        if (!fp || step(fp, username) == -1)
+        {
+            fprintf(stderr, "Failed to migrate %s\n", filepath);
+            failed++;
+        }
+        else
+        {
+            (*done)++;
+        }
+        if (fp)
+        {
+            fclose(fp);
+        }
+    }
+    closedir(d);
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "Usage: %s [users directory]\n", argv[0]);
+        return 1;
+    }
+
+    // The file names are appended to the directory
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", argc == 2 ? argv[1] : USER_DIR);
+    size_t dir_len = strlen(dir);
+    if (dir_len > 0 && dir[dir_len - 1] != '/' && dir_len + 1 < sizeof(dir))
+    {
+        strcat(dir, "/");
+    }
+    char db_path[1100];
+    snprintf(db_path, sizeof(db_path), "%s%s", dir, USER_DB_NAME);
+
+    // Synced once at the end instead of after each user
+    if (user_db_open(db_path, 0) == -1)
+    {
+        return 1;
+    }
+
+    // Friends refer to user IDs, so every user is created first
+    size_t migrated = 0;
+    size_t friend_lists = 0;
+    size_t failed = for_each_user_file(dir, migrate_user, &migrated);
+    failed += for_each_user_file(dir, migrate_friends, &friend_lists);
+    user_db_close();
+
+    printf("Migrated %zu users to %s", migrated, db_path);
+    if (failed > 0)
+    {
+        printf(", %zu failed", failed);
+    }
+    printf("\n");
+    return failed > 0 ? 1 : 0;
+}
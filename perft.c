@@ -0,0 +1,346 @@
+// Throughput of the rules, and a check that they didn't change
+// Perft counts the sequences of depth moves from fixed positions, with make_move on copies of the
+// game as the server plays them, with do_move and undo_move, and with apply_move on packed boards.
+// The counts are known up to PERFT_KNOWN_DEPTH, a kernel that finds another count is wrong.
+// Then each operation on a board is timed alone, as many times as it takes to measure it
+// Usage: ./perft [depth]
+
+#include <time.h>
+#include "game.h"
+
+#define PERFT_POSITIONS 5
+#define PERFT_KNOWN_DEPTH 10
+#define PERFT_DEFAULT_DEPTH 8
+// Each microbenchmark runs for at least this long
+#define MICROBENCHMARK_MIN_TIME 0.2
+
+typedef struct
+{
+    const char *name;
+    int board[NUM_HOLES];
+    int scores[2];
+    int turn;
+    long counts[PERFT_KNOWN_DEPTH]; // Sequences of 1 to PERFT_KNOWN_DEPTH moves
+} PerftPosition;
+
+// The start of a game, then positions reached after 13, 24, 37 and 50 random moves
+static const PerftPosition positions[PERFT_POSITIONS] = {
+    {"initial", {4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4}, {0, 0}, PLAYER1,
+     {6, 36, 190, 1014, 5219, 27332, 139157, 711414, 3592872, 18137964}},
+    {"opening", {4, 0, 3, 2, 3, 5, 3, 1, 11, 2, 11, 3}, {0, 0}, PLAYER2,
+     {6, 33, 170, 892, 4583, 23491, 121515, 608429, 3132130, 15482288}},
+    {"middle", {0, 0, 2, 16, 3, 0, 0, 0, 1, 7, 4, 8}, {0, 7}, PLAYER1,
+     {3, 14, 65, 279, 1421, 6039, 30606, 133499, 663543, 2993925}},
+    {"big-hole", {0, 9, 2, 12, 1, 1, 0, 5, 1, 2, 1, 5}, {9, 0}, PLAYER2,
+     {5, 26, 126, 614, 2990, 14867, 71210, 352813, 1673866, 8167708}},
+    {"late", {9, 1, 0, 2, 5, 1, 2, 2, 10, 7, 0, 1}, {4, 4}, PLAYER1,
+     {5, 24, 120, 558, 2795, 13345, 65308, 319629, 1531878, 7553820}},
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Game *position_game(const PerftPosition *position)
+{
+    Game *game = create_game(0, NO_USERNAME, NO_USERNAME);
+    if (!game)
+    {
+        exit(1);
+    }
+    memcpy(game->state.board, position->board, sizeof(game->state.board));
+    game->state.scores[PLAYER1] = position->scores[PLAYER1];
+    game->state.scores[PLAYER2] = position->scores[PLAYER2];
+    game->state.turn = position->turn;
+    game->state.hash = hash_game_state(&game->state);
+    return game;
+}
+
+// ========== Perft ==========
+// A sequence that ends the game before depth moves isn't counted
+
+// The server's way: every hole is checked by is_valid_move and played by make_move on a copy
+static long perft_make_move(const Game *game, int depth)
+{
+    long count = 0;
+    int first = game->state.turn * (NUM_HOLES / 2);
+    for (int hole = first; hole < first + NUM_HOLES / 2; hole++)
+    {
+        if (is_valid_move((Game *)game, game->state.turn, hole) != 0)
+        {
+            continue;
+        }
+        Game child = *game;
+        child.move_history = NULL;
+        int over = make_move(&child, child.state.turn, hole);
+        free_move_history(child.move_history);
+        if (depth == 1)
+        {
+            count++;
+        }
+        else if (!over)
+        {
+            count += perft_make_move(&child, depth - 1);
+        }
+    }
+    return count;
+}
+
+static long perft_do_move(GameState *state, int depth)
+{
+    long count = 0;
+    int first = state->turn * (NUM_HOLES / 2);
+    for (int hole = first; hole < first + NUM_HOLES / 2; hole++)
+    {
+        if (state->board[hole] == 0)
+        {
+            continue;
+        }
+        if (depth == 1)
+        {
+            count++;
+            continue;
+        }
+        MoveUndo undo;
+        if (!do_move(state, hole, &undo))
+        {
+            count += perft_do_move(state, depth - 1);
+        }
+        undo_move(state, &undo);
+    }
+    return count;
+}
+
+static long perft_apply_move(const PackedState *state, int depth)
+{
+    int moves[NUM_HOLES / 2];
+    int count = legal_moves(state, moves);
+    if (depth == 1)
+    {
+        return count;
+    }
+    long total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        PackedState child = apply_move(*state, moves[i]);
+        if (!child.over)
+        {
+            total += perft_apply_move(&child, depth - 1);
+        }
+    }
+    return total;
+}
+
+// Print the speed of a kernel in M nodes/s
+// Returns 0 if the count is the known one, or unknown
+static int report_kernel(const PerftPosition *position, int depth, long nodes, double elapsed)
+{
+    printf("  %10.2f", elapsed > 0 ? nodes / elapsed / 1e6 : 0);
+    return depth <= PERFT_KNOWN_DEPTH && nodes != position->counts[depth - 1];
+}
+
+// Returns the number of wrong counts
+static int run_perft(int depth)
+{
+    int errors = 0;
+    printf("Perft to depth %d, M nodes/s\n", depth);
+    printf("position        nodes   make_move     do_move  apply_move\n");
+    for (int p = 0; p < PERFT_POSITIONS; p++)
+    {
+        const PerftPosition *position = &positions[p];
+        Game *game = position_game(position);
+        PackedState packed;
+        pack_state(&game->state, &packed);
+        GameState state = game->state;
+
+        double start = now();
+        long make_move_nodes = perft_make_move(game, depth);
+        double make_move_time = now() - start;
+        start = now();
+        long do_move_nodes = perft_do_move(&state, depth);
+        double do_move_time = now() - start;
+        start = now();
+        long apply_move_nodes = perft_apply_move(&packed, depth);
+        double apply_move_time = now() - start;
+
+        printf("%-9s %11ld", position->name, apply_move_nodes);
+        int wrong = report_kernel(position, depth, make_move_nodes, make_move_time) +
+                    report_kernel(position, depth, do_move_nodes, do_move_time) +
+                    report_kernel(position, depth, apply_move_nodes, apply_move_time);
+        printf("\n");
+        if (wrong > 0)
+        {
+            fprintf(stderr, "%s: %ld, %ld and %ld nodes, %ld expected\n", position->name,
+                    make_move_nodes, do_move_nodes, apply_move_nodes, position->counts[depth - 1]);
+        }
+        errors += wrong;
+        delete_game(game);
+    }
+    return errors;
+}
+
+// ========== Microbenchmarks ==========
+// Every legal move of the perft positions, each one is timed in turn
+
+#define MAX_BENCH_MOVES (PERFT_POSITIONS * NUM_HOLES / 2)
+
+static Game *bench_games[MAX_BENCH_MOVES];
+static GameState bench_states[MAX_BENCH_MOVES];
+static PackedState bench_packed[MAX_BENCH_MOVES];
+static int bench_holes[MAX_BENCH_MOVES];
+static int bench_count = 0;
+// Results are added here so that the calls aren't optimized away
+static volatile long sink;
+
+static void setup_microbenchmarks(void)
+{
+    for (int p = 0; p < PERFT_POSITIONS; p++)
+    {
+        Game *game = position_game(&positions[p]);
+        PackedState packed;
+        pack_state(&game->state, &packed);
+        int moves[NUM_HOLES / 2];
+        int count = legal_moves(&packed, moves);
+        for (int i = 0; i < count; i++)
+        {
+            bench_games[bench_count] = game;
+            bench_states[bench_count] = game->state;
+            bench_packed[bench_count] = packed;
+            bench_holes[bench_count] = moves[i];
+            bench_count++;
+        }
+    }
+}
+
+static void bench_apply_move(long iterations)
+{
+    long total = 0;
+    for (long i = 0, m = 0; i < iterations; i++, m = m + 1 == bench_count ? 0 : m + 1)
+    {
+        PackedState child = apply_move(bench_packed[m], bench_holes[m]);
+        total += child.scores[0] + child.holes[0];
+    }
+    sink += total;
+}
+
+static void bench_do_undo_move(long iterations)
+{
+    long total = 0;
+    for (long i = 0, m = 0; i < iterations; i++, m = m + 1 == bench_count ? 0 : m + 1)
+    {
+        MoveUndo undo;
+        total += do_move(&bench_states[m], bench_holes[m], &undo);
+        undo_move(&bench_states[m], &undo);
+    }
+    sink += total;
+}
+
+static void bench_make_move(long iterations)
+{
+    long total = 0;
+    for (long i = 0, m = 0; i < iterations; i++, m = m + 1 == bench_count ? 0 : m + 1)
+    {
+        Game child = *bench_games[m];
+        child.move_history = NULL;
+        total += make_move(&child, child.state.turn, bench_holes[m]);
+        free_move_history(child.move_history);
+    }
+    sink += total;
+}
+
+static void bench_is_valid_move(long iterations)
+{
+    long total = 0;
+    for (long i = 0, m = 0; i < iterations; i++, m = m + 1 == bench_count ? 0 : m + 1)
+    {
+        total += is_valid_move(bench_games[m], bench_games[m]->state.turn, (bench_holes[m] + i) % NUM_HOLES);
+    }
+    sink += total;
+}
+
+static void bench_check_game_over(long iterations)
+{
+    long total = 0;
+    for (long i = 0, m = 0; i < iterations; i++, m = m + 1 == bench_count ? 0 : m + 1)
+    {
+        total += check_game_over(bench_games[m]);
+    }
+    sink += total;
+}
+
+static void bench_legal_moves(long iterations)
+{
+    long total = 0;
+    int moves[NUM_HOLES / 2];
+    for (long i = 0, m = 0; i < iterations; i++, m = m + 1 == bench_count ? 0 : m + 1)
+    {
+        total += legal_moves(&bench_packed[m], moves);
+    }
+    sink += total;
+}
+
+static void bench_zobrist_hash(long iterations)
+{
+    uint64_t total = 0;
+    for (long i = 0, m = 0; i < iterations; i++, m = m + 1 == bench_count ? 0 : m + 1)
+    {
+        total += zobrist_hash(&bench_packed[m]);
+    }
+    sink += (long)total;
+}
+
+// Run a benchmark with more iterations each time, until it lasts long enough to be measured
+static void run_microbenchmark(const char *name, void (*benchmark)(long iterations))
+{
+    long iterations = 1;
+    double elapsed;
+    while (1)
+    {
+        double start = now();
+        benchmark(iterations);
+        elapsed = now() - start;
+        if (elapsed >= MICROBENCHMARK_MIN_TIME)
+        {
+            break;
+        }
+        // Aim a little past the minimum time, growing at most 100 times at once
+        double factor = elapsed > 0 ? MICROBENCHMARK_MIN_TIME * 1.4 / elapsed : 100;
+        iterations = (long)(iterations * (factor < 100 ? (factor > 2 ? factor : 2) : 100));
+    }
+    printf("%-24s %10.1f ns %14ld\n", name, elapsed * 1e9 / iterations, iterations);
+}
+
+int main(int argc, char **argv)
+{
+    int depth = argc > 1 ? atoi(argv[1]) : PERFT_DEFAULT_DEPTH;
+    if (argc > 2 || depth <= 0)
+    {
+        fprintf(stderr, "Usage: %s [depth]\n", argv[0]);
+        return 1;
+    }
+    if (depth > PERFT_KNOWN_DEPTH)
+    {
+        printf("The counts are only known up to depth %d, they aren't checked\n", PERFT_KNOWN_DEPTH);
+    }
+    int errors = run_perft(depth);
+
+    setup_microbenchmarks();
+    printf("\nBenchmark                      Time     Iterations\n");
+    run_microbenchmark("BM_apply_move", bench_apply_move);
+    run_microbenchmark("BM_do_move_undo_move", bench_do_undo_move);
+    run_microbenchmark("BM_make_move", bench_make_move);
+    run_microbenchmark("BM_is_valid_move", bench_is_valid_move);
+    run_microbenchmark("BM_check_game_over", bench_check_game_over);
+    run_microbenchmark("BM_legal_moves", bench_legal_moves);
+    run_microbenchmark("BM_zobrist_hash", bench_zobrist_hash);
+
+    if (errors > 0)
+    {
+        fprintf(stderr, "%d perft counts differ from the known ones, the rules have changed\n", errors);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include "registry.h"
+
+void registry_init(ClientRegistry *registry, size_t max_clients)
+{
+    registry->slots = NULL;
+    registry->capacity = 0;
+    registry->count = 0;
+    registry->used = 0;
+    registry->max_clients = max_clients;
+    pthread_rwlock_init(&registry->lock, NULL);
+}
+
+// Multiplicative hash of a username ID, IDs are handed out in sequence so the high bits are better spread
+static size_t registry_slot(UsernameId name_id, size_t capacity)
+{
+    return (name_id * 2654435761u) & (capacity - 1);
+}
+
+// Find the slot of a username ID, must hold the lock
+// Returns the index of the slot, or -1 if the username isn't registered
+static long find_slot(ClientRegistry *registry, UsernameId name_id)
+{
+    if (registry->capacity == 0 || name_id == NO_USERNAME)
+    {
+        return -1;
+    }
+
+    size_t mask = registry->capacity - 1;
+    for (size_t i = registry_slot(name_id, registry->capacity);; i = (i + 1) & mask)
+    {
+        RegistrySlot *slot = &registry->slots[i];
+        if (slot->state == SLOT_EMPTY)
+        {
+            return -1;
+        }
+        if (slot->state == SLOT_USED && slot->name_id == name_id)
+        {
+            return i;
+        }
+    }
+}
+
+// Rebuild the table with a new capacity, which drops the deleted slots, must hold the lock for writing
+// Returns -1 if the memory can't be allocated
+static int resize_registry(ClientRegistry *registry, size_t capacity)
+{
+    RegistrySlot *slots = (RegistrySlot *)calloc(capacity, sizeof(RegistrySlot));
+    if (!slots)
+    {
+        perror("Failed to allocate memory for client registry");
+        return -1;
+    }
+
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < registry->capacity; i++)
+    {
+        RegistrySlot *slot = &registry->slots[i];
+        if (slot->state != SLOT_USED)
+        {
+            continue;
+        }
+        size_t j = registry_slot(slot->name_id, capacity);
+        while (slots[j].state != SLOT_EMPTY)
+        {
+            j = (j + 1) & mask;
+        }
+        slots[j] = *slot;
+    }
+
+    free(registry->slots);
+    registry->slots = slots;
+    registry->capacity = capacity;
+    registry->used = registry->count;
+    return 0;
+}
+
+// Register a logged in client under its username ID, the registry takes a reference to the connection
+RegistryResult registry_add(ClientRegistry *registry, Connection *conn)
+{
+    if (conn->name_id == NO_USERNAME)
+    {
+        return REGISTRY_ERROR;
+    }
+
+    pthread_rwlock_wrlock(&registry->lock);
+
+    if (find_slot(registry, conn->name_id) != -1)
+    {
+        pthread_rwlock_unlock(&registry->lock);
+        return REGISTRY_TAKEN;
+    }
+    if (registry->max_clients != 0 && registry->count >= registry->max_clients)
+    {
+        pthread_rwlock_unlock(&registry->lock);
+        return REGISTRY_FULL;
+    }
+
+    // Keep the load factor under 3/4, counting deleted slots since they lengthen probes
+    if ((registry->used + 1) * 4 > registry->capacity * 3)
+    {
+        size_t capacity = registry->capacity ? registry->capacity : REGISTRY_INITIAL_CAPACITY;
+        while ((registry->count + 1) * 2 > capacity)
+        {
+            capacity *= 2;
+        }
+        if (resize_registry(registry, capacity) == -1)
+        {
+            pthread_rwlock_unlock(&registry->lock);
+            return REGISTRY_ERROR;
+        }
+    }
+
+    size_t mask = registry->capacity - 1;
+    size_t i = registry_slot(conn->name_id, registry->capacity);
+    while (registry->slots[i].state == SLOT_USED)
+    {
+        i = (i + 1) & mask;
+    }
+    if (registry->slots[i].state == SLOT_EMPTY)
+    {
+        registry->used++;
+    }
+    registry->slots[i].name_id = conn->name_id;
+    registry->slots[i].state = SLOT_USED;
+    registry->slots[i].conn = conn;
+    registry->count++;
+    acquire_connection(conn);
+
+    pthread_rwlock_unlock(&registry->lock);
+    return REGISTRY_ADDED;
+}
+
+// Unregister a client, if it is this connection that is registered under its username
+void registry_remove(ClientRegistry *registry, Connection *conn)
+{
+    pthread_rwlock_wrlock(&registry->lock);
+    long i = find_slot(registry, conn->name_id);
+    int removed = i != -1 && registry->slots[i].conn == conn;
+    if (removed)
+    {
+        registry->slots[i].state = SLOT_DELETED;
+        registry->slots[i].conn = NULL;
+        registry->count--;
+    }
+    pthread_rwlock_unlock(&registry->lock);
+
+    if (removed)
+    {
+        release_connection(conn);
+    }
+}
+
+// Find the connection of a logged in user
+// Returns a new reference to release with release_connection, or NULL if the user isn't connected
+Connection *registry_get(ClientRegistry *registry, UsernameId name_id)
+{
+    pthread_rwlock_rdlock(&registry->lock);
+    Connection *conn = NULL;
+    long i = find_slot(registry, name_id);
+    if (i != -1)
+    {
+        conn = registry->slots[i].conn;
+        acquire_connection(conn);
+    }
+    pthread_rwlock_unlock(&registry->lock);
+
+    return conn;
+}
+
+int registry_contains(ClientRegistry *registry, UsernameId name_id)
+{
+    pthread_rwlock_rdlock(&registry->lock);
+    int found = find_slot(registry, name_id) != -1;
+    pthread_rwlock_unlock(&registry->lock);
+
+    return found;
+}
+
+// Get all the logged in clients, so they can be used without holding the lock
+// Returns an array of new references to free with release_snapshot, or NULL if there are none
+Connection **registry_snapshot(ClientRegistry *registry, size_t *count)
+{
+    pthread_rwlock_rdlock(&registry->lock);
+
+    *count = 0;
+    Connection **snapshot = NULL;
+    if (registry->count > 0)
+    {
+        snapshot = (Connection **)malloc(registry->count * sizeof(Connection *));
+        if (!snapshot)
+        {
+            perror("Failed to allocate memory for client snapshot");
+        }
+    }
+
+    for (size_t i = 0; snapshot && i < registry->capacity; i++)
+    {
+        if (registry->slots[i].state == SLOT_USED)
+        {
+            acquire_connection(registry->slots[i].conn);
+            snapshot[(*count)++] = registry->slots[i].conn;
+        }
+    }
+
+    pthread_rwlock_unlock(&registry->lock);
+    return snapshot;
+}
+
+void release_snapshot(Connection **snapshot, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        release_connection(snapshot[i]);
+    }
+    free(snapshot);
+}
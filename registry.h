@@ -0,0 +1,55 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "connection.h"
+
+// Initial number of slots of the registry, always a power of two
+#define REGISTRY_INITIAL_CAPACITY 64
+
+typedef enum
+{
+    SLOT_EMPTY = 0,
+    SLOT_USED,
+    // A removed entry, kept so that probing continues past it
+    SLOT_DELETED
+} RegistrySlotState;
+
+typedef struct
+{
+    UsernameId name_id;
+    RegistrySlotState state;
+    Connection *conn; // Holds a reference to the connection
+} RegistrySlot;
+
+// Logged in clients, indexed by username ID with open addressing (linear probing)
+// Lookups take the lock for reading, so they run in parallel with each other
+typedef struct
+{
+    RegistrySlot *slots;
+    size_t capacity;
+    size_t count; // Used slots
+    size_t used;  // Used and deleted slots
+    size_t max_clients; // Admission limit, 0 for no limit
+    pthread_rwlock_t lock;
+} ClientRegistry;
+
+typedef enum
+{
+    REGISTRY_ADDED = 0,
+    REGISTRY_TAKEN = -1,
+    REGISTRY_FULL = -2,
+    REGISTRY_ERROR = -3
+} RegistryResult;
+
+// Function prototypes
+void registry_init(ClientRegistry *registry, size_t max_clients);
+RegistryResult registry_add(ClientRegistry *registry, Connection *conn);
+void registry_remove(ClientRegistry *registry, Connection *conn);
+Connection *registry_get(ClientRegistry *registry, UsernameId name_id);
+int registry_contains(ClientRegistry *registry, UsernameId name_id);
+Connection **registry_snapshot(ClientRegistry *registry, size_t *count);
+void release_snapshot(Connection **snapshot, size_t count);
+
+#endif // REGISTRY_H
@@ -2,93 +2,141 @@
 #include "game.h"
 #include "color.h"
 #include "user.h"
+#include "connection.h"
+#include "registry.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "topic.h"
+#include "bot.h"
+#include "tablebase.h"
 #include <pthread.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <signal.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <fcntl.h>
+#endif
 
-#define MAX_CLIENTS 10
+// Maximum number of events handled per epoll_wait call
+#define MAX_EVENTS 64
 
 // Todo: factor out common logic
 
-#define GAME_DIR "./games/"
-
 // Forward definition
-void save_game_state(Game *game);
-void send_to_user(const char *username, Message *msg);
+void send_to_user(UsernameId name_id, Message *msg);
+void send_board_to_user(UsernameId name_id, Message boards[WIRE_FORMAT_COUNT]);
 
 int next_game_id = 1;
 // For matchmaking
-char waiting_player[USERNAME_MAX_LEN] = "";
+UsernameId waiting_player = NO_USERNAME;
 
-typedef struct
-{
-    int sockfd;
-    char username[USERNAME_MAX_LEN];
-} ClientInfo;
 
 // Structure to represent a challenge
 typedef struct Challenge
 {
-    char challenger[USERNAME_MAX_LEN];
-    char challenged[USERNAME_MAX_LEN];
+    UsernameId challenger;
+    UsernameId challenged;
     int game_id;
     struct Challenge *next;
 } Challenge;
 
-// Head pointers for active games and challenges
-Game *game_list = NULL;
+// All games, by ID and by player, and the head pointer for challenges
+GameIndex game_index;
 Challenge *challenge_list = NULL;
-ClientInfo clients[MAX_CLIENTS];
+// Logged in clients, by username
+ClientRegistry clients;
+// Logged in clients, for the messages sent to everyone
+Topic lobby;
 
 // Mutexes for thread-safe operations
-pthread_mutex_t game_mutex = PTHREAD_MUTEX_INITIALIZER;
+// The game index lock only protects the index, each game has its own lock for its state
+pthread_rwlock_t game_index_lock = PTHREAD_RWLOCK_INITIALIZER;
 pthread_mutex_t challenge_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t matchmaking_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 const char *SERVER_WELCOME_MESSAGE = "Welcome to Matt & Quent's Awale server!\nType /help for a list of available commands.";
 
-// Broadcast message to all clients except the sender
-void broadcast_message(Message *msg, int exclude_sockfd)
+// Send a message to a connection, in the wire format it speaks
+// The message is queued and written without blocking, the rest is written when the socket is writable again
+int send_to_client(Connection *conn, Message *msg)
 {
-    pthread_mutex_lock(&clients_mutex);
-
-    for (int i = 0; i < MAX_CLIENTS; ++i)
+    if (queue_message(conn, msg) == -1)
     {
-        if (clients[i].sockfd != 0 && clients[i].sockfd != exclude_sockfd)
-        {
-            if (send_message(clients[i].sockfd, msg) == -1)
-            {
-                perror("send_message");
-            }
-        }
+        return -1;
     }
+    return flush_connection(conn) == -1 ? -1 : 0;
+}
+
+// Broadcast message to all clients except the sender
+void broadcast_message(Message *msg, Connection *exclude)
+{
+    // Encoded once, sockets are written to once the lobby is unlocked
+    Publication pub;
+    begin_publication(&pub, msg);
+    topic_publish(&lobby, &pub, exclude);
+    end_publication(&pub);
+}
 
-    pthread_mutex_unlock(&clients_mutex);
+// Write the text board of a game, the only board legacy clients know
+void prepare_text_board(Game *game, Message *msg)
+{
+    msg->type = MSG_TYPE_INFO;
+    strcpy(msg->username, "Server");
+    game_to_string(game, msg->data);
+}
+
+// Write the board of a game for each wire format, the caller holds the game's lock if it is published
+// Legacy clients don't know MSG_TYPE_BOARD, they get the text board they always had
+void prepare_board_messages(Game *game, Message boards[WIRE_FORMAT_COUNT])
+{
+    boards[WIRE_FRAMED].type = MSG_TYPE_BOARD;
+    strcpy(boards[WIRE_FRAMED].username, "Server");
+    encode_game_state(game, boards[WIRE_FRAMED].data);
+    prepare_text_board(game, &boards[WIRE_LEGACY]);
+}
+
+// Send a board prepared by prepare_board_messages, in the form the client understands
+int send_board(Connection *conn, Message boards[WIRE_FORMAT_COUNT])
+{
+    return send_to_client(conn, &boards[conn->format]);
 }
 
 // Check if username is already taken
 int is_username_taken(const char *username)
 {
-    int taken = 0;
-    pthread_mutex_lock(&clients_mutex);
+    return registry_contains(&clients, find_username_id(username));
+}
 
-    for (int i = 0; i < MAX_CLIENTS; ++i)
-    {
-        if (clients[i].sockfd != 0 && strcmp(clients[i].username, username) == 0)
-        {
-            taken = 1;
-            break;
-        }
-    }
+// ========== Game logic ==========
+// Game IDs are shared by challenges and matchmaking, which run on several threads
+int allocate_game_id()
+{
+    return __atomic_fetch_add(&next_game_id, 1, __ATOMIC_RELAXED);
+}
 
-    pthread_mutex_unlock(&clients_mutex);
-    return taken;
+// Find a game, the index is only locked for the lookup
+// Games are never freed while the server runs, so the pointer stays valid afterwards
+Game *lookup_game(int game_id)
+{
+    pthread_rwlock_rdlock(&game_index_lock);
+    Game *game = find_game_by_id(&game_index, game_id);
+    pthread_rwlock_unlock(&game_index_lock);
+    return game;
+}
+
+// Make a new game visible to the other commands
+void publish_game(Game *game)
+{
+    pthread_rwlock_wrlock(&game_index_lock);
+    add_game(&game_index, game);
+    pthread_rwlock_unlock(&game_index_lock);
 }
 
-// ========== Game logic ==========
 // Add a new challenge
-void add_challenge(const char *challenger, const char *challenged, int game_id)
+void add_challenge(UsernameId challenger, UsernameId challenged, int game_id)
 {
     Challenge *new_challenge = (Challenge *)malloc(sizeof(Challenge));
     if (!new_challenge)
@@ -96,10 +144,8 @@ void add_challenge(const char *challenger, const char *challenged, int game_id)
         perror("Failed to allocate memory for new challenge");
         return;
     }
-    strncpy(new_challenge->challenger, challenger, USERNAME_MAX_LEN - 1);
-    new_challenge->challenger[USERNAME_MAX_LEN - 1] = '\0';
-    strncpy(new_challenge->challenged, challenged, USERNAME_MAX_LEN - 1);
-    new_challenge->challenged[USERNAME_MAX_LEN - 1] = '\0';
+    new_challenge->challenger = challenger;
+    new_challenge->challenged = challenged;
     new_challenge->game_id = game_id;
     new_challenge->next = NULL;
 
@@ -110,15 +156,14 @@ void add_challenge(const char *challenger, const char *challenged, int game_id)
 }
 
 // Find and remove a challenge
-Challenge *find_and_remove_challenge(const char *challenger, const char *challenged)
+Challenge *find_and_remove_challenge(UsernameId challenger, UsernameId challenged)
 {
     pthread_mutex_lock(&challenge_mutex);
     Challenge *current = challenge_list;
     Challenge *prev = NULL;
     while (current)
     {
-        if (strcmp(current->challenger, challenger) == 0 &&
-            strcmp(current->challenged, challenged) == 0)
+        if (current->challenger == challenger && current->challenged == challenged)
         {
             if (prev)
             {
@@ -138,252 +183,452 @@ Challenge *find_and_remove_challenge(const char *challenger, const char *challen
     return NULL;
 }
 
-void handle_matchmaking(int sockfd, const char *username)
+void handle_matchmaking(Connection *conn, UsernameId name_id)
 {
     // MAKE SURE TO RELEASE THIS IN ALL CODE PATHS
-    pthread_mutex_lock(&clients_mutex);
-    if (strlen(waiting_player) == 0)
+    pthread_mutex_lock(&matchmaking_mutex);
+    if (waiting_player == NO_USERNAME)
     {
         // No player is waiting, set current player as waiting
-        strncpy(waiting_player, username, USERNAME_MAX_LEN - 1);
-        waiting_player[USERNAME_MAX_LEN - 1] = '\0';
+        waiting_player = name_id;
         Message msg;
         msg.type = MSG_TYPE_TEXT;
         strcpy(msg.username, "Server");
         strcpy(msg.data, "You are now in the matchmaking queue. Waiting for another player...");
-        send_message(sockfd, &msg);
-        pthread_mutex_unlock(&clients_mutex);
+        send_to_client(conn, &msg);
+        pthread_mutex_unlock(&matchmaking_mutex);
     }
     else
     {
         // Another player is waiting, start a game
-        int game_id = next_game_id++;
-        Game *new_game = create_game(game_id, waiting_player, username);
+        int game_id = allocate_game_id();
+        Game *new_game = create_game(game_id, waiting_player, name_id);
         if (new_game)
         {
             // Clear the waiting player
-            char orig_waiting_player[USERNAME_MAX_LEN];
-            strncpy(orig_waiting_player, waiting_player, USERNAME_MAX_LEN - 1);
-            waiting_player[0] = '\0';
+            UsernameId orig_waiting_player = waiting_player;
+            waiting_player = NO_USERNAME;
 
-            add_game(&game_list, new_game);
-            save_game_state(new_game);
-            pthread_mutex_unlock(&clients_mutex);
+            // Nobody else knows about the game until it is published
+            journal_game_created(new_game);
+            Message boards[WIRE_FORMAT_COUNT];
+            prepare_board_messages(new_game, boards);
+            publish_game(new_game);
+            pthread_mutex_unlock(&matchmaking_mutex);
 
-            // Notify both players
+            // Notify both players, the usernames and the first turn don't change
             char game_start_msg[BUFFER_SIZE];
             sprintf(game_start_msg, "Match found! Game %d started between %s and %s.\n"
                                     "It's %s's turn.\n%s, reply with /move %d <hole_number> to make your move.",
-                    game_id, new_game->player_usernames[PLAYER1], new_game->player_usernames[PLAYER2],
-                    new_game->player_usernames[new_game->state.turn], new_game->player_usernames[new_game->state.turn], game_id);
+                    game_id, username_of(new_game->players[PLAYER1]), username_of(new_game->players[PLAYER2]),
+                    username_of(new_game->players[new_game->state.turn]), username_of(new_game->players[new_game->state.turn]), game_id);
             Message msg;
             msg.type = MSG_TYPE_TEXT;
             strcpy(msg.username, "Server");
             strcpy(msg.data, game_start_msg);
-            send_message(sockfd, &msg);
+            send_to_client(conn, &msg);
             send_to_user(orig_waiting_player, &msg);
 
             // Send the initial board state
-            msg.type = MSG_TYPE_INFO;
-            strcpy(msg.data, game_to_string(new_game));
-            send_message(sockfd, &msg);
-            send_to_user(orig_waiting_player, &msg);
+            send_board(conn, boards);
+            send_board_to_user(orig_waiting_player, boards);
         }
         else
         {
-            pthread_mutex_unlock(&clients_mutex);
+            pthread_mutex_unlock(&matchmaking_mutex);
 
             // Handle error in game creation
             Message msg;
             msg.type = MSG_TYPE_TEXT;
             strcpy(msg.username, "Server");
             strcpy(msg.data, "Failed to create game. Please try again later.");
-            send_message(sockfd, &msg);
+            send_to_client(conn, &msg);
             send_to_user(waiting_player, &msg);
         }
     }
 }
 
 // Send a message to a specific user
-void send_to_user(const char *username, Message *msg)
+void send_to_user(UsernameId name_id, Message *msg)
 {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < MAX_CLIENTS; ++i)
+    Connection *recipient = registry_get(&clients, name_id);
+    if (recipient)
     {
-        if (clients[i].sockfd != 0 && strcmp(clients[i].username, username) == 0)
-        {
-            send_message(clients[i].sockfd, msg);
-            break;
-        }
+        send_to_client(recipient, msg);
+        release_connection(recipient);
     }
-    pthread_mutex_unlock(&clients_mutex);
 }
 
-// ========== Filesystem logic ==========
-void save_game_state(Game *game)
+// Send a board prepared by prepare_board_messages to a specific user
+void send_board_to_user(UsernameId name_id, Message boards[WIRE_FORMAT_COUNT])
 {
-    char filepath[1024];
-    snprintf(filepath, sizeof(filepath), "%s/game_%d.dat", GAME_DIR, game->game_id);
-
-    FILE *fp = fopen(filepath, "w");
-    if (fp == NULL)
+    Connection *recipient = registry_get(&clients, name_id);
+    if (recipient)
     {
-        perror("Failed to open file for writing game state");
-        return;
+        send_board(recipient, boards);
+        release_connection(recipient);
     }
+}
 
-    fprintf(fp, "%d|%s|%s|%d|%d|%d",
-            game->game_id,
-            game->player_usernames[PLAYER1],
-            game->player_usernames[PLAYER2],
-            game->state.scores[PLAYER1],
-            game->state.scores[PLAYER2],
-            game->state.turn);
-
-    for (int i = 0; i < NUM_HOLES; i++)
+// Send the whole state of a game to a spectator, the caller holds the game's lock
+// Legacy clients don't know snapshots and deltas, they get the text board instead
+void send_game_snapshot(Connection *conn, Game *game)
+{
+    Message snapshot_msg;
+    if (conn->format == WIRE_LEGACY)
     {
-        fprintf(fp, "|%d", game->state.board[i]);
+        prepare_text_board(game, &snapshot_msg);
+        send_to_client(conn, &snapshot_msg);
+        return;
     }
+    snapshot_msg.type = MSG_TYPE_GAME_SNAPSHOT;
+    snapshot_msg.username[0] = '\0';
+    game_snapshot_to_string(game, snapshot_msg.data);
+    send_to_client(conn, &snapshot_msg);
+}
 
-    // Append the move history to the file
-    MoveNode *node = game->move_history;
-    while (node != NULL)
+// Queue a publication to a specific user
+void publish_to_user(Publication *pub, UsernameId name_id)
+{
+    Connection *recipient = registry_get(&clients, name_id);
+    if (recipient)
     {
-        fprintf(fp, "|%d|%d", node->player, node->hole);
-        node = node->next;
+        publish_to(pub, recipient);
+        release_connection(recipient);
     }
-
-    fclose(fp);
 }
 
-void load_all_games()
+// ========== Moves and bots ==========
+// Ask the bots for a move if it is the turn of a bot, the caller holds the game's lock
+void schedule_bot_move(Game *game)
 {
-    DIR *dir;
-    struct dirent *entry;
-
-    if ((dir = opendir(GAME_DIR)) == NULL)
+    if (game->status != ONGOING)
+    {
+        return;
+    }
+    int level = bot_level(username_of(game->players[game->state.turn]));
+    if (level == 0)
     {
-        perror("Failed to open directory");
         return;
     }
+    PackedState state;
+    pack_state(&game->state, &state);
+    request_bot_move(game->game_id, game->move_count, &state, level);
+}
 
-    int max_game_id = 0; // Local variable to find the maximum game ID
+// Save and send a move just played by make_move, before is the state of the game before the move
+// Called with the game locked, it is unlocked before the sockets are written
+void announce_move(Game *game, int player, int hole, int move_result, const GameState *before)
+{
+    // Only the move is written, the whole game is saved again when the journal is compacted
+    journal_move(game);
+
+    // Prepare game state update message
+    Message game_msg;
+    game_msg.type = MSG_TYPE_TEXT;
+    strcpy(game_msg.username, "Server");
+    // The board is queued while the game is locked so updates stay in order, sockets are written afterwards
+    Message boards[WIRE_FORMAT_COUNT];
+    prepare_board_messages(game, boards);
+    Publication board;
+    begin_publication(&board, &boards[WIRE_FRAMED]);
+    set_publication_message(&board, WIRE_LEGACY, &boards[WIRE_LEGACY]);
+
+    // Check if game is over
+    if (move_result == 1)
+    {
+        snprintf(game_msg.data, BUFFER_SIZE, "Game %d over. Scores - %s: %d, %s: %d.",
+                 game->game_id, username_of(game->players[PLAYER1]), game->state.scores[PLAYER1],
+                 username_of(game->players[PLAYER2]), game->state.scores[PLAYER2]);
+        // Notify both players
+        send_to_user(game->players[PLAYER1], &game_msg);
+        send_to_user(game->players[PLAYER2], &game_msg);
 
-    while ((entry = readdir(dir)) != NULL)
+        // The game is no longer ongoing, but stays available for /history and /gameinfo
+        pthread_rwlock_wrlock(&game_index_lock);
+        finish_game(&game_index, game, status_from_scores(game));
+        pthread_rwlock_unlock(&game_index_lock);
+    }
+    else
     {
-        if (entry->d_type == DT_REG)
-        { // If the entry is a regular file
-            char filepath[1024];
-            snprintf(filepath, sizeof(filepath), "%s%s", GAME_DIR, entry->d_name);
-            FILE *fp = fopen(filepath, "r");
-            if (fp == NULL)
-            {
-                perror("Failed to open file for reading game state");
-                continue;
-            }
+        // Notify both players of the updated game state
+        char *pos = game_msg.data;
+        pos += sprintf(pos, " ===== Game %d =====\n", game->game_id);
+        pos += sprintf(pos, "Move executed (%s played hole %d). It's %s's turn.\nNew board state:\n",
+                       username_of(game->players[player]), hole, username_of(game->players[game->state.turn]));
+        // pos += pretty_board_state(game, pos);
+        // Todo: probs only need to send to the player whose turn it is
+        pos += sprintf(pos, "%s, reply with /move %d <hole_number> to make your move.\n",
+                       username_of(game->players[game->state.turn]), game->game_id);
+        send_to_user(game->players[PLAYER1], &game_msg);
+        send_to_user(game->players[PLAYER2], &game_msg);
 
-            Game *new_game = (Game *)malloc(sizeof(Game));
-            if (new_game == NULL)
-            {
-                perror("Failed to allocate memory for game");
-                fclose(fp);
-                continue;
-            }
+        publish_to_user(&board, game->players[PLAYER1]);
+        publish_to_user(&board, game->players[PLAYER2]);
+    }
 
-            fscanf(fp, "%d|%[^|]|%[^|]|%d|%d|%d",
-                   &new_game->game_id,
-                   new_game->player_usernames[PLAYER1],
-                   new_game->player_usernames[PLAYER2],
-                   &new_game->state.scores[PLAYER1],
-                   &new_game->state.scores[PLAYER2],
-                   (int *)&new_game->state.turn);
+    // Spectators apply the deltas in order, and ask for a snapshot if one is missing
+    // Legacy ones get the whole text board after every move
+    Message delta_msg;
+    delta_msg.type = MSG_TYPE_GAME_DELTA;
+    delta_msg.username[0] = '\0';
+    game_delta_to_string(game, before, hole, delta_msg.data);
+    Publication deltas;
+    begin_publication(&deltas, &delta_msg);
+    set_publication_message(&deltas, WIRE_LEGACY, &boards[WIRE_LEGACY]);
+    topic_publish(&game->watchers, &deltas, NULL);
+
+    // A bot whose turn it is starts searching right away
+    schedule_bot_move(game);
+
+    pthread_mutex_unlock(&game->lock);
+    end_publication(&board);
+    end_publication(&deltas);
+}
 
-            if (new_game->game_id > max_game_id)
-            {
-                max_game_id = new_game->game_id; // Update max_game_id if current game ID is higher
-            }
+// Create a game with a random first player, then record it, add it to the index and tell both players
+// Returns NULL if the game can't be created
+Game *start_game(int game_id, UsernameId player1, UsernameId player2)
+{
+    Game *new_game = create_game(game_id, player1, player2);
+    if (!new_game)
+    {
+        return NULL;
+    }
 
-            for (int i = 0; i < NUM_HOLES; i++)
-            {
-                fscanf(fp, "|%d", &new_game->state.board[i]);
-            }
+    // make a random first player
+    new_game->state.turn = rand() % 2;
+    new_game->state.hash = hash_game_state(&new_game->state);
+
+    // Record the game, then add it to the index
+    // Nobody else knows about the game until it is published
+    journal_game_created(new_game);
+    Message boards[WIRE_FORMAT_COUNT];
+    prepare_board_messages(new_game, boards);
+    publish_game(new_game);
+
+    // Notify both players, the usernames and the first turn don't change
+    Message game_start_msg;
+    game_start_msg.type = MSG_TYPE_TEXT;
+    strcpy(game_start_msg.username, "Server");
+    char *pos = game_start_msg.data;
+
+    pos += sprintf(pos, "Game %d started between %s%s%s and %s%s%s. It's %s's turn.\n",
+                   game_id, STYLE_BOLD, username_of(new_game->players[PLAYER1]), COLOR_RESET, STYLE_BOLD,
+                   username_of(new_game->players[PLAYER2]), COLOR_RESET, username_of(new_game->players[new_game->state.turn]));
+    // Todo: probs only need to send to the player whose turn it is
+    pos += sprintf(pos, "%s, reply with /move %d <hole_number> to make your move.\n",
+                   username_of(new_game->players[new_game->state.turn]), game_id);
+    send_to_user(new_game->players[PLAYER1], &game_start_msg);
+    send_to_user(new_game->players[PLAYER2], &game_start_msg);
+
+    // pretty_board_state(new_game, response.data);
+    // send_to_user(new_game->players[PLAYER1], &response);
+    // send_to_user(new_game->players[PLAYER2], &response);
+
+    // Print the initial board state
+    send_board_to_user(new_game->players[PLAYER1], boards);
+    send_board_to_user(new_game->players[PLAYER2], boards);
+
+    // A bot that plays first doesn't wait for anyone
+    pthread_mutex_lock(&new_game->lock);
+    schedule_bot_move(new_game);
+    pthread_mutex_unlock(&new_game->lock);
+    return new_game;
+}
 
-            // Load move history
-            new_game->move_history = NULL;
-            MoveNode **current_node = &new_game->move_history;
-            while (fscanf(fp, "|%d|%d", (int *)&new_game->state.turn, &new_game->state.board[0]) == 2)
-            {
-                *current_node = (MoveNode *)malloc(sizeof(MoveNode));
-                (*current_node)->player = new_game->state.turn;
-                (*current_node)->hole = new_game->state.board[0];
-                current_node = &(*current_node)->next;
-            }
-            *current_node = NULL;
+// Play the move chosen by a bot, unless the game changed since it was requested
+void play_bot_move(int game_id, int version, int hole)
+{
+    Game *game = lookup_game(game_id);
+    if (!game)
+    {
+        return;
+    }
 
-            new_game->next = game_list;
-            game_list = new_game;
+    pthread_mutex_lock(&game->lock);
+    // The game may have been forfeited while the bot was thinking
+    int player = game->state.turn;
+    if (game->status != ONGOING || game->move_count != version || bot_level(username_of(game->players[player])) == 0)
+    {
+        pthread_mutex_unlock(&game->lock);
+        return;
+    }
+    GameState before = game->state;
+    int move_result = make_move(game, player, hole);
+    if (move_result < 0)
+    {
+        pthread_mutex_unlock(&game->lock);
+        return;
+    }
+    announce_move(game, player, hole, move_result, &before);
+}
+
+// Ask the bots for the moves they owe in the games loaded from disk
+void resume_bot_games()
+{
+    pthread_rwlock_rdlock(&game_index_lock);
+    for (size_t i = 0; i < game_index.capacity; i++)
+    {
+        if (game_index.slots[i].state != GAME_SLOT_USED)
+        {
+            continue;
+        }
+        Game *game = game_index.slots[i].game;
+        pthread_mutex_lock(&game->lock);
+        schedule_bot_move(game);
+        pthread_mutex_unlock(&game->lock);
+    }
+    pthread_rwlock_unlock(&game_index_lock);
+}
 
-            fclose(fp);
+// ========== Filesystem logic ==========
+static int compare_games(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t) * (Game *const *)a;
+    uintptr_t y = (uintptr_t) * (Game *const *)b;
+    return (x > y) - (x < y);
+}
 
-            printf("Loaded game %d\n", new_game->game_id);
+// Write every game to the snapshot, called when the journal is compacted
+// The changed games are passed too, since a game is recorded before it is added to the index
+// Returns -1 if the snapshot couldn't be written
+int save_all_games(Game **changed, size_t changed_count)
+{
+    pthread_rwlock_rdlock(&game_index_lock);
+    Game **games = (Game **)malloc((game_index.count + changed_count + 1) * sizeof(Game *));
+    size_t count = 0;
+    for (size_t i = 0; games && i < game_index.capacity; i++)
+    {
+        if (game_index.slots[i].state == GAME_SLOT_USED)
+        {
+            games[count++] = game_index.slots[i].game;
         }
     }
+    pthread_rwlock_unlock(&game_index_lock);
+    if (!games)
+    {
+        perror("Failed to allocate memory for snapshot");
+        return -1;
+    }
 
-    closedir(dir);
+    // Keep each game once
+    memcpy(games + count, changed, changed_count * sizeof(Game *));
+    count += changed_count;
+    qsort(games, count, sizeof(Game *), compare_games);
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (unique == 0 || games[unique - 1] != games[i])
+        {
+            games[unique++] = games[i];
+        }
+    }
 
-    next_game_id = max_game_id + 1; // Set next_game_id to one more than the highest found
+    int result = write_snapshot(GAME_DIR SNAPSHOT_FILE, games, unique);
+    free(games);
+    return result;
 }
 
 // ========== Main server logic ==========
-void handle_command(int sockfd, const char *command, const char *username)
+// The username is only used in the replies, the user is compared by its ID
+void handle_command(Connection *conn, const char *command, const char *username)
 {
+    UsernameId name_id = conn->name_id;
     Message response;
     response.type = MSG_TYPE_SERVER;
+    response.username[0] = '\0';
 
     if (strcmp(command, "/list") == 0)
     {
         char client_list[BUFFER_SIZE] = "Connected clients:\n";
-        pthread_mutex_lock(&clients_mutex);
-        for (int i = 0; i < MAX_CLIENTS; ++i)
+        size_t count;
+        Connection **connected = registry_snapshot(&clients, &count);
+        size_t len = strlen(client_list);
+        for (size_t i = 0; i < count; ++i)
         {
-            if (clients[i].sockfd != 0)
+            // Leave room for the color codes
+            if (len + USERNAME_MAX_LEN + 32 >= BUFFER_SIZE)
             {
-                strcat(client_list, clients[i].username);
-                strcat(client_list, "\n");
+                strcat(client_list, "...\n");
+                break;
             }
+            len += sprintf(client_list + len, "%s\n", connected[i]->user.username);
         }
-        pthread_mutex_unlock(&clients_mutex);
+        release_snapshot(connected, count);
         colorize(client_list, SERVER_SUCCESS_STYLE, NULL, response.data);
-        send_message(sockfd, &response);
+        send_to_client(conn, &response);
+    }
+    else if (strcmp(command, "/stats") == 0)
+    {
+        QueueStats stats;
+        get_queue_stats(&stats);
+        JournalStats journal;
+        get_journal_stats(&journal);
+        char stats_text[BUFFER_SIZE];
+        snprintf(stats_text, BUFFER_SIZE, "Server stats:\n"
+                                          "Queued bytes: %ld\n"
+                                          "Dropped messages: %ld\n"
+                                          "Evicted slow clients: %ld\n"
+                                          "Journal records waiting for disk: %ld\n"
+                                          "Journal commits: %ld\n"
+                                          "Commit latency: last %lu us, average %lu us, max %lu us",
+                 stats.queued_bytes, stats.dropped_messages, stats.evictions,
+                 journal.pending_records, journal.batches, (unsigned long)journal.last_latency_us,
+                 (unsigned long)(journal.batches ? journal.total_latency_us / journal.batches : 0),
+                 (unsigned long)journal.max_latency_us);
+        colorize(stats_text, SERVER_INFO_STYLE, NULL, response.data);
+        send_to_client(conn, &response);
     }
     else if (strncmp(command, "/forfeit", 8) == 0)
     {
         int game_id;
         sscanf(command + 8, "%d", &game_id);
-        pthread_mutex_lock(&game_mutex);
-        Game *game_to_forfeit = find_game_by_id(game_list, game_id);
-        pthread_mutex_unlock(&game_mutex);
+        Game *game_to_forfeit = lookup_game(game_id);
 
         if (!game_to_forfeit)
         {
             colorize("Game not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
         else
         {
             // Store the game state before closing it
-            pthread_mutex_lock(&game_mutex);
-            game_to_forfeit->status = (strcmp(username, game_to_forfeit->player_usernames[PLAYER1]) == 0) ? PLAYER2_WON : PLAYER1_WON;
-            save_game_state(game_to_forfeit);
-            pthread_mutex_unlock(&game_mutex);
+            pthread_mutex_lock(&game_to_forfeit->lock);
+            // The last move may have ended the game since the command was sent, its result stays
+            if (game_to_forfeit->status != ONGOING)
+            {
+                pthread_mutex_unlock(&game_to_forfeit->lock);
+                colorize("Game is already over.", SERVER_ERROR_STYLE, NULL, response.data);
+                send_to_client(conn, &response);
+                return;
+            }
+            pthread_rwlock_wrlock(&game_index_lock);
+            finish_game(&game_index, game_to_forfeit,
+                        game_to_forfeit->players[PLAYER1] == name_id ? PLAYER2_WON : PLAYER1_WON);
+            pthread_rwlock_unlock(&game_index_lock);
+            journal_game_finished(game_to_forfeit);
+            // No move was played, so the spectators get the whole game again
+            Message snapshot_msg;
+            snapshot_msg.type = MSG_TYPE_GAME_SNAPSHOT;
+            snapshot_msg.username[0] = '\0';
+            game_snapshot_to_string(game_to_forfeit, snapshot_msg.data);
+            Message board_msg;
+            prepare_text_board(game_to_forfeit, &board_msg);
+            Publication snapshot;
+            begin_publication(&snapshot, &snapshot_msg);
+            set_publication_message(&snapshot, WIRE_LEGACY, &board_msg);
+            topic_publish(&game_to_forfeit->watchers, &snapshot, NULL);
+            pthread_mutex_unlock(&game_to_forfeit->lock);
+            end_publication(&snapshot);
 
             // send message to both players
             Message forfeit_msg;
             forfeit_msg.type = MSG_TYPE_SERVER;
             strcpy(forfeit_msg.username, "Server");
             sprintf(forfeit_msg.data, "Game %d has been forfeited by %s.", game_id, username);
-            send_to_user(game_to_forfeit->player_usernames[PLAYER1], &forfeit_msg);
-            send_to_user(game_to_forfeit->player_usernames[PLAYER2], &forfeit_msg);
+            send_to_user(game_to_forfeit->players[PLAYER1], &forfeit_msg);
+            send_to_user(game_to_forfeit->players[PLAYER2], &forfeit_msg);
         }
     }
     else if (strcmp(command, "/help") == 0)
@@ -393,7 +638,8 @@ void handle_command(int sockfd, const char *command, const char *username)
                                "  /help - Displays this help message\n"
                                "  /exit - Disconnects from the server\n"
                                "  /info <username> - Retrieves information about a user (name and biography)\n"
-                               "  /bio <biography> - Sets your biography\n\n"
+                               "  /bio <biography> - Sets your biography\n"
+                               "  /stats - Shows server statistics\n\n"
 
                                "%sPlayer Interaction:%s\n"
                                "  /addfriend <username> - Adds a user to your friends list\n"
@@ -404,6 +650,7 @@ void handle_command(int sockfd, const char *command, const char *username)
                                "%sGames:%s\n"
                                "  /listgames - Lists all active games you are part of\n"
                                "  /challenge <username> - Challenges another player to a game\n"
+                               "  /challenge bot [level] - Plays against the computer, level 1 to 5 (default 3)\n"
                                "  /accept <game_id> - Accepts a game challenge\n"
                                "  /decline <game_id> - Declines a game challenge\n"
                                "  /move <game_id> <hole_number> - Makes a move in a specified game\n"
@@ -412,62 +659,78 @@ void handle_command(int sockfd, const char *command, const char *username)
                                "  /forfeit <game_id> - Forfeits a game\n"
                                "  /watch <game_id> - Watches a game\n"
                                "  /unwatch <game_id> - Stops watching a game\n"
+                               "  /resync <game_id> - Sends the whole board of a watched game again\n"
                                "  /match - Joins the matchmaking queue\n"
                                "  /visibility <game_id> <visibility> - Sets the visibility of a game (0 for private, 1 for public)\n",
                 SERVER_INFO_STYLE, STYLE_BOLD, COLOR_RESET, SERVER_INFO_STYLE, COLOR_RESET, SERVER_INFO_STYLE, COLOR_RESET, SERVER_INFO_STYLE, COLOR_RESET);
 
-        send_message(sockfd, &response);
+        send_to_client(conn, &response);
     }
 
     // Game commands
     else if (strncmp(command, "/challenge ", 11) == 0)
     {
         char target_username[USERNAME_MAX_LEN];
-        sscanf(command + 11, "%s", target_username);
+        int level = BOT_DEFAULT_LEVEL;
+        sscanf(command + 11, "%31s %d", target_username, &level);
 
-        if (strcmp(target_username, username) == 0)
+        // Bots are always available, the game starts right away
+        if (strcmp(target_username, BOT_PREFIX) == 0)
         {
-            colorize("You cannot challenge yourself.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
-            return;
+            if (level < BOT_MIN_LEVEL || level > BOT_MAX_LEVEL)
+            {
+                char error[64];
+                sprintf(error, "Bot level must be between %d and %d.", BOT_MIN_LEVEL, BOT_MAX_LEVEL);
+                colorize(error, SERVER_ERROR_STYLE, NULL, response.data);
+                send_to_client(conn, &response);
+                return;
+            }
+            bot_username(level, target_username);
         }
-
-        // Check if target user exists
-        int user_found = 0;
-        pthread_mutex_lock(&clients_mutex);
-        for (int i = 0; i < MAX_CLIENTS; ++i)
+        if (bot_level(target_username) != 0)
         {
-            if (clients[i].sockfd != 0 && strcmp(clients[i].username, target_username) == 0)
+            if (!start_game(allocate_game_id(), name_id, intern_username(target_username)))
             {
-                user_found = 1;
-                break;
+                colorize("Failed to create game.", SERVER_ERROR_STYLE, NULL, response.data);
+                send_to_client(conn, &response);
             }
+            return;
+        }
+
+        UsernameId target_id = find_username_id(target_username);
+        if (target_id == name_id)
+        {
+            colorize("You cannot challenge yourself.", SERVER_ERROR_STYLE, NULL, response.data);
+            send_to_client(conn, &response);
+            return;
         }
-        pthread_mutex_unlock(&clients_mutex);
+
+        // Check if target user exists
+        int user_found = registry_contains(&clients, target_id);
 
         if (!user_found)
         {
             colorize("User not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
         // Create a unique game ID (simple increment, could be improved)
-        int game_id = next_game_id++;
+        int game_id = allocate_game_id();
 
         // Add challenge to the list
-        add_challenge(username, target_username, game_id);
+        add_challenge(name_id, target_id, game_id);
 
         // Notify the challenged user
         Message challenge_msg;
         challenge_msg.type = MSG_TYPE_TEXT;
         strcpy(challenge_msg.username, "Server");
         snprintf(challenge_msg.data, BUFFER_SIZE, "You have been challenged by %s. Use /accept %d or /decline %d to respond.", username, game_id, game_id);
-        send_to_user(target_username, &challenge_msg);
+        send_to_user(target_id, &challenge_msg);
 
         // Notify the challenger
         colorize("Challenge sent.", SERVER_SUCCESS_STYLE, NULL, response.data);
-        send_message(sockfd, &response);
+        send_to_client(conn, &response);
     }
     else if (strncmp(command, "/accept", 7) == 0)
     {
@@ -481,7 +744,7 @@ void handle_command(int sockfd, const char *command, const char *username)
         Challenge *prev = NULL;
         while (current)
         {
-            if (current->game_id == game_id && strcmp(current->challenged, username) == 0)
+            if (current->game_id == game_id && current->challenged == name_id)
             {
                 challenge = current;
                 // Remove from challenge list
@@ -503,56 +766,17 @@ void handle_command(int sockfd, const char *command, const char *username)
         if (!challenge)
         {
             colorize("No such challenge found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
-        // Create a new game
-        Game *new_game = create_game(game_id, challenge->challenger, challenge->challenged);
+        Game *new_game = start_game(game_id, challenge->challenger, challenge->challenged);
+        free(challenge);
         if (!new_game)
         {
             colorize("Failed to create game.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
-            free(challenge);
-            return;
+            send_to_client(conn, &response);
         }
-
-        // Add the game to the game list
-        pthread_mutex_lock(&game_mutex);
-        add_game(&game_list, new_game);
-        // Save the game state to a file
-        save_game_state(new_game);
-        pthread_mutex_unlock(&game_mutex);
-
-        // Notify both players
-        Message game_start_msg;
-        game_start_msg.type = MSG_TYPE_TEXT;
-        strcpy(game_start_msg.username, "Server");
-        char *pos = game_start_msg.data;
-
-        // make a random first player
-        new_game->state.turn = rand() % 2;
-
-        pos += sprintf(pos, "Game %d started between %s%s%s and %s%s%s. It's %s's turn.\n",
-                       game_id, STYLE_BOLD, new_game->player_usernames[PLAYER1], COLOR_RESET, STYLE_BOLD,
-                       new_game->player_usernames[PLAYER2], COLOR_RESET, new_game->player_usernames[new_game->state.turn]);
-        // Todo: probs only need to send to the player whose turn it is
-        pos += sprintf(pos, "%s, reply with /move %d <hole_number> to make your move.\n",
-                       new_game->player_usernames[new_game->state.turn], game_id);
-        send_to_user(new_game->player_usernames[PLAYER1], &game_start_msg);
-        send_to_user(new_game->player_usernames[PLAYER2], &game_start_msg);
-        free(challenge);
-
-        // pretty_board_state(new_game, response.data);
-        // send_to_user(new_game->player_usernames[PLAYER1], &response);
-        // send_to_user(new_game->player_usernames[PLAYER2], &response);
-
-        // Print the initial board state
-        game_start_msg.type = MSG_TYPE_INFO;
-        strcpy(game_start_msg.username, "Server");
-        strcpy(game_start_msg.data, game_to_string(new_game));
-        send_to_user(new_game->player_usernames[PLAYER1], &game_start_msg);
-        send_to_user(new_game->player_usernames[PLAYER2], &game_start_msg);
     }
     else if (strncmp(command, "/decline ", 9) == 0)
     {
@@ -566,7 +790,7 @@ void handle_command(int sockfd, const char *command, const char *username)
         Challenge *prev = NULL;
         while (current)
         {
-            if (current->game_id == game_id && strcmp(current->challenged, username) == 0)
+            if (current->game_id == game_id && current->challenged == name_id)
             {
                 challenge = current;
                 // Remove from challenge list
@@ -588,7 +812,7 @@ void handle_command(int sockfd, const char *command, const char *username)
         if (!challenge)
         {
             colorize("No such challenge found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
@@ -596,12 +820,12 @@ void handle_command(int sockfd, const char *command, const char *username)
         Message decline_msg;
         decline_msg.type = MSG_TYPE_TEXT;
         strcpy(decline_msg.username, "Server");
-        snprintf(decline_msg.data, BUFFER_SIZE, "Your challenge to %s has been declined.", challenge->challenged);
+        snprintf(decline_msg.data, BUFFER_SIZE, "Your challenge to %s has been declined.", username);
         send_to_user(challenge->challenger, &decline_msg);
 
         // Notify the decliner
         colorize("Challenge declined.", SERVER_SUCCESS_STYLE, NULL, response.data);
-        send_message(sockfd, &response);
+        send_to_client(conn, &response);
         free(challenge);
     }
     else if (strncmp(command, "/move ", 6) == 0)
@@ -611,194 +835,144 @@ void handle_command(int sockfd, const char *command, const char *username)
         // From here onwards, holes are 0-indexed
         hole--;
 
-        pthread_mutex_lock(&game_mutex);
-        Game *game = find_game_by_id(game_list, game_id);
+        Game *game = lookup_game(game_id);
 
         if (!game)
         {
             colorize("Game not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
-            pthread_mutex_unlock(&game_mutex);
+            send_to_client(conn, &response);
             return;
         }
 
+        // The game is locked from the checks until the new state is saved and sent,
+        // so moves are applied and broadcast in order, without waiting on other games
+        pthread_mutex_lock(&game->lock);
+
         // Check the game isn't over
         if (game->status != ONGOING)
         {
             colorize("Game is already over.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
-            pthread_mutex_unlock(&game_mutex);
+            send_to_client(conn, &response);
+            pthread_mutex_unlock(&game->lock);
             return;
         }
-        pthread_mutex_unlock(&game_mutex);
 
         // Determine player number
         int player = -1;
-        if (strcmp(game->player_usernames[PLAYER1], username) == 0)
+        if (game->players[PLAYER1] == name_id)
         {
             player = PLAYER1;
         }
-        else if (strcmp(game->player_usernames[PLAYER2], username) == 0)
+        else if (game->players[PLAYER2] == name_id)
         {
             player = PLAYER2;
         }
         else
         {
             colorize("You are not a participant of this game.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
+            pthread_mutex_unlock(&game->lock);
             return;
         }
 
-        // Attempt to make the move
+        // Attempt to make the move, spectators are only sent what it changed
+        GameState before = game->state;
         int move_result = make_move(game, player, hole);
         if (move_result == -1)
         {
             colorize("Not your turn.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
+            pthread_mutex_unlock(&game->lock);
             return;
         }
         else if (move_result == -2)
         {
             colorize("Not a hole you can select.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
+            pthread_mutex_unlock(&game->lock);
             return;
         }
         else if (move_result == -3)
         {
             colorize("Selected hole is empty.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
+            pthread_mutex_unlock(&game->lock);
             return;
         }
 
-        // Prepare game state update message
-        Message game_msg;
-        game_msg.type = MSG_TYPE_TEXT;
-        strcpy(game_msg.username, "Server");
-
-        // Check if game is over
-        if (move_result == 1)
-        {
-            snprintf(game_msg.data, BUFFER_SIZE, "Game %d over. Scores - %s: %d, %s: %d.",
-                     game->game_id, game->player_usernames[PLAYER1], game->state.scores[PLAYER1],
-                     game->player_usernames[PLAYER2], game->state.scores[PLAYER2]);
-            // Notify both players
-            send_to_user(game->player_usernames[PLAYER1], &game_msg);
-            send_to_user(game->player_usernames[PLAYER2], &game_msg);
-
-            // Remove the game from the list
-            pthread_mutex_lock(&game_mutex);
-            remove_game(&game_list, game->game_id);
-            pthread_mutex_unlock(&game_mutex);
-        }
-        else
-        {
-            // Notify both players of the updated game state
-            char *pos = game_msg.data;
-            pos += sprintf(pos, " ===== Game %d =====\n", game->game_id);
-            pos += sprintf(pos, "Move executed (%s played hole %d). It's %s's turn.\nNew board state:\n",
-                           username, hole, game->player_usernames[game->state.turn]);
-            // pos += pretty_board_state(game, pos);
-            // Todo: probs only need to send to the player whose turn it is
-            pos += sprintf(pos, "%s, reply with /move %d <hole_number> to make your move.\n",
-                           game->player_usernames[game->state.turn], game->game_id);
-            send_to_user(game->player_usernames[PLAYER1], &game_msg);
-            send_to_user(game->player_usernames[PLAYER2], &game_msg);
-
-            game_msg.type = MSG_TYPE_INFO;
-            strcpy(game_msg.username, "Server");
-            strcpy(game_msg.data, game_to_string(game));
-            send_to_user(game->player_usernames[PLAYER1], &game_msg);
-            send_to_user(game->player_usernames[PLAYER2], &game_msg);
-
-            for (int i = 0; i < MAX_WATCHERS; i++)
-            {
-                if (game->watch_list[i][0] != '\0')
-                {
-                    send_to_user(game->watch_list[i], &game_msg);
-                }
-            }
-        }
-
-        // Save the game state to a file
-        pthread_mutex_lock(&game_mutex);
-        save_game_state(game);
-        pthread_mutex_unlock(&game_mutex);
+        announce_move(game, player, hole, move_result, &before);
     }
     else if (strcmp(command, "/listgames") == 0)
     {
-        // List all active games, with a special message if the user is a participant
+        // List the active games of the user first, then the other active games while they fit
         char list[BUFFER_SIZE] = "Active Games:\n";
-        pthread_mutex_lock(&game_mutex);
-        Game *current = game_list;
-        while (current)
-        {
-            char *pos = list + strlen(list);
-            if (strcmp(current->player_usernames[PLAYER1], username) == 0 ||
-                strcmp(current->player_usernames[PLAYER2], username) == 0)
-            {
-                pos += sprintf(pos, "[YOU] ");
-            }
-            pos += sprintf(pos, "Game %d: %s vs %s (", current->game_id,
-                           current->player_usernames[PLAYER1], current->player_usernames[PLAYER2]);
-            if (current->status == ONGOING)
-            {
-                pos += sprintf(pos, "ongoing");
-            }
-            else if (current->status == PLAYER1_WON)
-            {
-                pos += sprintf(pos, "%s won", current->player_usernames[PLAYER1]);
-            }
-            else if (current->status == PLAYER2_WON)
-            {
-                pos += sprintf(pos, "%s won", current->player_usernames[PLAYER2]);
-            }
-            else if (current->status == DRAW)
+        char *pos = list + strlen(list);
+        // Leave room for the color codes and the truncation mark
+        char *end = list + BUFFER_SIZE - 2 * USERNAME_MAX_LEN - 64;
+        // Statuses only change while the index is locked for writing, so the games don't need to be locked
+        pthread_rwlock_rdlock(&game_index_lock);
+        PlayerGames *own_games = find_player_games(&game_index, name_id);
+        for (int i = 0; own_games && i < own_games->count && pos < end; i++)
+        {
+            Game *current = own_games->games[i];
+            pos += sprintf(pos, "[YOU] Game %d: %s vs %s (ongoing)\n", current->game_id,
+                           username_of(current->players[PLAYER1]), username_of(current->players[PLAYER2]));
+        }
+        for (size_t i = 0; i < game_index.capacity && pos < end; i++)
+        {
+            Game *current = game_index.slots[i].game;
+            if (game_index.slots[i].state != GAME_SLOT_USED || current->status != ONGOING ||
+                current->players[PLAYER1] == name_id || current->players[PLAYER2] == name_id)
             {
-                pos += sprintf(pos, "draw");
+                continue;
             }
-            pos += sprintf(pos, ")\n");
-            current = current->next;
+            pos += sprintf(pos, "Game %d: %s vs %s (ongoing)\n", current->game_id,
+                           username_of(current->players[PLAYER1]), username_of(current->players[PLAYER2]));
+        }
+        if (pos >= end)
+        {
+            sprintf(pos, "...\n");
         }
-        pthread_mutex_unlock(&game_mutex);
+        pthread_rwlock_unlock(&game_index_lock);
 
         colorize(list, SERVER_GAME_STYLE, NULL, response.data);
-        send_message(sockfd, &response);
+        send_to_client(conn, &response);
     }
     else if (strncmp(command, "/gameinfo ", 10) == 0)
     {
         int game_id;
         sscanf(command + 10, "%d", &game_id);
 
-        pthread_mutex_lock(&game_mutex);
-        Game *game = find_game_by_id(game_list, game_id);
-        pthread_mutex_unlock(&game_mutex);
+        Game *game = lookup_game(game_id);
 
         if (!game)
         {
             colorize("Game not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
         // if the game is private, the user can't see it if they are not a friend of the players
         // We check both players' friends list, since friendship is unilateral
-        if (game->visibility == 0 && strcmp(username, game->player_usernames[PLAYER1]) != 0 && strcmp(username, game->player_usernames[PLAYER2]) != 0)
+        pthread_mutex_lock(&game->lock);
+        int visibility = game->visibility;
+        pthread_mutex_unlock(&game->lock);
+        if (visibility == 0 && game->players[PLAYER1] != name_id && game->players[PLAYER2] != name_id)
         {
-            if ((!is_friend(game->player_usernames[PLAYER1], username) && !is_friend(game->player_usernames[PLAYER2], username)))
+            if ((!is_friend(username_of(game->players[PLAYER1]), username) && !is_friend(username_of(game->players[PLAYER2]), username)))
             {
                 colorize("You can't watch this game because it's private and you are not a friend of the players.", SERVER_ERROR_STYLE, NULL, response.data);
-                send_message(sockfd, &response);
-                pthread_mutex_unlock(&game_mutex);
+                send_to_client(conn, &response);
                 return;
             }
         }
 
         // Prepare game state information
-        Message game_msg;
-        game_msg.type = MSG_TYPE_INFO;
-        strcpy(game_msg.username, "Server");
-        strcpy(game_msg.data, game_to_string(game));
-        send_message(sockfd, &game_msg);
+        Message boards[WIRE_FORMAT_COUNT];
+        pthread_mutex_lock(&game->lock);
+        prepare_board_messages(game, boards);
+        pthread_mutex_unlock(&game->lock);
+        send_board(conn, boards);
     }
     else if (strncmp(command, "/visibility", 11) == 0)
     {
@@ -806,21 +980,19 @@ void handle_command(int sockfd, const char *command, const char *username)
         int visibility;
         sscanf(command + 11, "%d %d", &game_id, &visibility);
 
-        pthread_mutex_lock(&game_mutex);
-        Game *game = find_game_by_id(game_list, game_id);
-        pthread_mutex_unlock(&game_mutex);
+        Game *game = lookup_game(game_id);
 
         if (!game)
         {
             colorize("Game not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
-        if (strcmp(username, game->player_usernames[PLAYER1]) != 0)
+        if (game->players[PLAYER1] != name_id)
         {
             colorize("You are not the host of this game.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
@@ -828,13 +1000,15 @@ void handle_command(int sockfd, const char *command, const char *username)
         if (visibility != 0 && visibility != 1)
         {
             colorize("Visibility must be 0 or 1.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
+        pthread_mutex_lock(&game->lock);
         game->visibility = visibility;
+        pthread_mutex_unlock(&game->lock);
         colorize("Visibility updated.", SERVER_SUCCESS_STYLE, NULL, response.data);
-        send_message(sockfd, &response);
+        send_to_client(conn, &response);
     }
     // Get the history of moves in a game
     else if (strncmp(command, "/history ", 9) == 0)
@@ -842,14 +1016,12 @@ void handle_command(int sockfd, const char *command, const char *username)
         int game_id;
         sscanf(command + 9, "%d", &game_id);
 
-        pthread_mutex_lock(&game_mutex);
-        Game *game = find_game_by_id(game_list, game_id);
-        pthread_mutex_unlock(&game_mutex);
+        Game *game = lookup_game(game_id);
 
         if (!game)
         {
             colorize("Game not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
@@ -857,15 +1029,17 @@ void handle_command(int sockfd, const char *command, const char *username)
         Message history_msg;
         history_msg.type = MSG_TYPE_TEXT;
         strcpy(history_msg.username, "Server");
+        pthread_mutex_lock(&game->lock);
         MoveNode *current = game->move_history;
         char *pos = history_msg.data;
         pos += sprintf(pos, "Move history for game %d:\n", game_id);
         while (current)
         {
-            pos += sprintf(pos, "%s played hole %d\n", game->player_usernames[current->player], current->hole + 1);
+            pos += sprintf(pos, "%s played hole %d\n", username_of(game->players[current->player]), current->hole + 1);
             current = current->next;
         }
-        send_message(sockfd, &history_msg);
+        pthread_mutex_unlock(&game->lock);
+        send_to_client(conn, &history_msg);
     }
     // add friend command
     else if (strncmp(command, "/addfriend", 10) == 0)
@@ -876,19 +1050,17 @@ void handle_command(int sockfd, const char *command, const char *username)
         if (strcmp(friend_username, username) == 0)
         {
             colorize("You cannot add yourself as a friend.\n", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
         // Check if friend user exists
-        pthread_mutex_lock(&clients_mutex);
         int user_found = user_exists(friend_username);
-        pthread_mutex_unlock(&clients_mutex);
 
         if (!user_found)
         {
             colorize("User not found.\n", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
@@ -896,17 +1068,17 @@ void handle_command(int sockfd, const char *command, const char *username)
         if (added == 1)
         {
             colorize("Friend added successfully.\n", SERVER_SUCCESS_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
         else if (added == 0)
         {
             colorize("Friend already exists in your list.\n", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
         else
         {
             colorize("Failed to add friend.\n", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
     }
     else if (strncmp(command, "/removefriend", 12) == 0)
@@ -917,19 +1089,17 @@ void handle_command(int sockfd, const char *command, const char *username)
         if (strcmp(friend_username, username) == 0)
         {
             colorize("You cannot remove yourself as a friend.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
         // Check if friend user exists
-        pthread_mutex_lock(&clients_mutex);
         int user_found = user_exists(friend_username);
-        pthread_mutex_unlock(&clients_mutex);
 
         if (!user_found)
         {
             colorize("User not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
@@ -943,41 +1113,46 @@ void handle_command(int sockfd, const char *command, const char *username)
             if (removed)
             {
                 colorize("Friend removed successfully.", SERVER_SUCCESS_STYLE, NULL, response.data);
-                send_message(sockfd, &response);
+                send_to_client(conn, &response);
             }
             else
             {
                 colorize("Friend not found in your list.", SERVER_ERROR_STYLE, NULL, response.data);
-                send_message(sockfd, &response);
+                send_to_client(conn, &response);
             }
         }
         else
         {
             colorize("Failed to load user.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
     }
     else if (strcmp(command, "/getfriends") == 0)
     {
-        User user;
-        if (load_user(username, &user) == 1)
+        char (*friends)[USERNAME_MAX_LEN];
+        size_t count;
+        if (get_friends(username, &friends, &count) == 1)
         {
             char friends_list[BUFFER_SIZE] = "Friends:\n";
-            for (int i = 0; i < MAX_FRIENDS; i++)
+            size_t len = strlen(friends_list);
+            for (size_t i = 0; i < count; i++)
             {
-                if (user.friends[i][0] != '\0')
+                // Leave room for the color codes
+                if (len + USERNAME_MAX_LEN + 32 >= BUFFER_SIZE)
                 {
-                    strcat(friends_list, user.friends[i]);
-                    strcat(friends_list, "\n");
+                    strcat(friends_list, "...\n");
+                    break;
                 }
+                len += sprintf(friends_list + len, "%s\n", friends[i]);
             }
+            free(friends);
             colorize(friends_list, SERVER_SUCCESS_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
         else
         {
             colorize("Failed to load user.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
     }
     // watch a specific game
@@ -986,105 +1161,110 @@ void handle_command(int sockfd, const char *command, const char *username)
         int game_id;
         sscanf(command + 7, "%d", &game_id);
 
-        pthread_mutex_lock(&game_mutex);
-        Game *game = find_game_by_id(game_list, game_id);
-        pthread_mutex_unlock(&game_mutex);
+        Game *game = lookup_game(game_id);
 
         if (!game)
         {
             colorize("Game not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
         // Add the user to the watch list
-        pthread_mutex_lock(&game_mutex);
+        pthread_mutex_lock(&game->lock);
         // if the game is private, the user can't watch it if they are not a friend of the players
         // We check both players' friends list, since friendship is unilateral
         if (game->visibility == 0)
         {
-            if (!is_friend(game->player_usernames[PLAYER1], username) && !is_friend(game->player_usernames[PLAYER2], username))
+            if (!is_friend(username_of(game->players[PLAYER1]), username) && !is_friend(username_of(game->players[PLAYER2]), username))
             {
                 colorize("You can't watch this game because it's private and you are not a friend of the players.", SERVER_ERROR_STYLE, NULL, response.data);
-                send_message(sockfd, &response);
-                pthread_mutex_unlock(&game_mutex);
+                send_to_client(conn, &response);
+                pthread_mutex_unlock(&game->lock);
                 return;
             }
         }
         // check if the user is already watching the game
         int already_watching = 0;
-        for (int i = 0; i < 100; i++)
+        if (is_subscribed(conn, &game->watchers))
         {
-            if (strcmp(game->watch_list[i], username) == 0)
-            {
-                colorize("You are already watching this game.", SERVER_ERROR_STYLE, NULL, response.data);
-                already_watching = 1;
-                send_message(sockfd, &response);
-                break;
-            }
+            colorize("You are already watching this game.", SERVER_ERROR_STYLE, NULL, response.data);
+            already_watching = 1;
+            send_to_client(conn, &response);
         }
 
         // check if user doesn't watch his own game
         int own_game = 0;
-        if (strcmp(game->player_usernames[PLAYER1], username) == 0 || strcmp(game->player_usernames[PLAYER2], username) == 0)
+        if (game->players[PLAYER1] == name_id || game->players[PLAYER2] == name_id)
         {
             colorize("You can't watch your own game.", SERVER_ERROR_STYLE, NULL, response.data);
             own_game = 1;
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
-        // traverse the watch list to see an available slot
         if (already_watching == 0 && own_game == 0)
         {
-            for (int i = 0; i < 100; i++)
+            if (topic_subscribe(&game->watchers, conn) == 1)
             {
-                if (game->watch_list[i][0] == '\0')
-                {
-                    strncpy(game->watch_list[i], username, USERNAME_MAX_LEN - 1);
-                    colorize("You are now watching the game.", SERVER_SUCCESS_STYLE, NULL, response.data);
-                    send_message(sockfd, &response);
-                    break;
-                }
+                colorize("You are now watching the game.", SERVER_SUCCESS_STYLE, NULL, response.data);
+                send_to_client(conn, &response);
+                // Queued before any delta, since the game stays locked
+                send_game_snapshot(conn, game);
+            }
+            else
+            {
+                colorize("Failed to watch the game.", SERVER_ERROR_STYLE, NULL, response.data);
+                send_to_client(conn, &response);
             }
         }
-        pthread_mutex_unlock(&game_mutex);
+        pthread_mutex_unlock(&game->lock);
     }
     else if (strncmp(command, "/unwatch ", 7) == 0)
     {
         int game_id;
         sscanf(command + 9, "%d", &game_id);
 
-        pthread_mutex_lock(&game_mutex);
-        Game *game = find_game_by_id(game_list, game_id);
-        pthread_mutex_unlock(&game_mutex);
+        Game *game = lookup_game(game_id);
 
         if (!game)
         {
             colorize("Game not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
         // Remove the user from the watch list
-        pthread_mutex_lock(&game_mutex);
-        int watching = 0;
-        for (int i = 0; i < 100; i++)
+        pthread_mutex_lock(&game->lock);
+        int watching = topic_unsubscribe(&game->watchers, conn);
+        if (watching)
         {
-            if (strcmp(game->watch_list[i], username) == 0)
-            {
-                game->watch_list[i][0] = '\0';
-                watching = 1;
-                colorize("You are no longer watching the game.", SERVER_SUCCESS_STYLE, NULL, response.data);
-                break;
-            }
+            colorize("You are no longer watching the game.", SERVER_SUCCESS_STYLE, NULL, response.data);
+        }
+        else
+        {
+            colorize("You are not watching this game.", SERVER_ERROR_STYLE, NULL, response.data);
         }
 
-        if (!watching)
+        pthread_mutex_unlock(&game->lock);
+        send_to_client(conn, &response);
+    }
+    // Send the whole game again to a spectator that missed a delta
+    else if (strncmp(command, "/resync ", 8) == 0)
+    {
+        int game_id;
+        sscanf(command + 8, "%d", &game_id);
+
+        Game *game = lookup_game(game_id);
+
+        if (!game || !is_subscribed(conn, &game->watchers))
         {
             colorize("You are not watching this game.", SERVER_ERROR_STYLE, NULL, response.data);
+            send_to_client(conn, &response);
+            return;
         }
 
-        pthread_mutex_unlock(&game_mutex);
-        send_message(sockfd, &response);
+        pthread_mutex_lock(&game->lock);
+        send_game_snapshot(conn, game);
+        pthread_mutex_unlock(&game->lock);
     }
     // chat to a party with /chat <number_of_party> <message>
     else if (strncmp(command, "/chat ", 6) == 0)
@@ -1092,28 +1272,28 @@ void handle_command(int sockfd, const char *command, const char *username)
         int party;
         char message[BUFFER_SIZE];
         sscanf(command + 6, "%d %[^\n]", &party, message);
-        Game *game = find_game_by_id(game_list, party);
+        Game *game = lookup_game(party);
         if (!game)
         {
             colorize("Game not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
-        if (strcmp(username, game->player_usernames[PLAYER1]) == 0 || strcmp(username, game->player_usernames[PLAYER2]) == 0)
+        if (game->players[PLAYER1] == name_id || game->players[PLAYER2] == name_id)
         {
             Message chat_msg;
             chat_msg.type = MSG_TYPE_GAME;
             strcpy(chat_msg.username, username);
             strcpy(chat_msg.data, message);
 
-            send_to_user(game->player_usernames[PLAYER1], &chat_msg);
-            send_to_user(game->player_usernames[PLAYER2], &chat_msg);
+            send_to_user(game->players[PLAYER1], &chat_msg);
+            send_to_user(game->players[PLAYER2], &chat_msg);
         }
         else
         {
             colorize("You are not a participant of this game.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
     }
     // Allow user to set a biography
@@ -1132,18 +1312,18 @@ void handle_command(int sockfd, const char *command, const char *username)
             if (save_user(&user) == 1)
             {
                 colorize("Biography updated successfully.", SERVER_SUCCESS_STYLE, NULL, response.data);
-                send_message(sockfd, &response);
+                send_to_client(conn, &response);
             }
             else
             {
                 colorize("Failed to save biography.", SERVER_ERROR_STYLE, NULL, response.data);
-                send_message(sockfd, &response);
+                send_to_client(conn, &response);
             }
         }
         else
         {
             colorize("Failed to load user data.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
     }
     // get info of a specific user, get the informations from the file of the user, don't show the password
@@ -1159,12 +1339,12 @@ void handle_command(int sockfd, const char *command, const char *username)
             snprintf(response.data, BUFFER_SIZE, "%sUsername: %s%s\n%sBiography: %s%s",
                      SERVER_INFO_STYLE, target_user.username, COLOR_RESET,
                      SERVER_INFO_STYLE, target_user.biography, COLOR_RESET);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
         else
         {
             colorize("User not found.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
         }
     }
     // private message with /mp <name_to_receiver> <message>
@@ -1177,7 +1357,7 @@ void handle_command(int sockfd, const char *command, const char *username)
         if (strcmp(username, receiver) == 0)
         {
             colorize("You can't send a message to yourself.", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
+            send_to_client(conn, &response);
             return;
         }
 
@@ -1186,244 +1366,639 @@ void handle_command(int sockfd, const char *command, const char *username)
         strcpy(private_msg.username, username);
         strcpy(private_msg.data, message);
 
-        send_to_user(receiver, &private_msg);
+        send_to_user(find_username_id(receiver), &private_msg);
     }
     else if (strcmp(command, "/match") == 0)
     {
-        handle_matchmaking(sockfd, username);
+        handle_matchmaking(conn, name_id);
     }
 
     else
     {
         colorize("Unknown command.", SERVER_ERROR_STYLE, NULL, response.data);
-        send_message(sockfd, &response);
+        send_to_client(conn, &response);
     }
 }
 
-void *handle_client(void *arg)
+// Send a fatal error to a client before its connection is closed
+void reject_client(Connection *conn, const char *reason)
 {
-    int sockfd = *(int *)arg;
-    free(arg);
+    Message response;
+    response.type = MSG_TYPE_EXIT;
+    response.username[0] = '\0';
+    snprintf(response.data, BUFFER_SIZE, "%s", reason);
+    send_to_client(conn, &response);
+}
 
-    Message msg;
-    int res = receive_message(sockfd, &msg);
+// Log the user in: register them in the clients list and greet them
+// Returns -1 if the connection must be closed
+int complete_login(Connection *conn)
+{
+    // From now on the user is known by the ID of its username
+    conn->name_id = intern_username(conn->user.username);
 
-    if (res == -1 || msg.type == MSG_TYPE_EXIT)
+    // Add client to clients list
+    RegistryResult result = registry_add(&clients, conn);
+    if (result == REGISTRY_TAKEN)
     {
-        close(sockfd);
-        pthread_exit(NULL);
+        // Someone logged in with the same username in the meantime
+        char reason[BUFFER_SIZE];
+        sprintf(reason, "Username %s is already taken.", conn->user.username);
+        reject_client(conn, reason);
+        return -1;
     }
-    if (is_username_taken(msg.username))
+    else if (result != REGISTRY_ADDED)
+    {
+        // Max clients reached
+        char reason[BUFFER_SIZE];
+        colorize("Server full.", SERVER_ERROR_STYLE, NULL, reason);
+        reject_client(conn, reason);
+        return -1;
+    }
+    conn->state = CONN_READY;
+    topic_subscribe(&lobby, conn);
+
+    // Send welcome message
+    Message welcome_msg;
+    welcome_msg.type = MSG_TYPE_SERVER;
+    welcome_msg.username[0] = '\0';
+    colorize("Connection successful", SERVER_SUCCESS_STYLE, STYLE_BOLD, welcome_msg.data);
+    send_to_client(conn, &welcome_msg);
+
+    printf("%s has connected.\n", conn->user.username);
+
+    welcome_msg.type = MSG_TYPE_SERVER;
+    colorize(SERVER_WELCOME_MESSAGE, SERVER_INFO_STYLE, NULL, welcome_msg.data);
+    send_to_client(conn, &welcome_msg);
+    // Also broadcast to other clients
+    Message connected_msg;
+    connected_msg.type = MSG_TYPE_SERVER;
+    connected_msg.username[0] = '\0';
+    sprintf(connected_msg.data, "%s%s%s%s %shas connected.%s", SERVER_INFO_STYLE, STYLE_BOLD, conn->user.username, COLOR_RESET, SERVER_INFO_STYLE, COLOR_RESET);
+    broadcast_message(&connected_msg, conn);
+    return 0;
+}
+
+// Handle the first message of a connection, which carries the username
+// Returns -1 if the connection must be closed
+int handle_username(Connection *conn, Message *msg)
+{
+    if (is_username_taken(msg->username))
     {
         // Username is taken
-        Message response;
-        response.type = MSG_TYPE_EXIT;
-        sprintf(response.data, "Username %s is already taken.", msg.username);
-        send_message(sockfd, &response);
-        close(sockfd);
-        pthread_exit(NULL);
+        char reason[BUFFER_SIZE];
+        sprintf(reason, "Username %s is already taken.", msg->username);
+        reject_client(conn, reason);
+        return -1;
+    }
+    // The names of the bots can't be taken by a client
+    if (strcmp(msg->username, BOT_PREFIX) == 0 || bot_level(msg->username) != 0)
+    {
+        char reason[BUFFER_SIZE];
+        sprintf(reason, "Username %s is reserved for the bots.", msg->username);
+        reject_client(conn, reason);
+        return -1;
     }
     // Validate username length
-    if (strlen(msg.username) == 0 || strlen(msg.username) >= USERNAME_MAX_LEN)
+    size_t username_len = strnlen(msg->username, USERNAME_MAX_LEN);
+    if (username_len == 0 || username_len >= USERNAME_MAX_LEN)
     {
         // Invalid username
-        Message response;
-        response.type = MSG_TYPE_EXIT;
-        sprintf(response.data, "Invalid username. Must be between 1 and %d characters.", USERNAME_MAX_LEN - 1);
-        send_message(sockfd, &response);
-        close(sockfd);
-        pthread_exit(NULL);
+        char reason[BUFFER_SIZE];
+        sprintf(reason, "Invalid username. Must be between 1 and %d characters.", USERNAME_MAX_LEN - 1);
+        reject_client(conn, reason);
+        return -1;
     }
     // Only allow alphanumeric usernames
-    for (int i = 0; i < strlen(msg.username); i++)
+    for (size_t i = 0; i < username_len; i++)
     {
-        if (!isalnum(msg.username[i]))
+        if (!isalnum(msg->username[i]))
         {
             // Invalid username
-            Message response;
-            response.type = MSG_TYPE_EXIT;
-            sprintf(response.data, "Invalid username. Must be alphanumeric.");
-            send_message(sockfd, &response);
-            close(sockfd);
-            pthread_exit(NULL);
+            reject_client(conn, "Invalid username. Must be alphanumeric.");
+            return -1;
         }
     }
 
-    User user;
-    int user_exists = load_user(msg.username, &user);
+    int user_exists = load_user(msg->username, &conn->user);
 
+    Message response;
+    response.type = MSG_TYPE_SERVER;
+    response.username[0] = '\0';
     if (user_exists == 1)
     {
-        // User exists, check password
-        Message response;
-        response.type = MSG_TYPE_SERVER;
+        // User exists, ask for the password
         colorize("Password: ", SERVER_INFO_STYLE, NULL, response.data);
-        send_message(sockfd, &response);
-        res = receive_message(sockfd, &msg);
-        if (res == -1 || msg.type == MSG_TYPE_EXIT)
-        {
-            close(sockfd);
-            pthread_exit(NULL);
-        }
-
-        // if user enters wrong password repeat until correct
-        while (strcmp(msg.data, user.password) != 0)
-        {
-            Message response;
-            response.type = MSG_TYPE_SERVER;
-            colorize("Incorrect password. Try again: ", SERVER_ERROR_STYLE, NULL, response.data);
-            send_message(sockfd, &response);
-            res = receive_message(sockfd, &msg);
-            if (res == -1 || msg.type == MSG_TYPE_EXIT)
-            {
-                close(sockfd);
-                pthread_exit(NULL);
-            }
-        }
+        send_to_client(conn, &response);
+        conn->state = CONN_AWAIT_PASSWORD;
     }
     else if (user_exists == 0)
     {
         // TODO: make this into a function in user.c
         // User does not exist, create new user
-        memset(user.username, 0, sizeof(user.username));
-        memset(user.password, 0, sizeof(user.password));
-        memset(user.biography, 0, sizeof(user.biography));
-        for (int i = 0; i < MAX_FRIENDS; i++)
-        {
-            user.friends[i][0] = '\0';
-        }
+        memset(conn->user.username, 0, sizeof(conn->user.username));
+        memset(conn->user.password, 0, sizeof(conn->user.password));
+        memset(conn->user.biography, 0, sizeof(conn->user.biography));
+        strcpy(conn->user.username, msg->username);
 
-        Message response;
-        response.type = MSG_TYPE_SERVER;
         colorize("Create Password: ", SERVER_INFO_STYLE, NULL, response.data);
-        send_message(sockfd, &response);
-        res = receive_message(sockfd, &msg);
-        if (res == -1 || msg.type == MSG_TYPE_EXIT)
+        send_to_client(conn, &response);
+        conn->state = CONN_AWAIT_NEW_PASSWORD;
+    }
+    else
+    {
+        // Error loading user
+        reject_client(conn, "Error loading user data.");
+        return -1;
+    }
+    return 0;
+}
+
+// Handle one message received from a client, according to its login progress
+// Returns -1 if the connection must be closed
+int handle_client_message(Connection *conn, Message *msg)
+{
+    if (msg->type == MSG_TYPE_EXIT)
+    {
+        return -1;
+    }
+
+    Message response;
+    response.type = MSG_TYPE_SERVER;
+
+    switch (conn->state)
+    {
+    case CONN_AWAIT_USERNAME:
+        return handle_username(conn, msg);
+
+    case CONN_AWAIT_PASSWORD:
+        // if user enters wrong password repeat until correct
+        if (strcmp(msg->data, conn->user.password) != 0)
         {
-            close(sockfd);
-            pthread_exit(NULL);
+            colorize("Incorrect password. Try again: ", SERVER_ERROR_STYLE, NULL, response.data);
+            send_to_client(conn, &response);
+            return 0;
         }
+        return complete_login(conn);
 
+    case CONN_AWAIT_NEW_PASSWORD:
         // Copy the password to user struct
-        strcpy(user.username, msg.username);
-        strcpy(user.password, msg.data);
+        strncpy(conn->user.password, msg->data, sizeof(conn->user.password) - 1);
 
         // ask for a biography to the user
-        response.type = MSG_TYPE_SERVER;
         colorize("Biography: ", SERVER_INFO_STYLE, NULL, response.data);
-        send_message(sockfd, &response);
-        res = receive_message(sockfd, &msg);
-        if (res == -1 || msg.type == MSG_TYPE_EXIT)
-        {
-            close(sockfd);
-            pthread_exit(NULL);
-        }
-        strcpy(user.biography, msg.data);
+        send_to_client(conn, &response);
+        conn->state = CONN_AWAIT_BIOGRAPHY;
+        return 0;
+
+    case CONN_AWAIT_BIOGRAPHY:
+        strncpy(conn->user.biography, msg->data, sizeof(conn->user.biography) - 1);
 
         // Save the new user
-        save_user(&user);
+        save_user(&conn->user);
+        return complete_login(conn);
+
+    case CONN_READY:
+        // Never trust the username sent by the client once logged in
+        strcpy(msg->username, conn->user.username);
+        if (msg->data[0] == '/')
+        {
+            handle_command(conn, msg->data, conn->user.username);
+        }
+        else
+        {
+            // Broadcast message to other clients
+            broadcast_message(msg, conn);
+        }
+        return 0;
     }
-    else
+    return 0;
+}
+
+// Remove the client from the clients list and drop the server's reference to the connection
+void close_connection(Connection *conn)
+{
+    if (conn->state == CONN_READY)
     {
-        // Error loading user
-        Message response;
-        response.type = MSG_TYPE_EXIT;
-        sprintf(response.data, "Error loading user data.");
-        send_message(sockfd, &response);
-        close(sockfd);
-        pthread_exit(NULL);
+        printf("%s has disconnected.\n", conn->user.username);
+
+        // Leave the lobby and stop watching games, which drops their references to the connection
+        unsubscribe_all(conn);
+
+        // Remove client from clients list
+        registry_remove(&clients, conn);
+
+        // Clear the waiting player if they disconnect
+        pthread_mutex_lock(&matchmaking_mutex);
+        if (conn->name_id == waiting_player)
+        {
+            waiting_player = NO_USERNAME;
+        }
+        pthread_mutex_unlock(&matchmaking_mutex);
     }
 
-    // Send welcome message
-    Message welcome_msg;
-    welcome_msg.type = MSG_TYPE_SERVER;
-    colorize("Connection successful", SERVER_SUCCESS_STYLE, STYLE_BOLD, welcome_msg.data);
-    send_message(sockfd, &welcome_msg);
+    // Try to deliver what is still queued, like the reason of a rejection
+    flush_connection(conn);
+    pthread_mutex_lock(&conn->out_mutex);
+    conn->closed = 1;
+    pthread_mutex_unlock(&conn->out_mutex);
+    release_connection(conn);
+}
 
-    // Add client to clients list
-    pthread_mutex_lock(&clients_mutex);
+// ========== Thread-per-client mode ==========
+void *handle_client(void *arg)
+{
+    Connection *conn = (Connection *)arg;
+
+    // Peek at the first byte to find out which wire format the client speaks
+    unsigned char first_byte;
+    if (recv(conn->sockfd, &first_byte, 1, MSG_PEEK) == 1)
+    {
+        conn->format = detect_wire_format(first_byte);
+        conn->format_negotiated = 1;
+    }
 
-    int i;
-    for (i = 0; i < MAX_CLIENTS; ++i)
+    Message msg;
+    while (conn->format_negotiated && receive_message(conn->sockfd, &msg, conn->format) == 0)
     {
-        if (clients[i].sockfd == 0)
+        if (handle_client_message(conn, &msg) == -1)
         {
-            clients[i].sockfd = sockfd;
-            strncpy(clients[i].username, msg.username, USERNAME_MAX_LEN);
             break;
         }
     }
 
-    pthread_mutex_unlock(&clients_mutex);
+    close_connection(conn);
+    pthread_exit(NULL);
+}
+
+void run_thread_per_client(int server_sockfd)
+{
+    // Client threads block on reads, so another thread finishes writing to full sockets
+    start_flusher_thread();
+
+    struct sockaddr_in client_addr;
+    socklen_t sin_size;
 
-    if (i == MAX_CLIENTS)
+    while (1)
     {
-        // Max clients reached
-        Message response;
-        response.type = MSG_TYPE_EXIT;
-        colorize("Server full.", SERVER_ERROR_STYLE, NULL, response.data);
-        send_message(sockfd, &response);
-        close(sockfd);
-        pthread_exit(NULL);
+        sin_size = sizeof(struct sockaddr_in);
+        int new_sockfd = accept(server_sockfd, (struct sockaddr *)&client_addr, &sin_size);
+        if (new_sockfd == -1)
+        {
+            perror("accept");
+            continue;
+        }
+
+        printf("Got connection from %s\n", inet_ntoa(client_addr.sin_addr));
+
+        Connection *conn = create_connection(new_sockfd);
+        if (!conn)
+        {
+            close(new_sockfd);
+            continue;
+        }
+
+        // Create a thread to handle client
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, handle_client, conn) != 0)
+        {
+            perror("pthread_create");
+            close_connection(conn);
+            continue;
+        }
+
+        pthread_detach(tid);
     }
+}
 
-    printf("%s has connected.\n", msg.username);
+// ========== Event loop mode ==========
+#ifdef __linux__
+// Dispatch every complete message sitting in the read buffer of a connection
+// Returns -1 if the connection must be closed
+int process_read_buffer(Connection *conn)
+{
+    if (!conn->format_negotiated && conn->rlen > 0)
+    {
+        // The first byte tells which wire format the client speaks
+        conn->format = detect_wire_format(conn->rbuf[0]);
+        conn->format_negotiated = 1;
+    }
 
-    welcome_msg.type = MSG_TYPE_SERVER;
-    colorize(SERVER_WELCOME_MESSAGE, SERVER_INFO_STYLE, NULL, welcome_msg.data);
-    send_message(sockfd, &welcome_msg);
-    // Also broadcast to other clients
-    Message connected_msg;
-    connected_msg.type = MSG_TYPE_SERVER;
-    sprintf(connected_msg.data, "%s%s%s%s %shas connected.%s", SERVER_INFO_STYLE, STYLE_BOLD, msg.username, COLOR_RESET, SERVER_INFO_STYLE, COLOR_RESET);
-    broadcast_message(&connected_msg, sockfd);
+    Message msg;
+    size_t offset = 0;
+    int consumed;
+
+    while ((consumed = decode_message(conn->rbuf + offset, conn->rlen - offset, conn->format, &msg)) > 0)
+    {
+        offset += consumed;
+        if (handle_client_message(conn, &msg) == -1)
+        {
+            return -1;
+        }
+    }
+    if (consumed == -1)
+    {
+        // Malformed frame, the stream can't be resynchronized
+        return -1;
+    }
+
+    // Keep the partial message for the next read
+    conn->rlen -= offset;
+    memmove(conn->rbuf, conn->rbuf + offset, conn->rlen);
+    return 0;
+}
 
-    // Main loop
+// Read everything available on the socket, since events are edge-triggered
+// Returns -1 if the connection must be closed
+int read_from_connection(Connection *conn)
+{
     while (1)
     {
-        res = receive_message(sockfd, &msg);
-        if (res == -1 || msg.type == MSG_TYPE_EXIT)
+        // The socket stays blocking for sends, so only reads are made non-blocking
+        ssize_t n = recv(conn->sockfd, conn->rbuf + conn->rlen, sizeof(conn->rbuf) - conn->rlen, MSG_DONTWAIT);
+        if (n > 0)
         {
-            printf("%s has disconnected.\n", msg.username);
-            break;
+            conn->rlen += n;
+            if (process_read_buffer(conn) == -1)
+            {
+                return -1;
+            }
         }
-        if (msg.data[0] == '/')
+        else if (n == 0)
         {
-            handle_command(sockfd, msg.data, msg.username);
+            // Peer closed the connection
+            return -1;
         }
-        else
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
         {
-            // Broadcast message to other clients
-            broadcast_message(&msg, sockfd);
+            return 0;
+        }
+        else if (errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+// Accept every pending connection on the listening socket
+void accept_connections(int epoll_fd, int server_sockfd)
+{
+    struct sockaddr_in client_addr;
+    socklen_t sin_size;
+
+    while (1)
+    {
+        sin_size = sizeof(struct sockaddr_in);
+        int new_sockfd = accept(server_sockfd, (struct sockaddr *)&client_addr, &sin_size);
+        if (new_sockfd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("accept");
+            }
+            return;
+        }
+
+        printf("Got connection from %s\n", inet_ntoa(client_addr.sin_addr));
+
+        Connection *conn = create_connection(new_sockfd);
+        if (!conn)
+        {
+            close(new_sockfd);
+            continue;
+        }
+
+        struct epoll_event ev;
+        // EPOLLOUT fires when a full socket can take the rest of the outbound queue
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_sockfd, &ev) == -1)
+        {
+            perror("epoll_ctl");
+            close_connection(conn);
         }
     }
+}
 
-    // Remove client from clients list
-    pthread_mutex_lock(&clients_mutex);
-    // Clear the waiting player if they disconnect
-    if (strcmp(clients[i].username, waiting_player) == 0)
+// Each reactor has its own epoll instance and serves the connections it accepted
+void *run_reactor(void *arg)
+{
+    int server_sockfd = (int)(intptr_t)arg;
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1)
     {
-        waiting_player[0] = '\0';
+        perror("epoll_create1");
+        exit(1);
     }
-    clients[i].sockfd = 0;
-    clients[i].username[0] = '\0';
-    pthread_mutex_unlock(&clients_mutex);
 
-    close(sockfd);
-    pthread_exit(NULL);
+    // The listening socket is identified by a NULL pointer
+    // It is shared by all the reactors, only one of them is woken up for new connections
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sockfd, &ev) == -1)
+    {
+        perror("epoll_ctl");
+        exit(1);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            Connection *conn = (Connection *)events[i].data.ptr;
+            if (conn == NULL)
+            {
+                accept_connections(epoll_fd, server_sockfd);
+                continue;
+            }
+
+            int closing = (events[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+            if (!closing && (events[i].events & EPOLLOUT))
+            {
+                flush_connection(conn);
+            }
+            if (!closing && (events[i].events & (EPOLLIN | EPOLLRDHUP)))
+            {
+                closing = read_from_connection(conn) == -1;
+            }
+
+            if (closing)
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->sockfd, NULL);
+                close_connection(conn);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Serve clients from several reactors, so commands on different games run on different cores
+void run_event_loop(int server_sockfd, int reactors)
+{
+    fcntl(server_sockfd, F_SETFL, fcntl(server_sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    for (int i = 1; i < reactors; i++)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, run_reactor, (void *)(intptr_t)server_sockfd) != 0)
+        {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+
+    // The main thread is the first reactor
+    run_reactor((void *)(intptr_t)server_sockfd);
 }
+#endif
 
-int main()
+void print_usage(const char *program)
 {
+    fprintf(stderr, "Usage: %s [options]\n"
+                    "  --threads                        Use a thread per client instead of the event loop\n"
+                    "  --reactors <count>               Number of event loop threads (default one per CPU)\n"
+                    "  --max-clients <count>            Maximum number of logged in clients (default no limit)\n"
+                    "  --max-queue <bytes>              High-water mark of each client's outbound queue (default %d)\n"
+                    "  --slow-clients <drop|disconnect> What to do when a client's queue is full (default disconnect)\n"
+                    "  --fsync <every|group|none>       When the move journal is flushed to disk (default group)\n"
+                    "  --group-commit-ms <ms>           Interval between two flushes with --fsync group (default %d)\n"
+                    "  --bot-workers <count>            Number of threads searching the moves of the bots (default 1)\n"
+                    "  --tablebase <file>               Endgame tablebase of the bots (default %s%s if it exists)\n",
+            program, DEFAULT_MAX_QUEUED_BYTES, DEFAULT_GROUP_COMMIT_MS, GAME_DIR, TABLEBASE_FILE);
+}
+
+int main(int argc, char **argv)
+{
+    // Thread-per-client is kept for comparison with the event loop
+    int use_threads = 0;
+    long reactors = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_clients = 0;
+    size_t max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES;
+    SlowClientPolicy slow_client_policy = SLOW_CLIENT_DISCONNECT;
+    FsyncPolicy fsync_policy = FSYNC_GROUP;
+    int group_commit_ms = DEFAULT_GROUP_COMMIT_MS;
+    int bot_workers = 1;
+    const char *tablebase_path = GAME_DIR TABLEBASE_FILE;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0)
+        {
+            use_threads = 1;
+        }
+        else if (strcmp(argv[i], "--reactors") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+        {
+            reactors = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+        {
+            max_clients = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--max-queue") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0)
+        {
+            max_queued_bytes = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--slow-clients") == 0 && i + 1 < argc &&
+                 (strcmp(argv[i + 1], "drop") == 0 || strcmp(argv[i + 1], "disconnect") == 0))
+        {
+            slow_client_policy = strcmp(argv[++i], "drop") == 0 ? SLOW_CLIENT_DROP : SLOW_CLIENT_DISCONNECT;
+        }
+        else if (strcmp(argv[i], "--fsync") == 0 && i + 1 < argc &&
+                 (strcmp(argv[i + 1], "every") == 0 || strcmp(argv[i + 1], "group") == 0 || strcmp(argv[i + 1], "none") == 0))
+        {
+            i++;
+            fsync_policy = strcmp(argv[i], "every") == 0 ? FSYNC_EVERY : strcmp(argv[i], "group") == 0 ? FSYNC_GROUP : FSYNC_NONE;
+        }
+        else if (strcmp(argv[i], "--group-commit-ms") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            group_commit_ms = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bot-workers") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+        {
+            bot_workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tablebase") == 0 && i + 1 < argc)
+        {
+            tablebase_path = argv[++i];
+        }
+        else
+        {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    configure_outbound_queues(max_queued_bytes, slow_client_policy);
+    registry_init(&clients, max_clients);
+    topic_init(&lobby);
+
+    // Every client takes a file descriptor, allow as many as the system does
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0 && fd_limit.rlim_cur < fd_limit.rlim_max)
+    {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
+    }
+
+    // A client leaving mid-send must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Open the user database, in the users directory
+    if (init_users() == -1)
+    {
+        exit(1);
+    }
+
     // Create games directory if it doesn't exist
     mkdir(GAME_DIR, 0755);
 
-    // Load all games from the filesystem
-    load_all_games();
+    // Load all games from the filesystem: the snapshot, or the game files of the previous versions,
+    // then the moves recorded since
+    int max_game_id = load_snapshot(GAME_DIR SNAPSHOT_FILE, &game_index);
+    if (max_game_id == -2)
+    {
+        fprintf(stderr, "Fix or remove the snapshot, the games it contains would be lost\n");
+        exit(1);
+    }
+    int from_legacy = max_game_id == -1;
+    if (from_legacy)
+    {
+        max_game_id = load_legacy_games(GAME_DIR, &game_index);
+    }
+    if (journal_init(GAME_DIR, fsync_policy, group_commit_ms, save_all_games) == -1)
+    {
+        exit(1);
+    }
+    int journal_max_game_id = journal_replay(&game_index);
+    if (journal_max_game_id > max_game_id)
+    {
+        max_game_id = journal_max_game_id;
+    }
+    next_game_id = max_game_id + 1;
+    // The replayed games, or the game files, are written to a new snapshot in the background
+    start_journal_threads(from_legacy);
+
+    // The bots play their moves in the games where it was their turn when the server stopped
+    if (load_bot_tablebase(tablebase_path) == -1 || start_bots(bot_workers, play_bot_move) == -1)
+    {
+        exit(1);
+    }
+    resume_bot_games();
 
-    int server_sockfd, new_sockfd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t sin_size;
+    int server_sockfd;
+    struct sockaddr_in server_addr;
 
     server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_sockfd == -1)
@@ -1446,7 +2021,7 @@ int main()
         exit(1);
     }
 
-    if (listen(server_sockfd, MAX_CLIENTS) == -1)
+    if (listen(server_sockfd, SOMAXCONN) == -1)
     {
         perror("listen");
         exit(1);
@@ -1454,31 +2029,18 @@ int main()
 
     printf("Server listening on port %d\n", PORT);
 
-    while (1)
+#ifdef __linux__
+    if (!use_threads)
     {
-        sin_size = sizeof(struct sockaddr_in);
-        new_sockfd = accept(server_sockfd, (struct sockaddr *)&client_addr, &sin_size);
-        if (new_sockfd == -1)
-        {
-            perror("accept");
-            continue;
-        }
-
-        printf("Got connection from %s\n", inet_ntoa(client_addr.sin_addr));
-
-        // Create a thread to handle client
-        pthread_t tid;
-        int *pclient = malloc(sizeof(int));
-        *pclient = new_sockfd;
-
-        if (pthread_create(&tid, NULL, handle_client, pclient) != 0)
-        {
-            perror("pthread_create");
-            continue;
-        }
-
-        pthread_detach(tid);
+        run_event_loop(server_sockfd, reactors > 0 ? reactors : 1);
+        return 0;
     }
+#else
+    // epoll is Linux only, always use a thread per client
+    (void)use_threads;
+    (void)reactors;
+#endif
+    run_thread_per_client(server_sockfd);
 
     return 0;
 }
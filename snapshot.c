@@ -0,0 +1,558 @@
+#include "snapshot.h"
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// FNV-1a, continued over several buffers
+static uint32_t update_checksum(uint32_t hash, const void *data, size_t len)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+    const char *bytes = (const char *)data;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, bytes, len);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        bytes += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Number of threads used to load games, each one gets at least a few thousand
+static size_t loader_threads(size_t count)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = count / 4096 + 1;
+    if (cpus > 0 && threads > (size_t)cpus)
+    {
+        threads = cpus;
+    }
+    return threads;
+}
+
+// Run a loading job on several threads, each one on a slice of the items
+typedef struct
+{
+    void (*load)(void *context, size_t start, size_t end);
+    void *context;
+    size_t start;
+    size_t end;
+    int started; // Runs on its own thread
+} LoadJob;
+
+static void *run_load_job(void *arg)
+{
+    LoadJob *job = (LoadJob *)arg;
+    job->load(job->context, job->start, job->end);
+    return NULL;
+}
+
+static void load_in_parallel(void (*load)(void *, size_t, size_t), void *context, size_t count)
+{
+    size_t threads = loader_threads(count);
+    LoadJob *jobs = (LoadJob *)malloc(threads * sizeof(LoadJob));
+    pthread_t *tids = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    if (!jobs || !tids)
+    {
+        free(jobs);
+        free(tids);
+        load(context, 0, count);
+        return;
+    }
+
+    for (size_t i = 0; i < threads; i++)
+    {
+        jobs[i].load = load;
+        jobs[i].context = context;
+        jobs[i].start = count * i / threads;
+        jobs[i].end = count * (i + 1) / threads;
+        // The calling thread takes the first slice, and the ones that didn't get a thread
+        jobs[i].started = i > 0 && pthread_create(&tids[i], NULL, run_load_job, &jobs[i]) == 0;
+    }
+    for (size_t i = 0; i < threads; i++)
+    {
+        if (!jobs[i].started)
+        {
+            load(context, jobs[i].start, jobs[i].end);
+        }
+    }
+    for (size_t i = 1; i < threads; i++)
+    {
+        if (jobs[i].started)
+        {
+            pthread_join(tids[i], NULL);
+        }
+    }
+
+    free(jobs);
+    free(tids);
+}
+
+// Add the loaded games to the index, the ones that failed to load are NULL
+// Returns the highest game ID
+static int index_games(GameIndex *index, Game **games, size_t count)
+{
+    int max_game_id = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!games[i])
+        {
+            continue;
+        }
+        add_game(index, games[i]);
+        if (games[i]->game_id > max_game_id)
+        {
+            max_game_id = games[i]->game_id;
+        }
+    }
+    return max_game_id;
+}
+
+// ========== Binary snapshots ==========
+// Write all the games to a snapshot, each one is read while holding its lock
+// The file is written next to the previous snapshot and renamed over it, so a crash never leaves half a file
+// Returns -1 if the snapshot couldn't be written
+int write_snapshot(const char *path, Game **games, size_t count)
+{
+    SnapshotGame *records = (SnapshotGame *)calloc(count ? count : 1, sizeof(SnapshotGame));
+    uint8_t *moves = NULL;
+    size_t move_count = 0;
+    size_t moves_capacity = 0;
+    if (!records)
+    {
+        perror("Failed to allocate memory for snapshot");
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        Game *game = games[i];
+        SnapshotGame *record = &records[i];
+        pthread_mutex_lock(&game->lock);
+
+        if (move_count + game->move_count > moves_capacity)
+        {
+            size_t capacity = moves_capacity ? moves_capacity : 64 * 1024;
+            while (move_count + game->move_count > capacity)
+            {
+                capacity *= 2;
+            }
+            uint8_t *grown = (uint8_t *)realloc(moves, capacity);
+            if (!grown)
+            {
+                perror("Failed to allocate memory for snapshot");
+                pthread_mutex_unlock(&game->lock);
+                free(records);
+                free(moves);
+                return -1;
+            }
+            moves = grown;
+            moves_capacity = capacity;
+        }
+
+        record->game_id = game->game_id;
+        // The file keeps the usernames, IDs are only valid in this process
+        strcpy(record->player_usernames[PLAYER1], username_of(game->players[PLAYER1]));
+        strcpy(record->player_usernames[PLAYER2], username_of(game->players[PLAYER2]));
+        record->scores[PLAYER1] = game->state.scores[PLAYER1];
+        record->scores[PLAYER2] = game->state.scores[PLAYER2];
+        for (int h = 0; h < NUM_HOLES; h++)
+        {
+            record->board[h] = game->state.board[h];
+        }
+        record->turn = game->state.turn;
+        record->status = game->status;
+        record->visibility = game->visibility;
+        record->move_count = game->move_count;
+        record->first_move = move_count;
+
+        // The history starts from the newest move, the snapshot from the oldest
+        size_t m = move_count + game->move_count;
+        for (MoveNode *node = game->move_history; node && m > move_count; node = node->next)
+        {
+            moves[--m] = SNAPSHOT_MOVE(node->player, node->hole);
+        }
+        move_count += game->move_count;
+
+        pthread_mutex_unlock(&game->lock);
+    }
+
+    SnapshotHeader header;
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.game_count = count;
+    header.move_count = move_count;
+    header.checksum = update_checksum(2166136261u, records, count * sizeof(SnapshotGame));
+    header.checksum = update_checksum(header.checksum, moves, move_count);
+
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = -1;
+    if (fd == -1)
+    {
+        perror("Failed to open snapshot for writing");
+    }
+    else if (write_all(fd, &header, sizeof(header)) == -1 ||
+             write_all(fd, records, count * sizeof(SnapshotGame)) == -1 ||
+             write_all(fd, moves, move_count) == -1 ||
+             fsync(fd) == -1)
+    {
+        perror("Failed to write snapshot");
+    }
+    else if (rename(tmp_path, path) == -1)
+    {
+        perror("Failed to replace snapshot");
+    }
+    else
+    {
+        result = 0;
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    free(records);
+    free(moves);
+    return result;
+}
+
+typedef struct
+{
+    const SnapshotGame *records;
+    const uint8_t *moves;
+    Game **games;
+} SnapshotLoad;
+
+// Build the games of a slice of the snapshot
+static void load_snapshot_games(void *context, size_t start, size_t end)
+{
+    SnapshotLoad *load = (SnapshotLoad *)context;
+    for (size_t i = start; i < end; i++)
+    {
+        const SnapshotGame *record = &load->records[i];
+        Game *game = create_game(record->game_id, intern_username(record->player_usernames[PLAYER1]),
+                                 intern_username(record->player_usernames[PLAYER2]));
+        load->games[i] = game;
+        if (!game)
+        {
+            continue;
+        }
+
+        game->state.scores[PLAYER1] = record->scores[PLAYER1];
+        game->state.scores[PLAYER2] = record->scores[PLAYER2];
+        for (int h = 0; h < NUM_HOLES; h++)
+        {
+            game->state.board[h] = record->board[h];
+        }
+        game->state.turn = record->turn;
+        game->state.hash = hash_game_state(&game->state);
+        game->status = record->status;
+        game->visibility = record->visibility;
+
+        const uint8_t *moves = load->moves + record->first_move;
+        for (uint32_t m = 0; m < record->move_count; m++)
+        {
+            add_move_to_history(game, SNAPSHOT_MOVE_PLAYER(moves[m]), SNAPSHOT_MOVE_HOLE(moves[m]));
+        }
+    }
+}
+
+// Load all the games of a snapshot, the file is mapped and its games are built on several threads
+// Returns the highest game ID, -1 if there is no snapshot, or -2 if the snapshot is corrupted
+int load_snapshot(const char *path, GameIndex *index)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        if (errno == ENOENT)
+        {
+            return -1;
+        }
+        perror("Failed to open snapshot");
+        return -2;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(SnapshotHeader))
+    {
+        fprintf(stderr, "Invalid snapshot %s\n", path);
+        close(fd);
+        return -2;
+    }
+    size_t size = st.st_size;
+    char *data = (char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        perror("Failed to map snapshot");
+        return -2;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    const SnapshotGame *records = (const SnapshotGame *)(data + sizeof(SnapshotHeader));
+    const uint8_t *moves = (const uint8_t *)(records + header.game_count);
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION ||
+        size != sizeof(SnapshotHeader) + (size_t)header.game_count * sizeof(SnapshotGame) + header.move_count ||
+        header.checksum != update_checksum(2166136261u, data + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader)))
+    {
+        fprintf(stderr, "Invalid snapshot %s\n", path);
+        munmap(data, size);
+        return -2;
+    }
+    for (size_t i = 0; i < header.game_count; i++)
+    {
+        if (records[i].first_move + records[i].move_count > header.move_count)
+        {
+            fprintf(stderr, "Invalid snapshot %s\n", path);
+            munmap(data, size);
+            return -2;
+        }
+    }
+
+    SnapshotLoad load;
+    load.records = records;
+    load.moves = moves;
+    load.games = (Game **)malloc((header.game_count ? header.game_count : 1) * sizeof(Game *));
+    if (!load.games)
+    {
+        perror("Failed to allocate memory for snapshot");
+        munmap(data, size);
+        return -2;
+    }
+    load_in_parallel(load_snapshot_games, &load, header.game_count);
+    int max_game_id = index_games(index, load.games, header.game_count);
+
+    printf("Loaded %u games from %s\n", header.game_count, path);
+    free(load.games);
+    munmap(data, size);
+    return max_game_id;
+}
+
+// ========== Legacy game files ==========
+// Write a game to its text file, the caller holds the game's lock
+// Returns -1 if the game couldn't be saved
+int save_legacy_game(const char *dir, Game *game)
+{
+    char filepath[1024];
+    char tmp_filepath[1040];
+    snprintf(filepath, sizeof(filepath), "%sgame_%d.dat", dir, game->game_id);
+    snprintf(tmp_filepath, sizeof(tmp_filepath), "%s.tmp", filepath);
+
+    FILE *fp = fopen(tmp_filepath, "w");
+    if (fp == NULL)
+    {
+        perror("Failed to open file for writing game state");
+        return -1;
+    }
+
+    fprintf(fp, "%d|%s|%s|%d|%d|%d",
+            game->game_id,
+            username_of(game->players[PLAYER1]),
+            username_of(game->players[PLAYER2]),
+            game->state.scores[PLAYER1],
+            game->state.scores[PLAYER2],
+            game->state.turn);
+
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        fprintf(fp, "|%d", game->state.board[i]);
+    }
+
+    // Append the move history to the file
+    MoveNode *node = game->move_history;
+    while (node != NULL)
+    {
+        fprintf(fp, "|%d|%d", node->player, node->hole);
+        node = node->next;
+    }
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) == -1)
+    {
+        perror("Failed to write game state");
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    if (rename(tmp_filepath, filepath) == -1)
+    {
+        perror("Failed to replace game state");
+        return -1;
+    }
+    return 0;
+}
+
+// Read a game from its text file
+// Returns NULL if the file isn't a valid game
+static Game *load_legacy_game(const char *filepath)
+{
+    FILE *fp = fopen(filepath, "r");
+    if (fp == NULL)
+    {
+        perror("Failed to open file for reading game state");
+        return NULL;
+    }
+
+    char player1[USERNAME_MAX_LEN];
+    char player2[USERNAME_MAX_LEN];
+    int game_id;
+    if (fscanf(fp, "%d|%31[^|]|%31[^|]|", &game_id, player1, player2) != 3)
+    {
+        fprintf(stderr, "Invalid game file %s\n", filepath);
+        fclose(fp);
+        return NULL;
+    }
+
+    Game *new_game = create_game(game_id, intern_username(player1), intern_username(player2));
+    if (new_game == NULL)
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    fscanf(fp, "%d|%d|%d",
+           &new_game->state.scores[PLAYER1],
+           &new_game->state.scores[PLAYER2],
+           (int *)&new_game->state.turn);
+
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        fscanf(fp, "|%d", &new_game->state.board[i]);
+    }
+    new_game->state.hash = hash_game_state(&new_game->state);
+
+    // Load move history, stored from the newest move like the list
+    MoveNode **current_node = &new_game->move_history;
+    int player, hole;
+    while (fscanf(fp, "|%d|%d", &player, &hole) == 2)
+    {
+        *current_node = (MoveNode *)malloc(sizeof(MoveNode));
+        if (!*current_node)
+        {
+            perror("Failed to allocate memory for move history");
+            break;
+        }
+        (*current_node)->player = player;
+        (*current_node)->hole = hole;
+        current_node = &(*current_node)->next;
+        new_game->move_count++;
+    }
+    *current_node = NULL;
+
+    // The status isn't stored, but a finished game has its seeds distributed
+    if (check_game_over(new_game))
+    {
+        new_game->status = status_from_scores(new_game);
+    }
+
+    fclose(fp);
+    return new_game;
+}
+
+typedef struct
+{
+    char **paths;
+    Game **games;
+} LegacyLoad;
+
+static void load_legacy_slice(void *context, size_t start, size_t end)
+{
+    LegacyLoad *load = (LegacyLoad *)context;
+    for (size_t i = start; i < end; i++)
+    {
+        load->games[i] = load_legacy_game(load->paths[i]);
+    }
+}
+
+// Load the text file of every game in a directory, on several threads
+// Returns the highest game ID, 0 if there are no games
+int load_legacy_games(const char *dir, GameIndex *index)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        perror("Failed to open directory");
+        return 0;
+    }
+
+    LegacyLoad load = {NULL, NULL};
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        // Only game files, not the journals or the files that were being written
+        size_t name_len = strlen(entry->d_name);
+        if (entry->d_type != DT_REG || strncmp(entry->d_name, "game_", 5) != 0 ||
+            name_len <= 4 || strcmp(entry->d_name + name_len - 4, ".dat") != 0)
+        {
+            continue;
+        }
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            char **paths = (char **)realloc(load.paths, capacity * sizeof(char *));
+            if (!paths)
+            {
+                perror("Failed to allocate memory for game files");
+                break;
+            }
+            load.paths = paths;
+        }
+        size_t path_len = strlen(dir) + name_len + 1;
+        load.paths[count] = (char *)malloc(path_len);
+        if (!load.paths[count])
+        {
+            perror("Failed to allocate memory for game files");
+            break;
+        }
+        snprintf(load.paths[count], path_len, "%s%s", dir, entry->d_name);
+        count++;
+    }
+    closedir(d);
+
+    int max_game_id = 0;
+    load.games = (Game **)malloc((count ? count : 1) * sizeof(Game *));
+    if (!load.games)
+    {
+        perror("Failed to allocate memory for game files");
+    }
+    else
+    {
+        load_in_parallel(load_legacy_slice, &load, count);
+        max_game_id = index_games(index, load.games, count);
+        printf("Loaded %zu game files from %s\n", count, dir);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        free(load.paths[i]);
+    }
+    free(load.paths);
+    free(load.games);
+    return max_game_id;
+}
@@ -0,0 +1,52 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "game.h"
+
+#define GAME_DIR "./games/"
+// All the games in a single binary file, in the games directory
+#define SNAPSHOT_FILE "games.snap"
+#define SNAPSHOT_MAGIC 0x534C5741 // "AWLS"
+#define SNAPSHOT_VERSION 1
+
+// Layout of a snapshot file: the header, the games, then the moves of all the games
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t game_count;
+    uint32_t checksum; // Of everything after the header
+    uint64_t move_count;
+} SnapshotHeader;
+
+typedef struct
+{
+    int32_t game_id;
+    char player_usernames[2][USERNAME_MAX_LEN];
+    int32_t scores[2];
+    uint8_t board[NUM_HOLES];
+    uint8_t turn;
+    uint8_t status;
+    uint8_t visibility;
+    uint8_t reserved;
+    uint32_t move_count;
+    uint64_t first_move; // Index of the game's first move in the move array
+} SnapshotGame;
+
+// A move is stored in a byte: the player in the high bits and the hole in the low bits
+#define SNAPSHOT_MOVE(player, hole) ((uint8_t)(((player) << 4) | (hole)))
+#define SNAPSHOT_MOVE_PLAYER(move) ((move) >> 4)
+#define SNAPSHOT_MOVE_HOLE(move) ((move) & 0x0F)
+
+// Function prototypes
+
+// Binary snapshots
+int write_snapshot(const char *path, Game **games, size_t count);
+int load_snapshot(const char *path, GameIndex *index);
+
+// Game files of the previous versions, one text file per game
+int save_legacy_game(const char *dir, Game *game);
+int load_legacy_games(const char *dir, GameIndex *index);
+
+#endif // SNAPSHOT_H
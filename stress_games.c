@@ -0,0 +1,482 @@
+// Stress test of the per-game locks of the server, over the socket protocol
+// Many games are played at the same time, and both players of each game send their moves as fast as
+// the server answers, without waiting for their turn. Some games are forfeited by their first player
+// in the middle, others just as the other player ends them. Once every game stopped, the move
+// history of each one is replayed with make_move:
+// the board, scores, turn, version and status must be those the server reports
+// A server must be listening on PORT, make stress starts one in a scratch directory
+// Usage: ./stress_games [games]
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include "game.h"
+
+#define STRESS_DEFAULT_GAMES 40
+// The usernames must stay short, so that the history of a game fits in one message
+#define STRESS_MAX_GAMES 9999
+// Moves of a game before the players stop, a few more can be played while they see it
+// The history of a game must fit in one message
+#define STRESS_MOVES 72
+// Commands sent by a player at most, most of them are refused since it isn't their turn
+#define STRESS_MAX_COMMANDS (100 * STRESS_MOVES)
+// Two games in this many are forfeited by their first player: one after a number of moves, the other
+// as soon as player 2 can end the game, which player 2 does at the same time. /forfeit and the move
+// that ends a game both take the game lock, then the index write lock. In the second kind, both
+// players capture as much as they can, so that the game ends before STRESS_MOVES
+#define STRESS_FORFEIT_EVERY 4
+#define STRESS_PASSWORD "stress"
+// Seconds without a message before a connection is given up
+#define STRESS_TIMEOUT 10
+// Tries to connect, 100 ms apart, while the server starts
+#define STRESS_CONNECT_TRIES 50
+
+typedef struct
+{
+    int index;
+    int game_id;
+    char usernames[2][USERNAME_MAX_LEN];
+    int sockfds[2];
+    int forfeit_after; // Moves played before player 1 forfeits, -1 to play on
+    int forfeit_race;  // Player 1 forfeits when player 2 can end the game, and player 2 ends it
+    PackedState start; // Board when the game started, the first player is drawn by the server
+    int forfeited;     // Player 1 sent /forfeit
+    int failed;
+    int moves;         // Moves in the history, once checked
+} StressGame;
+
+typedef struct
+{
+    StressGame *game;
+    int player;
+} StressPlayer;
+
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the socket, or -1 if the server can't be reached
+static int connect_to_server(void)
+{
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int i = 0; i < STRESS_CONNECT_TRIES; i++)
+    {
+        int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd == -1)
+        {
+            perror("Failed to create socket");
+            return -1;
+        }
+        if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == 0)
+        {
+            // A server that stops answering fails the game instead of blocking the test
+            struct timeval timeout = {STRESS_TIMEOUT, 0};
+            setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            return sockfd;
+        }
+        close(sockfd);
+        usleep(100000);
+    }
+    perror("Failed to connect to server");
+    return -1;
+}
+
+static int send_text(int sockfd, const char *username, const char *text)
+{
+    Message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = MSG_TYPE_TEXT;
+    strncpy(msg.username, username, USERNAME_MAX_LEN - 1);
+    strncpy(msg.data, text, BUFFER_SIZE - 1);
+    return send_message(sockfd, &msg, WIRE_FRAMED);
+}
+
+// Read messages until one holds text, or until a board when text is NULL
+// Returns -1 if the connection failed first
+static int wait_for(int sockfd, const char *text, Message *msg)
+{
+    while (receive_message(sockfd, msg, WIRE_FRAMED) == 0)
+    {
+        if (msg->type == MSG_TYPE_BOARD ? text == NULL : text != NULL && strstr(msg->data, text))
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Log in, creating the account the first time
+// Returns the socket, or -1 if the login failed
+static int login(const char *username)
+{
+    int sockfd = connect_to_server();
+    if (sockfd == -1)
+    {
+        return -1;
+    }
+    Message msg;
+    if (send_text(sockfd, username, "has joined") == -1 || receive_message(sockfd, &msg, WIRE_FRAMED) == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+    int created = strstr(msg.data, "Create") != NULL;
+    if (send_text(sockfd, username, STRESS_PASSWORD) == -1 ||
+        (created && (wait_for(sockfd, "Biography", &msg) == -1 || send_text(sockfd, username, "stress") == -1)) ||
+        wait_for(sockfd, "Connection successful", &msg) == -1)
+    {
+        fprintf(stderr, "%s: login failed\n", username);
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// The move of the player to move that wins the most seeds, any of them if there are several, or for
+// player 2 one that ends the game
+// Returns the hole, over is set if the move ends the game
+static int race_move(const PackedState *board, uint64_t *random, int *over)
+{
+    int moves[NUM_HOLES / 2];
+    int count = legal_moves(board, moves);
+    int best = moves[0];
+    int most = -1;
+    int ties = 0;
+    *over = 0;
+    for (int i = 0; i < count; i++)
+    {
+        PackedState after = apply_move(*board, moves[i]);
+        if (after.over && board->turn == PLAYER2)
+        {
+            *over = 1;
+            return moves[i];
+        }
+        int seeds = after.scores[board->turn] - board->scores[board->turn];
+        if (seeds > most)
+        {
+            most = seeds;
+            best = moves[i];
+            ties = 1;
+        }
+        else if (seeds == most && next_random(random) % ++ties == 0)
+        {
+            best = moves[i];
+        }
+    }
+    return best;
+}
+
+// Read a board message, returns its version
+static int read_board(const Message *msg, PackedState *board)
+{
+    uint32_t version;
+    memcpy(&version, msg->data + 4, 4);
+    // The turn, the holes and the scores come after the ID, version and status
+    initial_packed_state(board);
+    board->turn = msg->data[9];
+    memcpy(board->holes, msg->data + 10, NUM_HOLES);
+    memcpy(board->scores, msg->data + 10 + NUM_HOLES, 2);
+    return (int)ntohl(version);
+}
+
+// Send moves in the game until it ends or has STRESS_MOVES moves, waiting for an answer between two
+// of them. The answer can be the board of a move of the other player, the point is to keep both busy
+// In the games where player 1 forfeits against the last move, the players only play on their turn
+static void *play_side(void *arg)
+{
+    StressPlayer *side = (StressPlayer *)arg;
+    StressGame *game = side->game;
+    int sockfd = game->sockfds[side->player];
+    const char *username = game->usernames[side->player];
+    uint64_t random = ((uint64_t)game->index << 1 | side->player) * 0x9E3779B97F4A7C15ull + 1;
+    char command[64];
+    PackedState board = game->start;
+    int version = 0;
+    // Each player learns the end of the game from the server, so that a late forfeit is still sent
+    int over = 0;
+
+    for (int sent = 0; sent < STRESS_MAX_COMMANDS && version < STRESS_MOVES && !over; sent++)
+    {
+        // Both players see the board where player 2 can end the game
+        int ends = 0;
+        int hole = game->forfeit_race ? race_move(&board, &random, &ends) : 0;
+        command[0] = '\0';
+        if (side->player == PLAYER1 && !game->forfeited &&
+            ((game->forfeit_after >= 0 && version >= game->forfeit_after) || (ends && board.turn == PLAYER2)))
+        {
+            game->forfeited = 1;
+            sprintf(command, "/forfeit %d", game->game_id);
+        }
+        else if (!game->forfeit_race)
+        {
+            hole = side->player * (NUM_HOLES / 2) + (int)(next_random(&random) % (NUM_HOLES / 2));
+            sprintf(command, "/move %d %d", game->game_id, hole + 1);
+        }
+        else if (board.turn == side->player)
+        {
+            sprintf(command, "/move %d %d", game->game_id, hole + 1);
+        }
+        if (command[0] != '\0' && send_text(sockfd, username, command) == -1)
+        {
+            game->failed = 1;
+            return NULL;
+        }
+
+        Message msg;
+        while (1)
+        {
+            if (receive_message(sockfd, &msg, WIRE_FRAMED) == -1)
+            {
+                fprintf(stderr, "%s: no answer from the server\n", username);
+                game->failed = 1;
+                return NULL;
+            }
+            if (msg.type == MSG_TYPE_BOARD)
+            {
+                version = read_board(&msg, &board);
+                break;
+            }
+            if (strstr(msg.data, "over") || strstr(msg.data, "forfeited"))
+            {
+                over = 1;
+                break;
+            }
+            if (strstr(msg.data, "Not your turn") || strstr(msg.data, "empty"))
+            {
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Log both players in and start their game
+// Returns -1 if the game couldn't be started
+static int start_stress_game(StressGame *game)
+{
+    for (int player = PLAYER1; player <= PLAYER2; player++)
+    {
+        game->sockfds[player] = login(game->usernames[player]);
+        if (game->sockfds[player] == -1)
+        {
+            return -1;
+        }
+    }
+
+    Message msg;
+    char command[64];
+    sprintf(command, "/challenge %s", game->usernames[PLAYER2]);
+    if (send_text(game->sockfds[PLAYER1], game->usernames[PLAYER1], command) == -1 ||
+        wait_for(game->sockfds[PLAYER2], "/accept ", &msg) == -1 ||
+        sscanf(strstr(msg.data, "/accept ") + 8, "%d", &game->game_id) != 1)
+    {
+        fprintf(stderr, "%s: challenge failed\n", game->usernames[PLAYER1]);
+        return -1;
+    }
+    sprintf(command, "/accept %d", game->game_id);
+    if (send_text(game->sockfds[PLAYER2], game->usernames[PLAYER2], command) == -1 ||
+        wait_for(game->sockfds[PLAYER1], NULL, &msg) == -1 || wait_for(game->sockfds[PLAYER2], NULL, &msg) == -1)
+    {
+        fprintf(stderr, "Game %d didn't start\n", game->game_id);
+        return -1;
+    }
+    read_board(&msg, &game->start);
+    return 0;
+}
+
+// Status the server must report, from the moves that were replayed
+static GameStatus expected_status(const StressGame *game, const Game *replay, int ended)
+{
+    if (ended)
+    {
+        if (replay->state.scores[PLAYER1] == replay->state.scores[PLAYER2])
+        {
+            return DRAW;
+        }
+        return replay->state.scores[PLAYER1] > replay->state.scores[PLAYER2] ? PLAYER1_WON : PLAYER2_WON;
+    }
+    return game->forfeited ? PLAYER2_WON : ONGOING;
+}
+
+// Compare the game the server reports with a replay of its history, from another account
+// Returns -1 if they differ
+static int check_stress_game(StressGame *game)
+{
+    char username[USERNAME_MAX_LEN];
+    snprintf(username, sizeof(username), "st%dc", game->index);
+    int sockfd = login(username);
+    if (sockfd == -1)
+    {
+        return -1;
+    }
+
+    // The history comes from the newest move
+    Message msg;
+    char command[64];
+    sprintf(command, "/history %d", game->game_id);
+    if (send_text(sockfd, username, command) == -1 || wait_for(sockfd, "Move history for game", &msg) == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+    int players[2 * STRESS_MOVES];
+    int holes[2 * STRESS_MOVES];
+    int count = 0;
+    char *saveptr;
+    strtok_r(msg.data, "\n", &saveptr);
+    for (char *line = strtok_r(NULL, "\n", &saveptr); line && count < 2 * STRESS_MOVES; line = strtok_r(NULL, "\n", &saveptr))
+    {
+        char player[USERNAME_MAX_LEN];
+        int hole;
+        if (sscanf(line, "%31s played hole %d", player, &hole) != 2)
+        {
+            continue;
+        }
+        players[count] = strcmp(player, game->usernames[PLAYER1]) == 0 ? PLAYER1 : PLAYER2;
+        holes[count] = hole - 1;
+        count++;
+    }
+
+    sprintf(command, "/gameinfo %d", game->game_id);
+    Game *reported = create_game(game->game_id, NO_USERNAME, NO_USERNAME);
+    Game *replay = create_game(game->game_id, NO_USERNAME, NO_USERNAME);
+    if (!reported || !replay || send_text(sockfd, username, command) == -1 || wait_for(sockfd, NULL, &msg) == -1 ||
+        decode_game_state(msg.data, reported) == -1)
+    {
+        delete_game(reported);
+        delete_game(replay);
+        close(sockfd);
+        return -1;
+    }
+    close(sockfd);
+
+    // The first player was drawn by the server
+    if (count > 0)
+    {
+        replay->state.turn = players[count - 1];
+        replay->state.hash = hash_game_state(&replay->state);
+    }
+    int ended = 0;
+    int legal = 1;
+    for (int i = count - 1; i >= 0 && legal; i--)
+    {
+        int result = make_move(replay, players[i], holes[i]);
+        legal = result >= 0 && !ended;
+        ended = result == 1;
+    }
+
+    int same = legal && reported->move_count == count &&
+               memcmp(reported->state.board, replay->state.board, sizeof(replay->state.board)) == 0 &&
+               reported->state.scores[PLAYER1] == replay->state.scores[PLAYER1] &&
+               reported->state.scores[PLAYER2] == replay->state.scores[PLAYER2] &&
+               (count == 0 || reported->state.turn == replay->state.turn) &&
+               reported->status == expected_status(game, replay, ended);
+    if (!same)
+    {
+        fprintf(stderr, "Game %d: %d moves, scores %d-%d, status %d, against %d moves, scores %d-%d, status %d%s\n",
+                game->game_id, reported->move_count, reported->state.scores[PLAYER1], reported->state.scores[PLAYER2],
+                reported->status, count, replay->state.scores[PLAYER1], replay->state.scores[PLAYER2],
+                expected_status(game, replay, ended), legal ? "" : ", the history has an illegal move");
+    }
+    game->moves = count;
+    delete_game(reported);
+    delete_game(replay);
+    return same ? 0 : -1;
+}
+
+static void *run_stress_game(void *arg)
+{
+    StressGame *game = (StressGame *)arg;
+    if (start_stress_game(game) == -1)
+    {
+        game->failed = 1;
+        return NULL;
+    }
+
+    // Player 1 plays on this thread, player 2 on its own
+    StressPlayer sides[2] = {{game, PLAYER1}, {game, PLAYER2}};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, play_side, &sides[PLAYER2]) != 0)
+    {
+        perror("Failed to create player thread");
+        game->failed = 1;
+        return NULL;
+    }
+    play_side(&sides[PLAYER1]);
+    pthread_join(thread, NULL);
+
+    if (!game->failed && check_stress_game(game) == -1)
+    {
+        game->failed = 1;
+    }
+    close(game->sockfds[PLAYER1]);
+    close(game->sockfds[PLAYER2]);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int games = argc > 1 ? atoi(argv[1]) : STRESS_DEFAULT_GAMES;
+    if (argc > 2 || games <= 0 || games > STRESS_MAX_GAMES)
+    {
+        fprintf(stderr, "Usage: %s [games]\n", argv[0]);
+        fprintf(stderr, "  games  Up to %d, default %d\n", STRESS_MAX_GAMES, STRESS_DEFAULT_GAMES);
+        return 1;
+    }
+
+    StressGame *stress_games = (StressGame *)calloc(games, sizeof(StressGame));
+    pthread_t *threads = (pthread_t *)malloc(games * sizeof(pthread_t));
+    if (!stress_games || !threads)
+    {
+        perror("Failed to allocate memory for games");
+        return 1;
+    }
+    double start = now();
+    int started = 0;
+    for (int i = 0; i < games; i++)
+    {
+        StressGame *game = &stress_games[i];
+        game->index = i;
+        snprintf(game->usernames[PLAYER1], USERNAME_MAX_LEN, "st%da", i);
+        snprintf(game->usernames[PLAYER2], USERNAME_MAX_LEN, "st%db", i);
+        game->forfeit_after = i % STRESS_FORFEIT_EVERY == 0 ? i / STRESS_FORFEIT_EVERY % STRESS_MOVES : -1;
+        game->forfeit_race = i % STRESS_FORFEIT_EVERY == 1;
+        if (pthread_create(&threads[i], NULL, run_stress_game, game) != 0)
+        {
+            perror("Failed to create game thread");
+            break;
+        }
+        started++;
+    }
+
+    int failed = games - started;
+    long moves = 0;
+    int forfeited = 0;
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+        failed += stress_games[i].failed;
+        moves += stress_games[i].moves;
+        forfeited += stress_games[i].forfeited;
+    }
+    printf("%d games, %ld moves, %d forfeited, in %.2f s: %d wrong\n", games, moves, forfeited, now() - start, failed);
+    free(stress_games);
+    free(threads);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tablebase.h"
+
+// Binomial coefficients, enough to count the boards of up to TABLEBASE_MAX_SEEDS + 1 seeds
+#define BINOMIAL_ROWS (TABLEBASE_MAX_SEEDS + NUM_HOLES + 2)
+
+static size_t binomials[BINOMIAL_ROWS][NUM_HOLES + 1];
+static pthread_once_t binomials_once = PTHREAD_ONCE_INIT;
+
+static void init_binomials(void)
+{
+    for (int n = 0; n < BINOMIAL_ROWS; n++)
+    {
+        binomials[n][0] = 1;
+        for (int k = 1; k <= NUM_HOLES && k <= n; k++)
+        {
+            binomials[n][k] = binomials[n - 1][k - 1] + (k < n ? binomials[n - 1][k] : 0);
+        }
+    }
+}
+
+// Number of ways to put seeds in holes holes
+static size_t count_boards(int seeds, int holes)
+{
+    return seeds < 0 ? 0 : binomials[seeds + holes - 1][holes - 1];
+}
+
+// Index of the first board of a number of seeds, which is also the number of boards with fewer seeds
+size_t tablebase_layer_start(int seeds)
+{
+    pthread_once(&binomials_once, init_binomials);
+    return binomials[seeds + NUM_HOLES - 1][NUM_HOLES];
+}
+
+// Index of a board holding seeds seeds, seen by the player to move
+// The boards of a number of seeds are numbered in the lexicographic order of their holes
+size_t tablebase_index(const uint8_t *holes, int seeds)
+{
+    size_t index = tablebase_layer_start(seeds);
+    int remaining = seeds;
+    // The boards before this one with the same first i holes have fewer seeds in hole i
+    for (int i = 0; i < NUM_HOLES - 1; i++)
+    {
+        index += count_boards(remaining, NUM_HOLES - i) - count_boards(remaining - holes[i], NUM_HOLES - i);
+        remaining -= holes[i];
+    }
+    return index;
+}
+
+// Map a tablebase file
+// Returns 0 on success, -1 if there is no file, or -2 if the file is invalid
+int open_tablebase(const char *path, Tablebase *tablebase)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        if (errno == ENOENT)
+        {
+            return -1;
+        }
+        perror("Failed to open tablebase");
+        return -2;
+    }
+
+    TablebaseHeader header;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(header) ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != TABLEBASE_MAGIC || header.version != TABLEBASE_VERSION ||
+        header.max_seeds > TABLEBASE_MAX_SEEDS ||
+        (size_t)st.st_size != sizeof(header) + tablebase_layer_start(header.max_seeds + 1) * sizeof(TablebaseEntry))
+    {
+        fprintf(stderr, "Invalid tablebase %s\n", path);
+        close(fd);
+        return -2;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("Failed to map tablebase");
+        return -2;
+    }
+    tablebase->map = map;
+    tablebase->size = st.st_size;
+    tablebase->max_seeds = header.max_seeds;
+    tablebase->entries = (const TablebaseEntry *)((const char *)map + sizeof(header));
+    return 0;
+}
+
+void close_tablebase(Tablebase *tablebase)
+{
+    if (tablebase->map)
+    {
+        munmap(tablebase->map, tablebase->size);
+    }
+    tablebase->map = NULL;
+    tablebase->entries = NULL;
+    tablebase->max_seeds = 0;
+}
+
+// Look up a board, the scores don't matter
+// Returns 1 if the entry was found, 0 if the game is over or there are too many seeds on the board
+int probe_tablebase(const Tablebase *tablebase, const PackedState *state, TablebaseEntry *entry)
+{
+    if (state->over || !tablebase->entries)
+    {
+        return 0;
+    }
+    // The side of the player to move comes first
+    uint8_t holes[NUM_HOLES];
+    int first = state->turn * (NUM_HOLES / 2);
+    int seeds = 0;
+    for (int i = 0; i < NUM_HOLES; i++)
+    {
+        holes[i] = state->holes[(first + i) % NUM_HOLES];
+        seeds += holes[i];
+    }
+    if (seeds > tablebase->max_seeds)
+    {
+        return 0;
+    }
+    *entry = tablebase->entries[tablebase_index(holes, seeds)];
+    return 1;
+}
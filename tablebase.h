@@ -0,0 +1,55 @@
+#ifndef TABLEBASE_H
+#define TABLEBASE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "board.h"
+
+// Endgame tablebase: the exact outcome of every board with few seeds left, whatever the scores
+// The file is built offline by build_tablebase and mapped by the programs that probe it
+#define TABLEBASE_FILE "endgames.tb"
+#define TABLEBASE_MAGIC 0x42547741 // "AwTB"
+#define TABLEBASE_VERSION 1
+#define TABLEBASE_DEFAULT_SEEDS 12
+// Largest number of seeds the generator accepts, it needs about 40 bytes per board of the last count
+#define TABLEBASE_MAX_SEEDS 15
+// Distance of the boards of value 0, whose seeds may also stay on the board forever
+#define TABLEBASE_NO_DISTANCE 255
+
+// Layout of a tablebase file: the header, then an entry for each board of 0 to max_seeds seeds
+// Boards are seen by the player to move, whose holes come first, and are numbered by
+// tablebase_index: the boards of n seeds follow those of n - 1 seeds
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_seeds;
+    uint32_t reserved;
+} TablebaseHeader;
+
+typedef struct
+{
+    // Seeds the player to move ends up with, minus those of the opponent, counting only the seeds
+    // on the board and with both players playing their best
+    // A game that goes on forever gets none of them, those boards have a value of 0
+    int8_t value;
+    // Moves until the next capture or the end of the game, forced by the player who gets the value
+    uint8_t distance;
+} TablebaseEntry;
+
+typedef struct
+{
+    void *map;
+    size_t size;
+    int max_seeds;
+    const TablebaseEntry *entries;
+} Tablebase;
+
+// Function prototypes
+size_t tablebase_layer_start(int seeds);
+size_t tablebase_index(const uint8_t *holes, int seeds);
+int open_tablebase(const char *path, Tablebase *tablebase);
+void close_tablebase(Tablebase *tablebase);
+int probe_tablebase(const Tablebase *tablebase, const PackedState *state, TablebaseEntry *entry);
+
+#endif // TABLEBASE_H
@@ -0,0 +1,141 @@
+#include "topic.h"
+#include "connection.h"
+
+void topic_init(Topic *topic)
+{
+    pthread_mutex_init(&topic->lock, NULL);
+    topic->subscribers = NULL;
+    topic->count = 0;
+    topic->capacity = 0;
+}
+
+// Add a topic to the list kept by the connection
+// Returns -1 if the memory can't be allocated
+static int track_topic(struct Connection *conn, Topic *topic)
+{
+    if (conn->topic_count == conn->topic_capacity)
+    {
+        size_t capacity = conn->topic_capacity ? conn->topic_capacity * 2 : 4;
+        Topic **topics = (Topic **)realloc(conn->topics, capacity * sizeof(Topic *));
+        if (!topics)
+        {
+            perror("Failed to allocate memory for subscriptions");
+            return -1;
+        }
+        conn->topics = topics;
+        conn->topic_capacity = capacity;
+    }
+    conn->topics[conn->topic_count++] = topic;
+    return 0;
+}
+
+// Subscribe a connection to a topic, from the thread handling the connection
+// Returns:
+//  1 - Subscribed
+//  0 - Already subscribed
+// -1 - Error
+int topic_subscribe(Topic *topic, struct Connection *conn)
+{
+    if (is_subscribed(conn, topic))
+    {
+        return 0;
+    }
+    if (track_topic(conn, topic) == -1)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&topic->lock);
+    if (topic->count == topic->capacity)
+    {
+        int capacity = topic->capacity ? topic->capacity * 2 : 4;
+        struct Connection **subscribers = (struct Connection **)realloc(topic->subscribers, capacity * sizeof(struct Connection *));
+        if (!subscribers)
+        {
+            perror("Failed to allocate memory for subscribers");
+            pthread_mutex_unlock(&topic->lock);
+            conn->topic_count--;
+            return -1;
+        }
+        topic->subscribers = subscribers;
+        topic->capacity = capacity;
+    }
+    acquire_connection(conn);
+    topic->subscribers[topic->count++] = conn;
+    pthread_mutex_unlock(&topic->lock);
+    return 1;
+}
+
+// Unsubscribe a connection from a topic, from the thread handling the connection
+// Returns 1 if the connection was subscribed, 0 otherwise
+int topic_unsubscribe(Topic *topic, struct Connection *conn)
+{
+    size_t i = 0;
+    while (i < conn->topic_count && conn->topics[i] != topic)
+    {
+        i++;
+    }
+    if (i == conn->topic_count)
+    {
+        return 0;
+    }
+    conn->topics[i] = conn->topics[--conn->topic_count];
+
+    pthread_mutex_lock(&topic->lock);
+    for (int j = 0; j < topic->count; j++)
+    {
+        if (topic->subscribers[j] == conn)
+        {
+            // Order doesn't matter, move the last subscriber in its place
+            topic->subscribers[j] = topic->subscribers[--topic->count];
+            break;
+        }
+    }
+    if (topic->count == 0)
+    {
+        free(topic->subscribers);
+        topic->subscribers = NULL;
+        topic->capacity = 0;
+    }
+    pthread_mutex_unlock(&topic->lock);
+
+    // The caller still has its own reference
+    release_connection(conn);
+    return 1;
+}
+
+int is_subscribed(struct Connection *conn, Topic *topic)
+{
+    for (size_t i = 0; i < conn->topic_count; i++)
+    {
+        if (conn->topics[i] == topic)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Unsubscribe a connection from everything, when it is closed
+void unsubscribe_all(struct Connection *conn)
+{
+    while (conn->topic_count > 0)
+    {
+        topic_unsubscribe(conn->topics[conn->topic_count - 1], conn);
+    }
+}
+
+// Queue a publication to every subscriber of a topic but one
+// Nothing is written to the sockets until the publication ends, so the topic is only locked for the queuing
+void topic_publish(Topic *topic, struct Publication *pub, struct Connection *exclude)
+{
+    pthread_mutex_lock(&topic->lock);
+    for (int i = 0; i < topic->count; i++)
+    {
+        if (topic->subscribers[i] != exclude)
+        {
+            publish_to(pub, topic->subscribers[i]);
+        }
+    }
+    pthread_mutex_unlock(&topic->lock);
+}
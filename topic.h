@@ -0,0 +1,28 @@
+#ifndef TOPIC_H
+#define TOPIC_H
+
+#include <pthread.h>
+
+struct Connection;
+struct Publication;
+
+// Connections subscribed to a stream of messages, like the spectators of a game or the lobby
+// A message published to a topic is encoded once and the same frame is queued to every subscriber
+// Each subscriber holds a reference to its connection, in no particular order
+typedef struct Topic
+{
+    pthread_mutex_t lock;
+    struct Connection **subscribers;
+    int count;
+    int capacity;
+} Topic;
+
+// Function prototypes
+void topic_init(Topic *topic);
+int topic_subscribe(Topic *topic, struct Connection *conn);
+int topic_unsubscribe(Topic *topic, struct Connection *conn);
+int is_subscribed(struct Connection *conn, Topic *topic);
+void unsubscribe_all(struct Connection *conn);
+void topic_publish(Topic *topic, struct Publication *pub, struct Connection *exclude);
+
+#endif // TOPIC_H
@@ -1,187 +1,435 @@
 #include "user.h"
+#include "userdb.h"
+#include <dirent.h>
 #include <sys/stat.h>
 
-int load_user(const char *username, User *user)
+// Users read so far, indexed by username with open addressing (linear probing)
+static UserEntry **user_slots = NULL;
+static size_t user_capacity = 0;
+static size_t user_count = 0;
+static pthread_rwlock_t user_cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// ========== Startup ==========
+// Returns 1 if a directory holds the user files of the previous versions
+static int has_legacy_users(const char *dir)
 {
-    memset(user->username, 0, sizeof(user->username));
-    memset(user->password, 0, sizeof(user->password));
-    memset(user->biography, 0, sizeof(user->biography));
-    for (int i = 0; i < MAX_FRIENDS; i++)
+    DIR *d = opendir(dir);
+    if (!d)
+    {
+        return 0;
+    }
+    int found = 0;
+    struct dirent *entry;
+    while (!found && (entry = readdir(d)) != NULL)
     {
-        user->friends[i][0] = '\0';
+        size_t len = strlen(entry->d_name);
+        found = len > 4 && strcmp(entry->d_name + len - 4, ".dat") == 0;
     }
+    closedir(d);
+    return found;
+}
 
-    char filepath[1024];
-    snprintf(filepath, sizeof(filepath), "%s%s.dat", USER_DIR, username);
+// Open the user database, refusing to start over the accounts of the previous versions
+// Returns -1 if the users can't be loaded
+int init_users(void)
+{
+    mkdir(USER_DIR, 0755);
+    if (access(USER_DB_FILE, F_OK) != 0 && has_legacy_users(USER_DIR))
+    {
+        fprintf(stderr, "%s holds one file per user, run ./migrate_users to move them to %s\n", USER_DIR, USER_DB_FILE);
+        return -1;
+    }
+    return user_db_open(USER_DB_FILE, 1);
+}
 
-    FILE *fp = fopen(filepath, "r");
-    if (!fp)
-        return 0; // User does not exist
+// ========== User cache ==========
+// Find a cached user, must hold the cache lock
+static UserEntry *find_entry(const char *username, uint32_t hash)
+{
+    if (user_capacity == 0)
+    {
+        return NULL;
+    }
 
-    strcpy(user->username, username);
+    size_t mask = user_capacity - 1;
+    for (size_t i = hash & mask; user_slots[i] != NULL; i = (i + 1) & mask)
+    {
+        if (user_slots[i]->hash == hash && strcmp(user_slots[i]->user.username, username) == 0)
+        {
+            return user_slots[i];
+        }
+    }
+    return NULL;
+}
 
-    if (fgets(user->password, sizeof(user->password), fp) == NULL)
+// Rebuild the table with a new capacity, must hold the cache lock for writing
+// Returns -1 if the memory can't be allocated
+static int resize_user_cache(size_t capacity)
+{
+    UserEntry **slots = (UserEntry **)calloc(capacity, sizeof(UserEntry *));
+    if (!slots)
     {
-        fclose(fp);
-        return -1; // Error
+        perror("Failed to allocate memory for user cache");
+        return -1;
     }
-    // Remove any trailing newline
-    user->password[strcspn(user->password, "\n")] = '\0';
 
-    if (fgets(user->biography, sizeof(user->biography), fp) == NULL)
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < user_capacity; i++)
     {
-        fclose(fp);
-        return -1; // Error
+        if (user_slots[i] == NULL)
+        {
+            continue;
+        }
+        size_t j = user_slots[i]->hash & mask;
+        while (slots[j] != NULL)
+        {
+            j = (j + 1) & mask;
+        }
+        slots[j] = user_slots[i];
     }
-    user->biography[strcspn(user->biography, "\n")] = '\0';
 
-    // Load friends
-    for (int i = 0; i < MAX_FRIENDS; i++)
+    free(user_slots);
+    user_slots = slots;
+    user_capacity = capacity;
+    return 0;
+}
+
+// Fill a set with the IDs of a friend list of the database
+// Returns -1 on error
+static int load_id_set(uint32_t user_id, UserIdList list, IdSet *set)
+{
+    uint32_t *ids;
+    size_t count;
+    if (user_db_get_ids(user_id, list, &ids, &count) == -1)
     {
-        if (fgets(user->friends[i], sizeof(user->friends[i]), fp) == NULL)
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (idset_add(set, ids[i]) == -1)
         {
-            break;
+            free(ids);
+            return -1;
         }
-        user->friends[i][strcspn(user->friends[i], "\n")] = '\0';
     }
+    free(ids);
+    return 0;
+}
 
-    fclose(fp);
-    return 1; // Success
+static void free_entry(UserEntry *entry)
+{
+    pthread_mutex_destroy(&entry->lock);
+    idset_free(&entry->friends);
+    idset_free(&entry->followers);
+    free(entry);
 }
 
-int save_user(const User *user)
+// Create an entry for a user of the database, with its friend lists
+// Returns NULL on error
+static UserEntry *new_entry(const User *user, uint32_t hash, uint32_t user_id)
 {
-    if (access(USER_DIR, F_OK) != 0)
+    UserEntry *entry = (UserEntry *)calloc(1, sizeof(UserEntry));
+    if (!entry)
     {
-        mkdir(USER_DIR, 0755);
+        perror("Failed to allocate memory for user");
+        return NULL;
     }
+    pthread_mutex_init(&entry->lock, NULL);
+    entry->hash = hash;
+    entry->user_id = user_id;
+    entry->user = *user;
+    if (load_id_set(user_id, USER_FRIENDS, &entry->friends) == -1 ||
+        load_id_set(user_id, USER_FOLLOWERS, &entry->followers) == -1)
+    {
+        free_entry(entry);
+        return NULL;
+    }
+    return entry;
+}
 
-    char filepath[1024];
-    snprintf(filepath, sizeof(filepath), "%s%s.dat", USER_DIR, user->username);
+// Add a user to the cache, unless another thread added it first
+// Returns the cached entry, or NULL if the memory can't be allocated
+static UserEntry *add_entry(UserEntry *entry)
+{
+    pthread_rwlock_wrlock(&user_cache_lock);
+    UserEntry *existing = find_entry(entry->user.username, entry->hash);
+    if (existing)
+    {
+        pthread_rwlock_unlock(&user_cache_lock);
+        free_entry(entry);
+        return existing;
+    }
 
-    FILE *fp = fopen(filepath, "w");
-    if (!fp)
+    // Keep the load factor under 3/4
+    if ((user_count + 1) * 4 > user_capacity * 3 &&
+        resize_user_cache(user_capacity ? user_capacity * 2 : USER_CACHE_INITIAL_CAPACITY) == -1)
     {
-        perror("Failed to open user file for writing");
-        return -1;
+        pthread_rwlock_unlock(&user_cache_lock);
+        free_entry(entry);
+        return NULL;
     }
 
-    fprintf(fp, "%s\n%s\n", user->password, user->biography);
-    // add friend to file
-    for (int i = 0; i < MAX_FRIENDS; i++)
+    size_t mask = user_capacity - 1;
+    size_t i = entry->hash & mask;
+    while (user_slots[i] != NULL)
     {
-        if (strlen(user->friends[i]) > 0)
-        {
-            fprintf(fp, "%s\n", user->friends[i]);
-        }
+        i = (i + 1) & mask;
     }
-    fclose(fp);
-    return 1;
+    user_slots[i] = entry;
+    user_count++;
+    pthread_rwlock_unlock(&user_cache_lock);
+    return entry;
 }
 
-int user_exists(const char *username)
+// Find a user, reading it from the database the first time only
+// Returns:
+// 1 - Success
+// 0 - User does not exist
+// -1 - Error
+static int get_entry(const char *username, UserEntry **entry)
 {
-    char filepath[1024];
-    snprintf(filepath, sizeof(filepath), "%s%s.dat", USER_DIR, username);
+    uint32_t hash = hash_string(username);
 
-    FILE *fp = fopen(filepath, "r");
-    if (!fp)
-        return 0; // User does not exist
+    pthread_rwlock_rdlock(&user_cache_lock);
+    *entry = find_entry(username, hash);
+    pthread_rwlock_unlock(&user_cache_lock);
+    if (*entry)
+    {
+        return 1;
+    }
 
-    fclose(fp);
-    return 1; // User exists
+    // Read outside the lock, a user read twice at the same time is cached once
+    User user;
+    uint32_t user_id;
+    int found = user_db_load(username, &user, &user_id);
+    if (found != 1)
+    {
+        return found;
+    }
+    *entry = new_entry(&user, hash, user_id);
+    if (*entry)
+    {
+        *entry = add_entry(*entry);
+    }
+    return *entry ? 1 : -1;
+}
+
+// Returns the ID of a user without loading it, 0 if the user doesn't exist
+static uint32_t find_user_id(const char *username)
+{
+    uint32_t hash = hash_string(username);
+    pthread_rwlock_rdlock(&user_cache_lock);
+    UserEntry *entry = find_entry(username, hash);
+    uint32_t user_id = entry ? entry->user_id : 0;
+    pthread_rwlock_unlock(&user_cache_lock);
+    return user_id ? user_id : user_db_find_id(username);
 }
 
+// ========== Users ==========
+// Copy a user, the copy isn't updated by later changes
 // Returns:
 // 1 - Success
-// 0 - Friend already exists
+// 0 - User does not exist
 // -1 - Error
-int add_friend(const char *username, const char *friend_username)
+int load_user(const char *username, User *user)
 {
-    User user;
-    if (load_user(username, &user) != 1)
+    UserEntry *entry;
+    int found = get_entry(username, &entry);
+    if (found != 1)
     {
-        return -1; // Error
+        memset(user, 0, sizeof(User));
+        return found;
     }
 
-    // Check if friend already exists
-    for (int i = 0; i < MAX_FRIENDS; i++)
+    pthread_mutex_lock(&entry->lock);
+    *user = entry->user;
+    pthread_mutex_unlock(&entry->lock);
+    return 1;
+}
+
+// Create or replace a user
+// Returns 1 on success, -1 on error
+int save_user(const User *user)
+{
+    UserEntry *entry;
+    int found = get_entry(user->username, &entry);
+    if (found == -1)
+    {
+        return -1;
+    }
+    if (found == 0)
     {
-        if (strcmp(user.friends[i], friend_username) == 0)
+        // A new user is cached once the database has given it an ID
+        uint32_t user_id;
+        if (user_db_save(user, &user_id) != 1)
+        {
+            return -1;
+        }
+        entry = new_entry(user, hash_string(user->username), user_id);
+        if (!entry || !(entry = add_entry(entry)))
         {
-            return 0; // Friend already exists
+            return -1;
         }
+        pthread_mutex_lock(&entry->lock);
+        entry->user = *user;
+        pthread_mutex_unlock(&entry->lock);
+        return 1;
     }
 
-    // Find an empty slot to add friend
-    for (int i = 0; i < MAX_FRIENDS; i++)
+    // The cached user only changes once the database is written
+    pthread_mutex_lock(&entry->lock);
+    uint32_t user_id;
+    int saved = user_db_save(user, &user_id);
+    if (saved == 1)
+    {
+        entry->user = *user;
+    }
+    pthread_mutex_unlock(&entry->lock);
+    return saved;
+}
+
+int user_exists(const char *username)
+{
+    UserEntry *entry;
+    return get_entry(username, &entry) == 1;
+}
+
+// ========== Friends ==========
+// Friend lists are changed one at a time, so a list and the reverse list of the friend always agree
+static pthread_mutex_t friends_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Add or remove an ID in a list of a user, in the database then in the cache
+// Returns 1 if the list changed, 0 if it was already as asked, -1 on error
+static int update_list(UserEntry *entry, UserIdList list, uint32_t id, int add)
+{
+    IdSet *set = list == USER_FRIENDS ? &entry->friends : &entry->followers;
+    pthread_mutex_lock(&entry->lock);
+    int result = 0;
+    if (add && !idset_contains(set, id))
     {
-        if (strlen(user.friends[i]) == 0)
+        result = user_db_add_id(entry->user_id, list, id);
+        if (result == 1 && idset_add(set, id) == -1)
         {
-            strcpy(user.friends[i], friend_username);
-            break;
+            result = -1;
         }
     }
+    else if (!add && idset_contains(set, id))
+    {
+        result = user_db_remove_id(entry->user_id, list, id);
+        idset_remove(set, id);
+    }
+    pthread_mutex_unlock(&entry->lock);
+    return result;
+}
 
-    if (save_user(&user) != 1)
+// Returns:
+// 1 - Success
+// 0 - Friend already exists
+// -1 - Error
+int add_friend(const char *username, const char *friend_username)
+{
+    UserEntry *user_entry;
+    UserEntry *friend_entry;
+    if (get_entry(username, &user_entry) != 1 || get_entry(friend_username, &friend_entry) != 1)
     {
         return -1; // Error
     }
 
-    return 1; // Success
+    // The friend list first, a crash in between leaves the reverse list missing the user,
+    // which hides private games rather than showing them
+    pthread_mutex_lock(&friends_lock);
+    int added = update_list(user_entry, USER_FRIENDS, friend_entry->user_id, 1);
+    if (added == 1 && update_list(friend_entry, USER_FOLLOWERS, user_entry->user_id, 1) == -1)
+    {
+        added = -1;
+    }
+    pthread_mutex_unlock(&friends_lock);
+    return added;
 }
 
+// Returns:
+// 1 - Success
+// 0 - Friend not found
+// -1 - Error
 int remove_friend(const char *username, const char *friend_username)
 {
-    User user;
-    if (load_user(username, &user) != 1)
+    UserEntry *user_entry;
+    UserEntry *friend_entry;
+    if (get_entry(username, &user_entry) != 1 || get_entry(friend_username, &friend_entry) != 1)
     {
         return -1; // Error
     }
 
-    int found = 0;
-    for (int i = 0; i < MAX_FRIENDS; i++)
-    {
-        if (found)
-        {
-            // Shift friends to the left
-            strcpy(user.friends[i - 1], user.friends[i]);
-        }
-        else if (strcmp(user.friends[i], friend_username) == 0)
-        {
-            user.friends[i][0] = '\0';
-            found = 1;
-        }
-    }
-
-    if (!found)
+    // The reverse list first, for the same reason as when adding
+    pthread_mutex_lock(&friends_lock);
+    if (update_list(friend_entry, USER_FOLLOWERS, user_entry->user_id, 0) == -1)
     {
-        return 0; // Friend not found
+        pthread_mutex_unlock(&friends_lock);
+        return -1;
     }
+    int removed = update_list(user_entry, USER_FRIENDS, friend_entry->user_id, 0);
+    pthread_mutex_unlock(&friends_lock);
+    return removed;
+}
 
-    if (save_user(&user) != 1)
+// Returns 1 if friend_username is in the friend list of username
+// Looked up in the reverse list of friend_username, usually the connected user, so username isn't loaded
+int is_friend(const char *username, const char *friend_username)
+{
+    UserEntry *entry;
+    if (get_entry(friend_username, &entry) != 1)
     {
         return -1; // Error
     }
+    uint32_t user_id = find_user_id(username);
+
+    pthread_mutex_lock(&entry->lock);
+    int friend = idset_contains(&entry->followers, user_id);
+    pthread_mutex_unlock(&entry->lock);
 
-    return 1; // Success
+    return friend;
 }
 
-int is_friend(const char *username, const char *friend_username)
+// Copy the usernames of the friends of a user to a new array, to free by the caller
+// Returns 1 on success, -1 on error
+int get_friends(const char *username, char (**friends)[USERNAME_MAX_LEN], size_t *count)
 {
-    User user;
-    if (load_user(username, &user) != 1)
+    *friends = NULL;
+    *count = 0;
+    UserEntry *entry;
+    if (get_entry(username, &entry) != 1)
     {
-        return -1; // Error
+        return -1;
     }
 
-    for (int i = 0; i < MAX_FRIENDS; i++)
+    pthread_mutex_lock(&entry->lock);
+    uint32_t *ids = (uint32_t *)malloc((entry->friends.count ? entry->friends.count : 1) * sizeof(uint32_t));
+    size_t id_count = 0;
+    for (size_t i = 0; ids && i < entry->friends.capacity; i++)
     {
-        if (strcmp(user.friends[i], friend_username) == 0)
+        if (entry->friends.slots[i] != 0)
         {
-            return 1; // Friend
+            ids[id_count++] = entry->friends.slots[i];
         }
     }
+    pthread_mutex_unlock(&entry->lock);
 
-    return 0; // Not a friend
-}
\ No newline at end of file
+    *friends = (char (*)[USERNAME_MAX_LEN])malloc((id_count ? id_count : 1) * USERNAME_MAX_LEN);
+    if (!ids || !*friends)
+    {
+        perror("Failed to allocate memory for friend list");
+        free(ids);
+        free(*friends);
+        *friends = NULL;
+        return -1;
+    }
+    for (size_t i = 0; i < id_count; i++)
+    {
+        if (user_db_username(ids[i], (*friends)[*count]) == 1)
+        {
+            (*count)++;
+        }
+    }
+    free(ids);
+    return 1;
+}
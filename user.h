@@ -1,19 +1,41 @@
+#ifndef USER_H
+#define USER_H
+
+#include <stdint.h>
+#include <pthread.h>
 #include "common.h"
+#include "idset.h"
 
 #define USER_DIR "./users/"
-#define MAX_FRIENDS 100
+// Initial number of slots of the user cache, always a power of two
+#define USER_CACHE_INITIAL_CAPACITY 64
 
 typedef struct
 {
     char username[USERNAME_MAX_LEN];
     char password[1024];
     char biography[1024];
-    char friends[MAX_FRIENDS][USERNAME_MAX_LEN];
 } User;
 
+// A user kept in memory once read from the database, users are never evicted while the server runs
+typedef struct
+{
+    pthread_mutex_t lock; // Protects the record, taken after a game's lock
+    uint32_t hash;
+    uint32_t user_id;
+    User user;
+    IdSet friends;   // IDs of the user's friends
+    IdSet followers; // IDs of the users who have this user as a friend
+} UserEntry;
+
+// The functions below read and change the cached users, changes are written to the database before returning
+int init_users(void);
 int load_user(const char *username, User *user);
 int save_user(const User *user);
 int user_exists(const char *username);
 int add_friend(const char *username, const char *friend_username);
 int remove_friend(const char *username, const char *friend_username);
-int is_friend(const char *username, const char *friend_username);
\ No newline at end of file
+int is_friend(const char *username, const char *friend_username);
+int get_friends(const char *username, char (**friends)[USERNAME_MAX_LEN], size_t *count);
+
+#endif // USER_H
@@ -0,0 +1,554 @@
+#include "userdb.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The database is mapped in memory, lookups take the lock for reading
+// Writes take it for writing, since growing the file remaps it
+static int db_fd = -1;
+static char *db_map = NULL;
+static size_t db_size = 0;
+static int db_sync_writes = 1;
+static pthread_rwlock_t db_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+#define DB_HEADER ((UserDbHeader *)db_map)
+#define DB_SLOTS ((UserDbSlot *)(db_map + USER_DB_SLOTS_OFFSET))
+#define DB_INDEX ((UserIndexSlot *)(db_map + DB_HEADER->index_offset))
+#define DB_ID_TABLE USER_DB_ID_TABLE(DB_INDEX, DB_HEADER->index_capacity)
+
+static uint64_t round_to_page(uint64_t offset)
+{
+    return (offset + 4095) & ~(uint64_t)4095;
+}
+
+// Size of the index with the table of user IDs, which holds up to half as many users
+static uint64_t index_size(uint32_t capacity)
+{
+    return (uint64_t)capacity * sizeof(UserIndexSlot) + (uint64_t)(capacity / 2) * sizeof(uint32_t);
+}
+
+// Flush a part of the mapping to disk, unless writes aren't synced
+static void sync_range(const void *addr, size_t len)
+{
+    if (!db_sync_writes)
+    {
+        return;
+    }
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)addr & ~(uintptr_t)(page_size - 1);
+    if (msync((void *)start, (uintptr_t)addr + len - start, MS_SYNC) == -1)
+    {
+        perror("Failed to sync user database");
+    }
+}
+
+// Change the size of the file and map it again, must hold the lock for writing
+// Returns -1 on error, the old mapping is then kept if possible
+static int resize_db(size_t size)
+{
+    if (ftruncate(db_fd, size) == -1)
+    {
+        perror("Failed to resize user database");
+        return -1;
+    }
+    char *map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, db_fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("Failed to map user database");
+        return -1;
+    }
+    if (db_map)
+    {
+        munmap(db_map, db_size);
+    }
+    db_map = map;
+    db_size = size;
+    return 0;
+}
+
+static UserRecord *record_of(uint32_t user_id)
+{
+    return &DB_SLOTS[DB_ID_TABLE[user_id - 1]].record;
+}
+
+// Find the index slot of a username, or the empty slot where it would go
+static UserIndexSlot *find_index_slot(const char *username, uint32_t hash)
+{
+    UserIndexSlot *index = DB_INDEX;
+    size_t mask = DB_HEADER->index_capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        if (index[i].user_id == 0 ||
+            (index[i].hash == hash && strcmp(record_of(index[i].user_id)->user.username, username) == 0))
+        {
+            return &index[i];
+        }
+    }
+}
+
+// Write the index to a new place with a new capacity, then switch the header to it
+// The old index stays valid until the switch, so a crash leaves one of the two
+static int move_index(uint64_t offset, uint32_t capacity)
+{
+    uint64_t old_offset = DB_HEADER->index_offset;
+    uint32_t old_capacity = DB_HEADER->index_capacity;
+    size_t size = offset + index_size(capacity);
+    if (size < db_size)
+    {
+        size = db_size;
+    }
+    if (size != db_size && resize_db(size) == -1)
+    {
+        return -1;
+    }
+
+    UserIndexSlot *old_index = (UserIndexSlot *)(db_map + old_offset);
+    UserIndexSlot *index = (UserIndexSlot *)(db_map + offset);
+    memset(index, 0, index_size(capacity));
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_index[i].user_id == 0)
+        {
+            continue;
+        }
+        size_t j = old_index[i].hash & mask;
+        while (index[j].user_id != 0)
+        {
+            j = (j + 1) & mask;
+        }
+        index[j] = old_index[i];
+    }
+    memcpy(USER_DB_ID_TABLE(index, capacity), USER_DB_ID_TABLE(old_index, old_capacity),
+           (size_t)DB_HEADER->user_count * sizeof(uint32_t));
+    sync_range(index, index_size(capacity));
+
+    DB_HEADER->index_offset = offset;
+    DB_HEADER->index_capacity = capacity;
+    sync_range(DB_HEADER, sizeof(UserDbHeader));
+    return 0;
+}
+
+// Take a free slot, growing the file if there is none, which remaps it
+// Returns the slot number, or -1 on error
+static long allocate_slot(void)
+{
+    if (DB_HEADER->free_head != 0)
+    {
+        uint32_t slot = DB_HEADER->free_head - 1;
+        DB_HEADER->free_head = DB_SLOTS[slot].next_free;
+        sync_range(DB_HEADER, sizeof(UserDbHeader));
+        return slot;
+    }
+
+    if (DB_HEADER->slot_count == DB_HEADER->slot_capacity)
+    {
+        // The slots grow over the index, which moves past them without overlapping its old place
+        uint32_t capacity = DB_HEADER->slot_capacity * 2;
+        uint64_t offset = round_to_page(USER_DB_SLOTS_OFFSET + (uint64_t)capacity * sizeof(UserDbSlot));
+        uint64_t index_end = round_to_page(DB_HEADER->index_offset + index_size(DB_HEADER->index_capacity));
+        if (offset < index_end)
+        {
+            offset = index_end;
+        }
+        if (move_index(offset, DB_HEADER->index_capacity) == -1)
+        {
+            return -1;
+        }
+        DB_HEADER->slot_capacity = capacity;
+        sync_range(DB_HEADER, sizeof(UserDbHeader));
+    }
+
+    uint32_t slot = DB_HEADER->slot_count++;
+    sync_range(DB_HEADER, sizeof(UserDbHeader));
+    return slot;
+}
+
+static void free_slot(uint32_t slot)
+{
+    DB_SLOTS[slot].next_free = DB_HEADER->free_head;
+    sync_range(&DB_SLOTS[slot], sizeof(uint32_t));
+    DB_HEADER->free_head = slot + 1;
+    sync_range(DB_HEADER, sizeof(UserDbHeader));
+}
+
+static UserIdHead *list_head(uint32_t user_id, UserIdList list)
+{
+    UserRecord *record = record_of(user_id);
+    return list == USER_FRIENDS ? &record->friends : &record->followers;
+}
+
+// Open the database, creating it if needed
+// sync_writes makes each save durable before returning, it can be turned off for bulk loads
+// Returns -1 if the file can't be opened or isn't a valid database
+int user_db_open(const char *path, int sync_writes)
+{
+    db_sync_writes = sync_writes;
+    db_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (db_fd == -1)
+    {
+        perror("Failed to open user database");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(db_fd, &st) == -1)
+    {
+        perror("Failed to open user database");
+        close(db_fd);
+        return -1;
+    }
+
+    if (st.st_size == 0)
+    {
+        // New database
+        uint64_t index_offset = round_to_page(USER_DB_SLOTS_OFFSET + (uint64_t)USER_DB_INITIAL_SLOTS * sizeof(UserDbSlot));
+        if (resize_db(index_offset + index_size(USER_DB_INITIAL_INDEX)) == -1)
+        {
+            close(db_fd);
+            return -1;
+        }
+        memset(DB_HEADER, 0, sizeof(UserDbHeader));
+        DB_HEADER->magic = USER_DB_MAGIC;
+        DB_HEADER->version = USER_DB_VERSION;
+        DB_HEADER->slot_capacity = USER_DB_INITIAL_SLOTS;
+        DB_HEADER->index_capacity = USER_DB_INITIAL_INDEX;
+        DB_HEADER->index_offset = index_offset;
+        if (msync(db_map, db_size, MS_SYNC) == -1)
+        {
+            perror("Failed to sync user database");
+        }
+        return 0;
+    }
+
+    if (resize_db(st.st_size) == -1)
+    {
+        close(db_fd);
+        return -1;
+    }
+    const UserDbHeader *header = DB_HEADER;
+    if ((size_t)st.st_size < USER_DB_SLOTS_OFFSET || header->magic != USER_DB_MAGIC ||
+        header->version != USER_DB_VERSION || header->index_capacity == 0 ||
+        (header->index_capacity & (header->index_capacity - 1)) != 0 ||
+        (uint64_t)header->user_count * 2 > header->index_capacity ||
+        header->slot_count > header->slot_capacity ||
+        header->index_offset < USER_DB_SLOTS_OFFSET + (uint64_t)header->slot_capacity * sizeof(UserDbSlot) ||
+        header->index_offset + index_size(header->index_capacity) > (uint64_t)st.st_size)
+    {
+        fprintf(stderr, "Invalid user database %s\n", path);
+        user_db_close();
+        return -1;
+    }
+    madvise(db_map, db_size, MADV_RANDOM);
+    return 0;
+}
+
+void user_db_close(void)
+{
+    if (db_map)
+    {
+        msync(db_map, db_size, MS_SYNC);
+        munmap(db_map, db_size);
+        db_map = NULL;
+        db_size = 0;
+    }
+    if (db_fd != -1)
+    {
+        close(db_fd);
+        db_fd = -1;
+    }
+}
+
+// Returns:
+// 1 - Success
+// 0 - User does not exist
+// -1 - Error
+int user_db_load(const char *username, User *user, uint32_t *user_id)
+{
+    memset(user, 0, sizeof(User));
+    *user_id = 0;
+    if (strlen(username) >= USERNAME_MAX_LEN)
+    {
+        return 0;
+    }
+
+    uint32_t hash = hash_string(username);
+    pthread_rwlock_rdlock(&db_lock);
+    if (!db_map)
+    {
+        pthread_rwlock_unlock(&db_lock);
+        return -1;
+    }
+    UserIndexSlot *slot = find_index_slot(username, hash);
+    int found = slot->user_id != 0;
+    if (found)
+    {
+        *user = record_of(slot->user_id)->user;
+        *user_id = slot->user_id;
+    }
+    pthread_rwlock_unlock(&db_lock);
+    return found;
+}
+
+// Create or replace a user, a new user gets the next ID
+// The new version goes to another slot before its ID points to it, so a crash leaves either version
+// Returns 1 on success, -1 on error
+int user_db_save(const User *user, uint32_t *user_id)
+{
+    uint32_t hash = hash_string(user->username);
+    pthread_rwlock_wrlock(&db_lock);
+    if (!db_map)
+    {
+        pthread_rwlock_unlock(&db_lock);
+        return -1;
+    }
+
+    // Keep the load factor of the index under 1/2
+    uint32_t id = find_index_slot(user->username, hash)->user_id;
+    if (id == 0 && (DB_HEADER->user_count + 1) * 2 > DB_HEADER->index_capacity)
+    {
+        uint32_t capacity = DB_HEADER->index_capacity * 2;
+        uint64_t offset = round_to_page(DB_HEADER->index_offset + index_size(DB_HEADER->index_capacity));
+        if (move_index(offset, capacity) == -1)
+        {
+            pthread_rwlock_unlock(&db_lock);
+            return -1;
+        }
+    }
+
+    long slot = allocate_slot();
+    if (slot == -1)
+    {
+        pthread_rwlock_unlock(&db_lock);
+        return -1;
+    }
+    UserRecord *record = &DB_SLOTS[slot].record;
+    if (id != 0)
+    {
+        // The friend lists stay with the user
+        *record = *record_of(id);
+    }
+    else
+    {
+        memset(record, 0, sizeof(UserRecord));
+        record->user_id = DB_HEADER->user_count + 1;
+    }
+    record->hash = hash;
+    record->user = *user;
+    sync_range(record, sizeof(UserRecord));
+
+    if (id != 0)
+    {
+        uint32_t old_slot = DB_ID_TABLE[id - 1];
+        DB_ID_TABLE[id - 1] = slot;
+        sync_range(&DB_ID_TABLE[id - 1], sizeof(uint32_t));
+        free_slot(old_slot);
+    }
+    else
+    {
+        // The ID is taken before the name points to it, a crash in between only loses the ID
+        id = record->user_id;
+        DB_ID_TABLE[id - 1] = slot;
+        sync_range(&DB_ID_TABLE[id - 1], sizeof(uint32_t));
+        DB_HEADER->user_count++;
+        sync_range(DB_HEADER, sizeof(UserDbHeader));
+
+        UserIndexSlot *index_slot = find_index_slot(user->username, hash);
+        index_slot->hash = hash;
+        index_slot->user_id = id;
+        sync_range(index_slot, sizeof(UserIndexSlot));
+    }
+
+    pthread_rwlock_unlock(&db_lock);
+    *user_id = id;
+    return 1;
+}
+
+// Returns the ID of a user, 0 if the user doesn't exist
+uint32_t user_db_find_id(const char *username)
+{
+    if (strlen(username) >= USERNAME_MAX_LEN)
+    {
+        return 0;
+    }
+
+    uint32_t hash = hash_string(username);
+    pthread_rwlock_rdlock(&db_lock);
+    uint32_t id = db_map ? find_index_slot(username, hash)->user_id : 0;
+    pthread_rwlock_unlock(&db_lock);
+    return id;
+}
+
+// Copy the username of a user ID, username must hold USERNAME_MAX_LEN bytes
+// Returns 1 on success, 0 if there is no such user
+int user_db_username(uint32_t user_id, char *username)
+{
+    pthread_rwlock_rdlock(&db_lock);
+    int found = db_map && user_id != 0 && user_id <= DB_HEADER->user_count;
+    if (found)
+    {
+        memcpy(username, record_of(user_id)->user.username, USERNAME_MAX_LEN);
+        username[USERNAME_MAX_LEN - 1] = '\0';
+    }
+    pthread_rwlock_unlock(&db_lock);
+    return found;
+}
+
+// ========== Friend lists ==========
+// Find an ID in a list
+// Returns where it is stored, NULL if it isn't in the list
+static uint32_t *find_list_id(UserIdHead *head, uint32_t id)
+{
+    for (uint32_t i = 0; i < head->count; i++)
+    {
+        if (head->ids[i] == id)
+        {
+            return &head->ids[i];
+        }
+    }
+    for (uint32_t block = head->blocks; block != 0; block = DB_SLOTS[block - 1].block.next)
+    {
+        UserIdBlock *ids_block = &DB_SLOTS[block - 1].block;
+        for (uint32_t i = 0; i < ids_block->count; i++)
+        {
+            if (ids_block->ids[i] == id)
+            {
+                return &ids_block->ids[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+// Copy the IDs of a list to a new array, to free by the caller
+// Returns 1 on success, -1 on error
+int user_db_get_ids(uint32_t user_id, UserIdList list, uint32_t **ids, size_t *count)
+{
+    *ids = NULL;
+    *count = 0;
+    pthread_rwlock_rdlock(&db_lock);
+    if (!db_map || user_id == 0 || user_id > DB_HEADER->user_count)
+    {
+        pthread_rwlock_unlock(&db_lock);
+        return -1;
+    }
+
+    UserIdHead *head = list_head(user_id, list);
+    size_t total = head->count;
+    for (uint32_t block = head->blocks; block != 0; block = DB_SLOTS[block - 1].block.next)
+    {
+        total += DB_SLOTS[block - 1].block.count;
+    }
+    if (total > 0)
+    {
+        *ids = (uint32_t *)malloc(total * sizeof(uint32_t));
+        if (!*ids)
+        {
+            perror("Failed to allocate memory for friend list");
+            pthread_rwlock_unlock(&db_lock);
+            return -1;
+        }
+    }
+    memcpy(*ids, head->ids, head->count * sizeof(uint32_t));
+    *count = head->count;
+    for (uint32_t block = head->blocks; block != 0; block = DB_SLOTS[block - 1].block.next)
+    {
+        UserIdBlock *ids_block = &DB_SLOTS[block - 1].block;
+        memcpy(*ids + *count, ids_block->ids, ids_block->count * sizeof(uint32_t));
+        *count += ids_block->count;
+    }
+    pthread_rwlock_unlock(&db_lock);
+    return 1;
+}
+
+// Add an ID to a list, the caller knows it isn't there yet
+// The ID is written before the count that makes it part of the list
+// Returns 1 on success, -1 on error
+int user_db_add_id(uint32_t user_id, UserIdList list, uint32_t id)
+{
+    pthread_rwlock_wrlock(&db_lock);
+    if (!db_map || user_id == 0 || user_id > DB_HEADER->user_count)
+    {
+        pthread_rwlock_unlock(&db_lock);
+        return -1;
+    }
+
+    // IDs go to the record, then to the first block, a new one goes in front when it is full
+    UserIdHead *head = list_head(user_id, list);
+    uint32_t first = head->blocks;
+    if (head->count < USER_DB_INLINE_IDS)
+    {
+        head->ids[head->count] = id;
+        sync_range(&head->ids[head->count], sizeof(uint32_t));
+        head->count++;
+        sync_range(&head->count, sizeof(uint32_t));
+    }
+    else if (first != 0 && DB_SLOTS[first - 1].block.count < USER_DB_BLOCK_IDS)
+    {
+        UserIdBlock *block = &DB_SLOTS[first - 1].block;
+        block->ids[block->count] = id;
+        sync_range(&block->ids[block->count], sizeof(uint32_t));
+        block->count++;
+        sync_range(&block->count, sizeof(uint32_t));
+    }
+    else
+    {
+        long slot = allocate_slot();
+        if (slot == -1)
+        {
+            pthread_rwlock_unlock(&db_lock);
+            return -1;
+        }
+        UserIdBlock *block = &DB_SLOTS[slot].block;
+        block->next = first;
+        block->count = 1;
+        block->ids[0] = id;
+        sync_range(block, 3 * sizeof(uint32_t));
+        // Allocating may have remapped the file
+        head = list_head(user_id, list);
+        head->blocks = slot + 1;
+        sync_range(&head->blocks, sizeof(uint32_t));
+    }
+
+    pthread_rwlock_unlock(&db_lock);
+    return 1;
+}
+
+// Remove an ID from a list, by moving the last ID of the first block, or of the record, in its place
+// A crash in between leaves that ID twice, every copy of the removed ID is looked for
+// Returns 1 if the ID was removed, 0 if it wasn't in the list, -1 on error
+int user_db_remove_id(uint32_t user_id, UserIdList list, uint32_t id)
+{
+    pthread_rwlock_wrlock(&db_lock);
+    if (!db_map || user_id == 0 || user_id > DB_HEADER->user_count)
+    {
+        pthread_rwlock_unlock(&db_lock);
+        return -1;
+    }
+
+    UserIdHead *head = list_head(user_id, list);
+    int removed = 0;
+    uint32_t *found;
+    while ((found = find_list_id(head, id)) != NULL)
+    {
+        UserIdBlock *first = head->blocks != 0 ? &DB_SLOTS[head->blocks - 1].block : NULL;
+        uint32_t *last_count = first ? &first->count : &head->count;
+        uint32_t *last_ids = first ? first->ids : head->ids;
+        *found = last_ids[*last_count - 1];
+        sync_range(found, sizeof(uint32_t));
+        (*last_count)--;
+        sync_range(last_count, sizeof(uint32_t));
+        removed = 1;
+
+        if (first && first->count == 0)
+        {
+            // Drop the empty block
+            uint32_t empty = head->blocks;
+            head->blocks = first->next;
+            sync_range(&head->blocks, sizeof(uint32_t));
+            free_slot(empty - 1);
+        }
+    }
+
+    pthread_rwlock_unlock(&db_lock);
+    return removed;
+}
@@ -0,0 +1,103 @@
+#ifndef USERDB_H
+#define USERDB_H
+
+#include <stdint.h>
+#include "user.h"
+
+// All the users in a single file, in the users directory
+#define USER_DB_NAME "users.db"
+#define USER_DB_FILE USER_DIR USER_DB_NAME
+#define USER_DB_MAGIC 0x42445541 // "AUDB"
+#define USER_DB_VERSION 2
+// The slots start after the header page
+#define USER_DB_SLOTS_OFFSET 4096
+// Slots and index entries of a new database, the index capacity is always a power of two
+#define USER_DB_INITIAL_SLOTS 1024
+#define USER_DB_INITIAL_INDEX 2048
+
+// Layout of the file: the header, the slots, then the hash index followed by the table of user IDs
+// The index is moved past the slots whenever they grow, so slots never move
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t user_count; // Also the last user ID given out
+    uint32_t slot_count; // Slots handed out, free ones included
+    uint32_t slot_capacity;
+    uint32_t free_head; // First free slot plus one, 0 if there is none
+    uint32_t index_capacity;
+    uint32_t reserved;
+    uint64_t index_offset;
+} UserDbHeader;
+
+// IDs of a friend list kept in the user's record, most lists need no block
+#define USER_DB_INLINE_IDS 14
+
+// Start of a friend list: the first IDs, then a chain of blocks holding the others
+typedef struct
+{
+    uint32_t count;
+    uint32_t blocks; // First block plus one, 0 if there are none
+    uint32_t ids[USER_DB_INLINE_IDS];
+} UserIdHead;
+
+// A user and its friend lists
+typedef struct
+{
+    uint32_t hash; // Of the username
+    uint32_t user_id;
+    UserIdHead friends;   // IDs of the user's friends
+    UserIdHead followers; // IDs of the users who have this user as a friend
+    User user;
+} UserRecord;
+
+#define USER_DB_BLOCK_IDS ((sizeof(UserRecord) - 2 * sizeof(uint32_t)) / sizeof(uint32_t))
+
+// IDs of a friend list, in no particular order
+typedef struct
+{
+    uint32_t next; // Next block plus one, 0 for the last one
+    uint32_t count;
+    uint32_t ids[USER_DB_BLOCK_IDS];
+} UserIdBlock;
+
+// Slots are fixed size so that slot n is at a known offset
+typedef union
+{
+    UserRecord record;
+    UserIdBlock block;
+    uint32_t next_free; // Next free slot plus one, while the slot is free
+} UserDbSlot;
+
+// A slot of the index, open addressing with linear probing
+typedef struct
+{
+    uint32_t hash;
+    uint32_t user_id; // 0 for an empty slot
+} UserIndexSlot;
+
+// The index is followed by the slot of each user ID, so a user is found by ID or by name
+// A user is updated by writing it to a new slot, then pointing its ID to it
+#define USER_DB_ID_TABLE(index, capacity) ((uint32_t *)((index) + (capacity)))
+
+typedef enum
+{
+    USER_FRIENDS,
+    USER_FOLLOWERS
+} UserIdList;
+
+// Function prototypes
+int user_db_open(const char *path, int sync_writes);
+void user_db_close(void);
+
+int user_db_load(const char *username, User *user, uint32_t *user_id);
+int user_db_save(const User *user, uint32_t *user_id);
+uint32_t user_db_find_id(const char *username);
+int user_db_username(uint32_t user_id, char *username);
+
+// Friend lists
+int user_db_get_ids(uint32_t user_id, UserIdList list, uint32_t **ids, size_t *count);
+int user_db_add_id(uint32_t user_id, UserIdList list, uint32_t id);
+int user_db_remove_id(uint32_t user_id, UserIdList list, uint32_t id);
+
+#endif // USERDB_H